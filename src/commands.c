@@ -1,12 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "commands.h"
 #include "shell.h"
 #include "errors.h"
 #include "io.h"
+#include "walk.h"
+#include "xattr.h"
+#include "expire.h"
 
 int
 cmd_mkdir(char *argline) {
@@ -50,9 +59,23 @@ cmd_rmdir(char *argline) {
 	return EXIT_SUCCESS;
 }
 
+/*
+ * ls [pattern [count [after]]]
+ * Lists the children of the current directory matching a glob
+ * pattern, in name order. With 'count', at most that many are listed
+ * and, if there are more, the name to pass as 'after' to get the next
+ * page is printed last. The literal part the pattern starts with is
+ * looked up in the directory index, so listing a page of a large
+ * directory doesn't walk all of it.
+ */
 int
 cmd_ls(char *argline) {
+	char *args[MAX_ARG_NUM], prefix[MAX_NAME_LENGTH], *pattern = "*", *after = NULL;
 	struct node_list *nl;
+	unsigned long count = ULONG_MAX, listed = 0;
+	const char *last = NULL;
+	int arg_no;
+	size_t len;
 
 	if (shell_get_root() == NULL)
 		return E_NO_ROOT;
@@ -60,14 +83,50 @@ cmd_ls(char *argline) {
 	if (shell_get_curr_node() == NULL)
 		return E_NO_DIR;
 
-	if (shell_get_curr_node()->children_no != 0) {
-		nl = shell_get_curr_node()->childrens;
-		while (nl != NULL) {
-			printf("%s\n", nl->node->name);
-			nl = nl->next;
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+	else if (arg_no > 3) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+
+	if (arg_no > 0)
+		pattern = args[0];
+	if (arg_no > 1 && (count = strtoul(args[1], NULL, 10)) == 0) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+	if (arg_no > 2)
+		after = args[2];
+
+	len = strcspn(pattern, "*?[\\");
+	if (len >= MAX_NAME_LENGTH)
+		len = MAX_NAME_LENGTH - 1;
+	memcpy(prefix, pattern, len);
+	prefix[len] = '\0';
+
+	if (after != NULL && strcmp(after, prefix) > 0)
+		nl = node_seek_children(shell_get_curr_node(), after);
+	else nl = node_seek_children(shell_get_curr_node(), prefix);
+
+	for (; nl != NULL; nl = nl->next) {
+		if (strncmp(nl->node->name, prefix, len) != 0)
+			break;
+		if (after != NULL && strcmp(nl->node->name, after) <= 0)
+			continue;
+		if (fnmatch(pattern, nl->node->name, 0) != 0)
+			continue;
+
+		if (listed++ == count) {
+			printf("next: %s\n", last);
+			break;
 		}
+		printf("%s\n", nl->node->name);
+		last = nl->node->name;
 	}
 
+	shell_free_parsed_argline(args, arg_no);
 	return EXIT_SUCCESS;
 }
 
@@ -104,14 +163,52 @@ cmd_cd(char *argline) {
 	return EXIT_SUCCESS;
 }
 
+/*
+ * Creates the file 'path' (relative to 'base'), whose directory must
+ * already exist.
+ */
+static int
+_create_file(struct node *base, const char *path) {
+	char dir[PATH_MAX], *name;
+	struct node *father = base, *n;
+	int ret;
+
+	if (strlen(path) >= PATH_MAX)
+		return E_INVALID_NAME;
+	strcpy(dir, path);
+
+	if ((name = strrchr(dir, '/')) == NULL)
+		name = dir;
+	else {
+		*name++ = '\0';
+		if (*dir && (father = node_path_find(base, dir)) == NULL)
+			return E_DIR_NOT_FOUND;
+	}
+	if (father->type != N_DIRECTORY)
+		return E_INVALID_TYPE;
+
+	if ((n = node_create(name, N_FILE)) == NULL)
+		return E_INVALID_NAME;
+	if ((ret = node_add_child(father, n)) < 0)
+		node_delete(n);
+
+	return ret;
+}
+
+/*
+ * copyto <path> <hostfile>
+ * Replaces the content of the file <path> with the content of the
+ * host file <hostfile>. The file is created if it doesn't exist.
+ */
 int
 cmd_copyto(char *argline) {
-	char *arguments[MAX_ARG_NUM], input_file_path[255];
-	int arg_no, i;
+	char *arguments[MAX_ARG_NUM];
+	int arg_no;
+	long written;
 	FILE *input_fd;
 	KFILE knode;
 	struct stat stat;
-	void *buffer = NULL;
+	struct node *base;
 
 	if (shell_get_root() == NULL)
 		return E_NO_ROOT;
@@ -130,40 +227,49 @@ cmd_copyto(char *argline) {
 		return E_TOO_MANY_ARGS;
 	}
 
-	knode = kopen(shell_get_root_reference()->node, arguments[0]);
-	if (strlen(arguments[1]) > 255)
+	input_fd = fopen(arguments[1], "r");
+	if (input_fd == NULL) {
+		shell_free_parsed_argline(arguments, arg_no);
 		return E_CANT_GET_EXT_FILE;
+	}
 
-	strcpy(input_file_path, arguments[1]);
+	base = shell_get_root_reference()->node;
+	knode = kopen(base, arguments[0]);
+	if (knode == NULL && (written = _create_file(base, arguments[0])) == 0)
+		knode = kopen(base, arguments[0]);
 	shell_free_parsed_argline(arguments, arg_no);
 
-	if (knode == NULL)
-		return E_FILE_NOT_FOUND;
+	if (knode == NULL) {
+		fclose(input_fd);
+		return (int)written;
+	}
 
-	if (knode->node->type != N_FILE)
+	if (knode->node->type != N_FILE) {
+		fclose(input_fd);
+		kclose(knode);
 		return E_INVALID_TYPE;
+	}
 
-	input_fd = fopen(input_file_path, "r");
-	if (input_fd == NULL)
-		return E_CANT_GET_EXT_FILE;
-
-	fstat(fileno(input_fd), &stat);
-
-	buffer = (void *)calloc(1, stat.st_size + 1);
-	fread(buffer, stat.st_size, 1, input_fd);
-	kwrite(knode, buffer, stat.st_size);
+	/* the old content goes away, even if it was longer */
+	if (fstat(fileno(input_fd), &stat) < 0)
+		written = E_CANT_GET_EXT_FILE;
+	else if ((written = ktruncate(knode, 0)) == 0) {
+		written = kwritefd(knode, fileno(input_fd), stat.st_size);
+		if (written >= 0 && written < stat.st_size)
+			written = E_CANT_GET_EXT_FILE;
+	}
 
-	free(buffer);
 	fclose(input_fd);
 	kclose(knode);
 
-	return EXIT_SUCCESS;
+	return (written < 0) ? (int)written : EXIT_SUCCESS;
 }
 
 int
 cmd_writeto(char *argline) {
 	char *arguments[MAX_ARG_NUM], output_file_path[255];
 	int arg_no;
+	unsigned int read_bytes;
 	FILE *output_fd;
 	void *buffer = NULL;
 	KFILE knode;
@@ -199,10 +305,9 @@ cmd_writeto(char *argline) {
 	if (output_fd == NULL)
 		return E_CANT_GET_EXT_FILE;
 
-	/* TODO: we need a way to know how big is the node */
-	buffer = (void *)calloc(1, 500);
-	kread(knode, 500, buffer);
-	fwrite(buffer, 500, 1, output_fd);
+	buffer = (void *)malloc(CHUNK_SIZE);
+	while ((read_bytes = kread(knode, CHUNK_SIZE, buffer)) > 0)
+		fwrite(buffer, read_bytes, 1, output_fd);
 
 	free(buffer);
 	fclose(output_fd);
@@ -290,7 +395,7 @@ cmd_delete_root(char *argline) {
 	}
 
 	node_delete(deletion->node);
-	free(deletion);
+	node_list_delete(deletion);
 
 	return EXIT_SUCCESS;
 }
@@ -354,3 +459,966 @@ cmd_mkfile(char *argline) {
 
 	return EXIT_SUCCESS;
 }
+
+/*
+ * mv <path> <path>
+ * Moves or renames a file or directory. If the second path is an
+ * existing directory the node is moved into it, otherwise the last
+ * component of the second path is the new name (and an existing file
+ * with that name is atomically replaced).
+ */
+int
+cmd_mv(char *argline) {
+	char *args[MAX_ARG_NUM], *name;
+	int arg_no, ret;
+	struct node *src, *dest, *father;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+	else if (arg_no != 2) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+
+	src = node_path_find(shell_get_curr_node(), args[0]);
+	dest = node_path_find(shell_get_curr_node(), args[1]);
+
+	if (src == NULL)
+		ret = E_FILE_NOT_FOUND;
+	else if (dest != NULL && dest->type == N_DIRECTORY && dest != src)
+		ret = node_move(src, dest, NULL);
+	else {
+		name = strrchr(args[1], '/');
+		if (name == NULL) {
+			father = shell_get_curr_node();
+			name = args[1];
+		} else {
+			*name++ = '\0';
+			father = node_path_find(shell_get_curr_node(), args[1]);
+		}
+
+		if (father == NULL)
+			ret = E_DIR_NOT_FOUND;
+		else ret = node_move(src, father, name);
+	}
+
+	shell_free_parsed_argline(args, arg_no);
+	return ret;
+}
+
+/*
+ * File contents are loaded by a pool of IMPORT_READERS threads, which
+ * read host files into new chunks (see kload()) while this thread
+ * keeps walking the host tree. Only this thread, the writer, touches
+ * the tree: it gives the loaded chunks to their nodes (see kattach()).
+ * At most IMPORT_WINDOW files per reader are queued or loaded but not
+ * attached yet, which bounds the memory held by the pool.
+ */
+#define IMPORT_READERS 4
+#define IMPORT_WINDOW  8
+
+struct _import_job {
+	struct node *node;
+	char *path;
+	unsigned long size;
+	Chunk *chunks;
+	int ret;
+	struct _import_job *next;
+};
+
+/* 'error' is the first error met while loading files, if any */
+struct _import_pool {
+	pthread_t readers[IMPORT_READERS];
+	unsigned int nreaders;
+	pthread_mutex_t lock;
+	pthread_cond_t queued, loaded;
+	struct _import_job *todo, *todo_tail, *done;
+	unsigned int inflight;
+	int stop;
+	int error;
+};
+
+static void
+_import_load(struct _import_job *job) {
+	int fd;
+
+	fd = open(job->path, O_RDONLY);
+	if (fd < 0) {
+		job->ret = E_CANT_GET_EXT_FILE;
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	job->ret = kload(fd, job->size, &job->chunks);
+	close(fd);
+}
+
+static void *
+_import_reader(void *arg) {
+	struct _import_pool *pool = (struct _import_pool *)arg;
+	struct _import_job *job;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->todo == NULL && !pool->stop)
+			pthread_cond_wait(&pool->queued, &pool->lock);
+		if ((job = pool->todo) == NULL)
+			break;
+		if ((pool->todo = job->next) == NULL)
+			pool->todo_tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		_import_load(job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->next = pool->done;
+		pool->done = job;
+		pthread_cond_signal(&pool->loaded);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/*
+ * Gives a loaded file to its node. A file which can't be loaded whole
+ * is reported and its error kept in the pool.
+ */
+static void
+_import_attach(struct _import_pool *pool, struct _import_job *job) {
+	int ret = job->ret;
+
+	if (ret == 0)
+		ret = kattach(job->node, job->chunks, job->size);
+	if (ret < 0) {
+		kfree(job->chunks);
+		printf("Can't load %s\n", job->node->name);
+		if (pool->error == 0)
+			pool->error = ret;
+	}
+
+	free(job->path);
+	free(job);
+}
+
+/* Attaches the loaded files until no more than 'max' are in flight */
+static void
+_import_drain(struct _import_pool *pool, unsigned int max) {
+	struct _import_job *done, *next;
+	unsigned int attached;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->inflight > max) {
+		while (pool->done == NULL)
+			pthread_cond_wait(&pool->loaded, &pool->lock);
+		done = pool->done;
+		pool->done = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		for (attached = 0; done != NULL; done = next, attached++) {
+			next = done->next;
+			_import_attach(pool, done);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		pool->inflight -= attached;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Queues a host file to be loaded into 'node'. Without readers (none
+ * could be started) it's loaded right away.
+ */
+static int
+_import_enqueue(struct _import_pool *pool, struct node *node,
+		const char *path, unsigned long size) {
+	struct _import_job *job;
+
+	job = (struct _import_job *)calloc(1, sizeof(struct _import_job));
+	if (job == NULL || (job->path = strdup(path)) == NULL) {
+		free(job);
+		return E_CANNOT_PROCEED;
+	}
+	job->node = node;
+	job->size = size;
+
+	if (pool->nreaders == 0) {
+		_import_load(job);
+		_import_attach(pool, job);
+		return 0;
+	}
+
+	_import_drain(pool, pool->nreaders * IMPORT_WINDOW - 1);
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->todo_tail != NULL)
+		pool->todo_tail->next = job;
+	else pool->todo = job;
+	pool->todo_tail = job;
+	pool->inflight++;
+	pthread_cond_signal(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+static void
+_import_start(struct _import_pool *pool) {
+	memset(pool, 0, sizeof(struct _import_pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queued, NULL);
+	pthread_cond_init(&pool->loaded, NULL);
+
+	while (pool->nreaders < IMPORT_READERS &&
+			pthread_create(&pool->readers[pool->nreaders], NULL,
+				_import_reader, pool) == 0)
+		pool->nreaders++;
+}
+
+/* Waits for the queued files to be loaded and attached, then stops the readers */
+static void
+_import_finish(struct _import_pool *pool) {
+	unsigned int i;
+
+	_import_drain(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nreaders; i++)
+		pthread_join(pool->readers[i], NULL);
+
+	pthread_cond_destroy(&pool->loaded);
+	pthread_cond_destroy(&pool->queued);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/* Creates a new node in 'dir', returns NULL on failure */
+static struct node *
+_import_node(struct node *dir, char *name, enum node_type type) {
+	struct node *n = node_create(name, type);
+
+	if (n != NULL && node_add_child(dir, n) < 0) {
+		node_delete(n);
+		n = NULL;
+	}
+
+	return n;
+}
+
+/*
+ * Mirrors the content of the host directory 'path' in 'dir'. Entries
+ * whose name isn't a valid node name, which are neither regular files
+ * nor directories (symbolic links aren't followed), or which would be
+ * too deep in the tree are reported and skipped.
+ */
+static void
+_import_dir(struct node *dir, const char *path, int depth,
+		struct _import_pool *pool) {
+	DIR *host_dir;
+	struct dirent *entry;
+	struct stat st;
+	struct node *n;
+	char child_path[PATH_MAX];
+
+	host_dir = opendir(path);
+	if (host_dir == NULL)
+		return;
+
+	while ((entry = readdir(host_dir)) != NULL) {
+		if (!strcmp(entry->d_name, NODE_SELF) ||
+				!strcmp(entry->d_name, NODE_PARENT))
+			continue;
+
+		if (snprintf(child_path, PATH_MAX, "%s/%s", path, entry->d_name) >= PATH_MAX ||
+				lstat(child_path, &st) < 0) {
+			printf("Skipping %s/%s\n", path, entry->d_name);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode) && depth >= MAX_TREE_DEPTH)
+			printf("Skipping %s: too deep\n", child_path);
+		else if (S_ISDIR(st.st_mode)) {
+			n = node_find_children(dir, entry->d_name);
+			if (n == NULL)
+				n = _import_node(dir, entry->d_name, N_DIRECTORY);
+			if (n == NULL || n->type != N_DIRECTORY) {
+				printf("Skipping %s\n", child_path);
+				continue;
+			}
+			_import_dir(n, child_path, depth + 1, pool);
+		} else if (S_ISREG(st.st_mode)) {
+			n = _import_node(dir, entry->d_name, N_FILE);
+			if (n == NULL || _import_enqueue(pool, n, child_path, st.st_size) < 0)
+				printf("Skipping %s\n", child_path);
+		} else if (S_ISLNK(st.st_mode))
+			printf("Skipping %s: symbolic link\n", child_path);
+		else printf("Skipping %s: special file\n", child_path);
+	}
+
+	closedir(host_dir);
+}
+
+/*
+ * import <hostdir> <name>
+ * Creates the directory <name> in the current directory (or reuses it
+ * if it already exists) and mirrors the host directory tree in it.
+ */
+int
+cmd_import(char *argline) {
+	char *args[MAX_ARG_NUM];
+	int arg_no, ret = EXIT_SUCCESS;
+	struct node *dir;
+	struct stat st;
+	struct _import_pool pool;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+	else if (arg_no != 2) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+
+	if (stat(args[0], &st) < 0 || !S_ISDIR(st.st_mode)) {
+		ret = E_CANT_GET_EXT_FILE;
+		goto out;
+	}
+
+	dir = node_find_children(shell_get_curr_node(), args[1]);
+	if (dir == NULL) {
+		dir = node_create(args[1], N_DIRECTORY);
+		if (dir == NULL) {
+			ret = E_INVALID_NAME;
+			goto out;
+		}
+		ret = node_add_child(shell_get_curr_node(), dir);
+		if (ret < 0) {
+			node_delete(dir);
+			goto out;
+		}
+	} else if (dir->type != N_DIRECTORY) {
+		ret = E_INVALID_TYPE;
+		goto out;
+	}
+
+	_import_start(&pool);
+	_import_dir(dir, args[0], 1, &pool);
+	_import_finish(&pool);
+	ret = pool.error;
+
+out:
+	shell_free_parsed_argline(args, arg_no);
+	return ret;
+}
+
+/*
+ * bind <name> <hostfile>
+ * Creates the file <name> in the current directory, whose content is
+ * read from <hostfile> the first time it's needed.
+ */
+int
+cmd_bind(char *argline) {
+	char *args[MAX_ARG_NUM];
+	int arg_no, ret;
+	struct node *n;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+	else if (arg_no != 2) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+
+	n = node_create(args[0], N_FILE);
+	if (n == NULL) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_NAME;
+	}
+
+	ret = kbind(n, args[1]);
+	shell_free_parsed_argline(args, arg_no);
+	if (ret == 0)
+		ret = node_add_child(shell_get_curr_node(), n);
+	if (ret < 0)
+		node_delete(n);
+
+	return ret;
+}
+
+/*
+ * cachelimit <megabytes>
+ * Sets how much memory chunks filled from host files can take before
+ * the least recently used ones are dropped (0 means no limit).
+ */
+int
+cmd_cache_limit(char *argline) {
+	char *end;
+	unsigned long megabytes;
+
+	if (!*argline)
+		return E_INVALID_SYNTAX;
+
+	megabytes = strtoul(argline, &end, 10);
+	if (*end)
+		return E_INVALID_SYNTAX;
+
+	kcache_set_limit(megabytes * 1024 * 1024);
+	return EXIT_SUCCESS;
+}
+
+static const char *_huge_policies[] = { "none", "thp", "hugetlb", NULL };
+static const char *_numa_policies[] = { "firsttouch", "local", "interleave", NULL };
+
+/* Returns the index of 'name' in a NULL terminated list, or -1 */
+static int
+_policy_index(const char **names, const char *name) {
+	int i;
+
+	for (i = 0; names[i] != NULL; i++) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * mempolicy [<none|thp|hugetlb> <firsttouch|local|interleave>]
+ * Sets where the memory of new file chunks comes from, or prints how
+ * many bytes are allocated per placement and per NUMA node.
+ */
+int
+cmd_mempolicy(char *argline) {
+	char *args[MAX_ARG_NUM];
+	int arg_no, huge, numa;
+	unsigned int i;
+	struct kalloc_stats stats;
+
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+
+	if (arg_no == 0) {
+		kalloc_get_stats(&stats);
+		printf("heap %lu, mapped %lu, thp %lu, hugetlb %lu, interleaved %lu\n",
+				stats.heap_bytes, stats.mapped_bytes, stats.thp_bytes,
+				stats.hugetlb_bytes, stats.interleaved_bytes);
+		for (i = 0; i < stats.nodes; i++)
+			printf("node %u: %lu\n", i, stats.node_bytes[i]);
+		return EXIT_SUCCESS;
+	}
+
+	if (arg_no != 2) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+
+	huge = _policy_index(_huge_policies, args[0]);
+	numa = _policy_index(_numa_policies, args[1]);
+	shell_free_parsed_argline(args, arg_no);
+
+	if (huge < 0 || numa < 0)
+		return E_INVALID_SYNTAX;
+
+	return kalloc_set_policy(huge, numa);
+}
+
+/*
+ * quota [<megabytes> <nodes> [priority]]
+ * Limits the size and the number of nodes of the current root (0 means
+ * no limit) and sets the eviction priority of its cached chunks, or
+ * prints the current limits and usage.
+ */
+int
+cmd_quota(char *argline) {
+	char *args[MAX_ARG_NUM], *end;
+	int arg_no, valid = 0;
+	unsigned long megabytes = 0, nodes = 0, priority = KCACHE_DEFAULT_PRIORITY;
+	struct node *root;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+	root = shell_get_root()->node;
+
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+
+	if (arg_no == 0) {
+		if (root->quota != NULL)
+			printf("limit %lu bytes, %lu nodes, priority %u\n",
+					root->quota->max_bytes, root->quota->max_nodes,
+					root->quota->priority);
+		printf("used %lu bytes, %lu nodes\n", root->tree_bytes,
+				root->tree_files + root->tree_dirs);
+		return EXIT_SUCCESS;
+	}
+
+	if (arg_no == 2 || arg_no == 3) {
+		megabytes = strtoul(args[0], &end, 10);
+		valid = !*end;
+		nodes = strtoul(args[1], &end, 10);
+		valid = valid && !*end;
+		if (arg_no == 3) {
+			priority = strtoul(args[2], &end, 10);
+			valid = valid && !*end;
+		}
+	}
+	shell_free_parsed_argline(args, arg_no);
+
+	if (!valid || priority >= KCACHE_PRIORITIES)
+		return E_INVALID_SYNTAX;
+
+	return node_set_quota(root, megabytes * 1024 * 1024, nodes, priority);
+}
+
+/*
+ * clone <path> <name>
+ * Creates <name> in the current directory as a copy of <path>. File
+ * contents are shared until they're modified, so it's cheap even for
+ * huge trees.
+ */
+int
+cmd_clone(char *argline) {
+	char *args[MAX_ARG_NUM];
+	int arg_no, ret;
+	struct node *src, *n = NULL;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+	else if (arg_no != 2) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+
+	src = node_path_find(shell_get_curr_node(), args[0]);
+	if (src == NULL)
+		ret = E_FILE_NOT_FOUND;
+	else if (node_find_children(shell_get_curr_node(), args[1]) != NULL)
+		ret = E_NAME_EXISTS;
+	else if ((n = node_clone(src, args[1])) == NULL)
+		ret = E_INVALID_NAME;
+	else ret = node_add_child(shell_get_curr_node(), n);
+
+	shell_free_parsed_argline(args, arg_no);
+	return ret;
+}
+
+/*
+ * du [path]
+ * Prints the total size and the number of files and directories below
+ * <path> (or the current directory).
+ */
+int
+cmd_du(char *argline) {
+	struct node *node;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	node = node_path_find(shell_get_curr_node(), argline);
+	if (node == NULL)
+		return E_FILE_NOT_FOUND;
+
+	/* totals are kept up to date by the node itself */
+	printf("%lu bytes, %lu files, %lu directories\n",
+			node->tree_bytes, node->tree_files, node->tree_dirs);
+
+	return EXIT_SUCCESS;
+}
+
+/* matches found by each find worker */
+struct _find_matches {
+	struct node **nodes;
+	unsigned int count, capacity;
+};
+
+struct _find_state {
+	const char *pattern;
+	struct _find_matches matches[WALK_MAX_THREADS];
+};
+
+static void
+_find_add(struct _find_matches *m, struct node *node) {
+	if (m->count == m->capacity) {
+		m->capacity = m->capacity ? m->capacity * 2 : 64;
+		m->nodes = (struct node **)realloc(m->nodes, m->capacity * sizeof(struct node *));
+	}
+	m->nodes[m->count++] = node;
+}
+
+static void
+_find_visit(struct node *node, unsigned int worker, void *arg) {
+	struct _find_state *state = (struct _find_state *)arg;
+
+	if (fnmatch(state->pattern, node->name, 0) == 0)
+		_find_add(&state->matches[worker], node);
+}
+
+static int
+_find_path_cmp(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Prints the paths (relative to 'curr') of the nodes collected by the
+ * walk workers in alphabetical order, and frees them. Returns how
+ * many they were.
+ */
+static unsigned int
+_find_print(struct node *curr, struct _find_matches *matches) {
+	char **paths, path[MAX_NAME_LENGTH * MAX_TREE_DEPTH];
+	unsigned int i, j, total = 0;
+
+	for (i = 0; i < WALK_MAX_THREADS; i++)
+		total += matches[i].count;
+
+	paths = (char **)malloc((total + 1) * sizeof(char *));
+	for (i = 0, total = 0; i < WALK_MAX_THREADS; i++) {
+		for (j = 0; j < matches[i].count; j++)
+			if (walk_path(curr, matches[i].nodes[j], path, sizeof(path)) >= 0)
+				paths[total++] = strdup(path);
+		free(matches[i].nodes);
+	}
+
+	qsort(paths, total, sizeof(char *), _find_path_cmp);
+	for (i = 0; i < total; i++) {
+		printf("%s\n", paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+
+	return total;
+}
+
+/*
+ * find <pattern>
+ * Prints the path of every node below the current directory whose
+ * name matches the shell wildcard <pattern>, in alphabetical order.
+ */
+int
+cmd_find(char *argline) {
+	struct _find_state state;
+	struct node *curr;
+	int ret;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if ((curr = shell_get_curr_node()) == NULL)
+		return E_NO_DIR;
+
+	if (!*argline)
+		return E_INVALID_SYNTAX;
+
+	memset(&state, 0, sizeof(state));
+	state.pattern = argline;
+	ret = walk_parallel(curr, _find_visit, &state, walk_threads());
+	_find_print(curr, state.matches);
+
+	return ret;
+}
+
+struct _verify_state {
+	unsigned long files[WALK_MAX_THREADS];
+	struct _find_matches corrupted[WALK_MAX_THREADS];
+};
+
+static void
+_verify_visit(struct node *node, unsigned int worker, void *arg) {
+	struct _verify_state *state = (struct _verify_state *)arg;
+
+	if (node->type != N_FILE)
+		return;
+
+	state->files[worker]++;
+	if (kverify(node) == E_CHECKSUM)
+		_find_add(&state->corrupted[worker], node);
+}
+
+/*
+ * verify [path]
+ * Checks every file below <path> (or the current directory) against
+ * its checksums, and prints the files whose content is corrupted.
+ */
+int
+cmd_verify(char *argline) {
+	struct _verify_state state;
+	struct node *node;
+	unsigned long files = 0;
+	unsigned int i, corrupted;
+	int ret;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	node = node_path_find(shell_get_curr_node(), argline);
+	if (node == NULL)
+		return E_FILE_NOT_FOUND;
+
+	memset(&state, 0, sizeof(state));
+	if ((ret = walk_parallel(node, _verify_visit, &state, walk_threads())) != 0)
+		return ret;
+
+	for (i = 0; i < WALK_MAX_THREADS; i++)
+		files += state.files[i];
+	corrupted = _find_print(node, state.corrupted);
+	printf("%lu files, %u corrupted\n", files, corrupted);
+
+	return (corrupted > 0) ? E_CHECKSUM : EXIT_SUCCESS;
+}
+
+static void
+_tree_print(struct node *node, int depth) {
+	struct node_list *nl;
+
+	printf("%*s%s%s\n", depth * 2, "", node->name,
+			(node->type == N_DIRECTORY) ? "/" : "");
+
+	for (nl = node->childrens; nl != NULL; nl = nl->next)
+		_tree_print(nl->node, depth + 1);
+}
+
+/*
+ * tree [path]
+ * Prints the whole subtree below <path> (or the current directory)
+ */
+int
+cmd_tree(char *argline) {
+	struct node *node;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	node = node_path_find(shell_get_curr_node(), argline);
+	if (node == NULL)
+		return E_FILE_NOT_FOUND;
+
+	_tree_print(node, 0);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * xattr <path> [key[=value]]
+ * Prints the attributes of <path>, or the value of one of them. With
+ * "key=value" the attribute is set, with "key=" it's removed.
+ */
+int
+cmd_xattr(char *argline) {
+	char *args[MAX_ARG_NUM], *value;
+	const char *key;
+	int arg_no, ret = EXIT_SUCCESS;
+	struct node *node;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+	else if (arg_no != 1 && arg_no != 2) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+
+	node = node_path_find(shell_get_curr_node(), args[0]);
+	if (node == NULL)
+		ret = E_FILE_NOT_FOUND;
+	else if (arg_no == 1) {
+		for (key = node_nextxattr(node, NULL); key != NULL; key = node_nextxattr(node, key))
+			printf("%s=%s\n", key, node_getxattr(node, key));
+	} else if ((value = strchr(args[1], '=')) == NULL) {
+		if ((key = node_getxattr(node, args[1])) != NULL)
+			printf("%s\n", key);
+		else ret = E_NO_ATTR;
+	} else {
+		*value++ = '\0';
+		if (*value)
+			ret = node_setxattr(node, args[1], value);
+		else ret = node_removexattr(node, args[1]);
+	}
+
+	shell_free_parsed_argline(args, arg_no);
+	return ret;
+}
+
+/*
+ * index <key> [value]
+ * index <key> before <number>
+ * Indexes the attribute <key> in every root, or prints the path of
+ * the nodes below the current directory whose <key> is <value> (or a
+ * number lower than <number>), using the index instead of walking the
+ * tree.
+ */
+int
+cmd_index(char *argline) {
+	char *args[MAX_ARG_NUM], *end;
+	int arg_no, valid, ret = EXIT_SUCCESS;
+	unsigned long number = 0;
+	struct node_list *nl;
+	struct _find_matches matches[WALK_MAX_THREADS];
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+	if (arg_no == 3) {
+		number = strtoul(args[2], &end, 10);
+		valid = strcmp(args[1], "before") == 0 && *args[2] && !*end;
+	} else valid = (arg_no == 1 || arg_no == 2);
+	if (!valid) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+
+	if (arg_no == 1) {
+		for (nl = shell_get_root_reference(); nl != NULL && ret == EXIT_SUCCESS; nl = nl->next)
+			ret = xattr_index_create(args[0], nl->node);
+	} else {
+		if (arg_no == 2)
+			ret = xattr_index_find(args[0], args[1], shell_get_curr_node(), NULL, 0);
+		else ret = xattr_index_before(args[0], number, shell_get_curr_node(), NULL, 0);
+
+		if (ret >= 0) {
+			memset(matches, 0, sizeof(matches));
+			matches[0].capacity = matches[0].count = ret;
+			matches[0].nodes = (struct node **)malloc((ret + 1) * sizeof(struct node *));
+			if (arg_no == 2)
+				xattr_index_find(args[0], args[1], shell_get_curr_node(), matches[0].nodes, ret);
+			else xattr_index_before(args[0], number, shell_get_curr_node(), matches[0].nodes, ret);
+			_find_print(shell_get_curr_node(), matches);
+			ret = EXIT_SUCCESS;
+		}
+	}
+
+	shell_free_parsed_argline(args, arg_no);
+	return ret;
+}
+
+/*
+ * rm <path>
+ * Deletes a file or a directory, with everything below it.
+ */
+int
+cmd_rm(char *argline) {
+	struct node *node, *n;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	if (!*argline)
+		return E_INVALID_SYNTAX;
+
+	node = node_path_find(shell_get_curr_node(), argline);
+	if (node == NULL)
+		return E_FILE_NOT_FOUND;
+	if (node->father == NULL)
+		return E_CONSTRAINT_VIOLATED;
+	if (node->father->readonly)
+		return E_READ_ONLY;
+
+	/* the current directory can't go away */
+	for (n = shell_get_curr_node(); n != NULL; n = n->father)
+		if (n == node)
+			return E_CONSTRAINT_VIOLATED;
+
+	node_delete_child(node->father, node);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * ttl <path> [seconds]
+ * Makes <path> expire (and be deleted, with everything below it) in
+ * <seconds>, 0 meaning never, or prints how many seconds it has left.
+ */
+int
+cmd_ttl(char *argline) {
+	char *args[MAX_ARG_NUM], *end;
+	int arg_no, ret = EXIT_SUCCESS;
+	unsigned long seconds, now;
+	struct node *node;
+
+	if (shell_get_root() == NULL)
+		return E_NO_ROOT;
+
+	if (shell_get_curr_node() == NULL)
+		return E_NO_DIR;
+
+	arg_no = shell_parse_argline(argline, args);
+	if (arg_no < 0)
+		return arg_no;
+	else if (arg_no != 1 && arg_no != 2) {
+		shell_free_parsed_argline(args, arg_no);
+		return E_INVALID_SYNTAX;
+	}
+
+	node = node_path_find(shell_get_curr_node(), args[0]);
+	if (node == NULL)
+		ret = E_FILE_NOT_FOUND;
+	else if (arg_no == 1) {
+		now = expire_now();
+		if (node->timer == NULL)
+			printf("never\n");
+		else printf("%lu\n", (node->timer->expires > now) ? node->timer->expires - now : 0);
+	} else {
+		seconds = strtoul(args[1], &end, 10);
+		if (*end)
+			ret = E_INVALID_SYNTAX;
+		else if (node->father == NULL)
+			ret = E_CONSTRAINT_VIOLATED;
+		else ret = node_set_ttl(node, seconds);
+	}
+
+	shell_free_parsed_argline(args, arg_no);
+	return ret;
+}
@@ -1,13 +1,28 @@
+int cmd_bind(char *);
+int cmd_cache_limit(char *);
 int cmd_cd(char *);
+int cmd_clone(char *);
 int cmd_copyto(char *);
 int cmd_writeto(char *);
 int cmd_create_root(char *);
 int cmd_delete_root(char *);
+int cmd_du(char *);
+int cmd_find(char *);
 int cmd_list_root(char *);
 int cmd_mkdir(char *);
+int cmd_rm(char *);
 int cmd_rmdir(char *);
 int cmd_get_root(char *);
+int cmd_import(char *);
+int cmd_index(char *);
 int cmd_ls(char *);
+int cmd_mempolicy(char *);
 int cmd_set_root(char *);
 int cmd_mkfile(char *);
+int cmd_mv(char *);
+int cmd_quota(char *);
+int cmd_tree(char *);
+int cmd_ttl(char *);
+int cmd_verify(char *);
+int cmd_xattr(char *);
 
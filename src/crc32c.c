@@ -0,0 +1,248 @@
+#include <string.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HAVE_CRC_INSN
+#endif
+
+#include "crc32c.h"
+
+/* reversed Castagnoli polynomial */
+#define POLY 0x82F63B78u
+
+/*
+ * Tables for the software version (slice by 8) and x^(2^n) modulo the
+ * polynomial for crc32c_shift(). Filled before main() runs.
+ */
+static uint32_t _table[8][256];
+static uint32_t _x2n[32];
+
+/* the versions of crc32c_update()/crc32c_delta() picked for this CPU */
+static uint32_t _update_sw(uint32_t, const void *, size_t);
+static uint32_t _delta_sw(const void *, const void *, size_t);
+#ifdef HAVE_CRC_INSN
+__attribute__((target("sse4.2"))) static uint32_t _update_hw(uint32_t, const void *, size_t);
+__attribute__((target("sse4.2"))) static uint32_t _delta_hw(const void *, const void *, size_t);
+#endif
+static uint32_t (*_update_impl)(uint32_t, const void *, size_t) = _update_sw;
+static uint32_t (*_delta_impl)(const void *, const void *, size_t) = _delta_sw;
+
+/* Multiplies a and b modulo the polynomial (bit reversed) */
+static uint32_t
+_multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = 1u << 31, p = 0;
+
+	while (m != 0) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ POLY : b >> 1;
+	}
+
+	return p;
+}
+
+__attribute__((constructor)) static void
+_crc32c_init(void) {
+	uint32_t crc, p;
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+		_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			_table[k][i] = (_table[k - 1][i] >> 8) ^ _table[0][_table[k - 1][i] & 0xff];
+
+	/* x^1, then squared over and over */
+	p = 1u << 30;
+	_x2n[0] = p;
+	for (i = 1; i < 32; i++)
+		_x2n[i] = p = _multmodp(p, p);
+
+#ifdef HAVE_CRC_INSN
+	/* constructors may run before the CPU model is known */
+	__builtin_cpu_init();
+#endif
+	_crc32c_use_hw(1);
+}
+
+/*
+ * The CRC32 instruction of SSE 4.2 is used when the CPU has it, which
+ * is checked at run time (see _crc32c_init()), so that the same binary
+ * runs everywhere. Both versions are built from the same loops below,
+ * inlined in a function compiled for the right instruction set.
+ */
+#ifdef HAVE_CRC_INSN
+__attribute__((target("sse4.2"))) static inline uint32_t
+_crc_u64_hw(uint32_t crc, uint64_t v) {
+	return (uint32_t)_mm_crc32_u64(crc, v);
+}
+
+__attribute__((target("sse4.2"))) static inline uint32_t
+_crc_u8_hw(uint32_t crc, unsigned char v) {
+	return _mm_crc32_u8(crc, v);
+}
+#endif
+
+static inline uint32_t
+_crc_u64_sw(uint32_t crc, uint64_t v) {
+	v ^= crc;
+	return _table[7][v & 0xff] ^ _table[6][(v >> 8) & 0xff] ^
+		_table[5][(v >> 16) & 0xff] ^ _table[4][(v >> 24) & 0xff] ^
+		_table[3][(v >> 32) & 0xff] ^ _table[2][(v >> 40) & 0xff] ^
+		_table[1][(v >> 48) & 0xff] ^ _table[0][v >> 56];
+}
+
+static inline uint32_t
+_crc_u8_sw(uint32_t crc, unsigned char v) {
+	return (crc >> 8) ^ _table[0][(crc ^ v) & 0xff];
+}
+
+/*
+ * Feeds 'n' zero bytes to a register: multiplies it by x^(8n), using
+ * the binary expansion of n.
+ */
+uint32_t
+crc32c_shift(uint32_t crc, size_t n) {
+	unsigned int k = 3;
+
+	for (; n != 0 && crc != 0; n >>= 1, k++)
+		if (n & 1)
+			crc = _multmodp(_x2n[k & 31], crc);
+
+	return crc;
+}
+
+/* Blocks of at least this size are split in three independent streams */
+#define STREAM_MIN 3072
+
+#ifdef HAVE_CRC_INSN
+#define CRC_U64(hw, crc, v) ((hw) ? _crc_u64_hw(crc, v) : _crc_u64_sw(crc, v))
+#define CRC_U8(hw, crc, v)  ((hw) ? _crc_u8_hw(crc, v) : _crc_u8_sw(crc, v))
+#else
+#define CRC_U64(hw, crc, v) _crc_u64_sw(crc, v)
+#define CRC_U8(hw, crc, v)  _crc_u8_sw(crc, v)
+#endif
+
+/* 'hw' is a constant in every caller, only one branch is left */
+static inline __attribute__((always_inline)) uint32_t
+_update(uint32_t crc, const void *buf, size_t len, const int hw) {
+	const unsigned char *p = (const unsigned char *)buf;
+	uint32_t crc1, crc2;
+	uint64_t v0, v1, v2;
+	size_t third, i;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		crc = CRC_U8(hw, crc, *p++);
+
+	/*
+	 * The CRC instruction has a latency of 3 cycles but can start one
+	 * every cycle: keep three of them in flight, then combine them.
+	 */
+	if (len >= STREAM_MIN) {
+		third = len / 24 * 8;
+		crc1 = crc2 = 0;
+		for (i = 0; i < third; i += 8) {
+			memcpy(&v0, p + i, 8);
+			memcpy(&v1, p + third + i, 8);
+			memcpy(&v2, p + 2 * third + i, 8);
+			crc = CRC_U64(hw, crc, v0);
+			crc1 = CRC_U64(hw, crc1, v1);
+			crc2 = CRC_U64(hw, crc2, v2);
+		}
+		crc = crc32c_shift(crc, third) ^ crc1;
+		crc = crc32c_shift(crc, third) ^ crc2;
+		p += 3 * third;
+		len -= 3 * third;
+	}
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v0, p, 8);
+		crc = CRC_U64(hw, crc, v0);
+	}
+	for (; len > 0; len--)
+		crc = CRC_U8(hw, crc, *p++);
+
+	return crc;
+}
+
+static inline __attribute__((always_inline)) uint32_t
+_delta(const void *old, const void *new, size_t len, const int hw) {
+	const unsigned char *a = (const unsigned char *)old;
+	const unsigned char *b = (const unsigned char *)new;
+	uint32_t crc = 0;
+	uint64_t va, vb;
+
+	for (; len >= 8; len -= 8, a += 8, b += 8) {
+		memcpy(&va, a, 8);
+		memcpy(&vb, b, 8);
+		crc = CRC_U64(hw, crc, va ^ vb);
+	}
+	for (; len > 0; len--)
+		crc = CRC_U8(hw, crc, *a++ ^ *b++);
+
+	return crc;
+}
+
+static uint32_t
+_update_sw(uint32_t crc, const void *buf, size_t len) {
+	return _update(crc, buf, len, 0);
+}
+
+static uint32_t
+_delta_sw(const void *old, const void *new, size_t len) {
+	return _delta(old, new, len, 0);
+}
+
+#ifdef HAVE_CRC_INSN
+__attribute__((target("sse4.2"))) static uint32_t
+_update_hw(uint32_t crc, const void *buf, size_t len) {
+	return _update(crc, buf, len, 1);
+}
+
+__attribute__((target("sse4.2"))) static uint32_t
+_delta_hw(const void *old, const void *new, size_t len) {
+	return _delta(old, new, len, 1);
+}
+#endif
+
+uint32_t
+crc32c_update(uint32_t crc, const void *buf, size_t len) {
+	return _update_impl(crc, buf, len);
+}
+
+/* Register for (old XOR new) in a single pass, without a temporary buffer */
+uint32_t
+crc32c_delta(const void *old, const void *new, size_t len) {
+	return _delta_impl(old, new, len);
+}
+
+/*
+ * Picks the CRC32 instruction (if 'hw' and the CPU has it) or the
+ * software version. Returns 1 if the instruction is used.
+ */
+int
+_crc32c_use_hw(int hw) {
+#ifdef HAVE_CRC_INSN
+	if (hw && __builtin_cpu_supports("sse4.2")) {
+		_update_impl = _update_hw;
+		_delta_impl = _delta_hw;
+		return 1;
+	}
+#endif
+	_update_impl = _update_sw;
+	_delta_impl = _delta_sw;
+	return 0;
+}
+
+/* The usual CRC32C of a buffer */
+uint32_t
+crc32c(const void *buf, size_t len) {
+	return crc32c_update(CRC32C_INIT, buf, len) ^ CRC32C_INIT;
+}
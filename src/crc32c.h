@@ -0,0 +1,29 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli). Besides the usual checksum of a buffer, the
+ * raw register operations let a checksum be updated when part of the
+ * data changes, without reading the rest of it:
+ * - crc32c_update() feeds bytes to a register;
+ * - crc32c_delta() gives the register for (old XOR new) fed to a
+ *   zeroed register;
+ * - crc32c_shift() feeds 'n' zero bytes to a register in O(log n).
+ * Since the CRC is linear, changing bytes at 'offset' in a buffer of
+ * 'size' bytes changes its register by
+ * crc32c_shift(crc32c_delta(old, new, len), size - offset - len).
+ */
+
+#define CRC32C_INIT 0xFFFFFFFFu
+
+uint32_t crc32c(const void *, size_t);
+uint32_t crc32c_update(uint32_t, const void *, size_t);
+uint32_t crc32c_delta(const void *, const void *, size_t);
+uint32_t crc32c_shift(uint32_t, size_t);
+
+int _crc32c_use_hw(int);
+
+#endif /* CRC32C_H */
@@ -0,0 +1,189 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "errors.h"
+#include "epoch.h"
+
+/*
+ * One slot for each reader thread, each on its own cache line so that
+ * readers never write to a line shared with other threads. A slot's
+ * epoch is 0 while its thread is outside a critical section.
+ */
+struct epoch_slot {
+	unsigned long epoch;
+	int used;
+	char pad[64 - sizeof(unsigned long) - sizeof(int)];
+};
+
+struct epoch_retired {
+	void *ptr;
+	void (*free_fn)(void *);
+	unsigned long epoch;
+	struct epoch_retired *next;
+};
+
+static struct epoch_slot _slots[EPOCH_MAX_THREADS] __attribute__((aligned(64)));
+static unsigned long _epoch = 1;
+
+static __thread struct epoch_slot *_my_slot = NULL;
+static __thread unsigned int _my_depth = 0;
+
+/* gives a thread's slot back when it exits */
+static pthread_key_t _slot_key;
+static pthread_once_t _slot_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Retired objects, oldest last. Besides the writer, readers evicting
+ * cached chunks retire memory too (see kcache_insert()), so the list
+ * is guarded by _retired_lock.
+ */
+static struct epoch_retired *_retired = NULL;
+static unsigned int _retired_no = 0;
+static pthread_mutex_t _retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+_epoch_release_slot(void *ptr) {
+	struct epoch_slot *slot = (struct epoch_slot *)ptr;
+
+	__atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+}
+
+static void
+_epoch_create_key(void) {
+	pthread_key_create(&_slot_key, _epoch_release_slot);
+}
+
+static struct epoch_slot *
+_epoch_claim_slot(void) {
+	int i, unused;
+
+	pthread_once(&_slot_key_once, _epoch_create_key);
+
+	for (i = 0; i < EPOCH_MAX_THREADS; i++) {
+		unused = 0;
+		if (__atomic_compare_exchange_n(&_slots[i].used, &unused, 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			if (pthread_setspecific(_slot_key, &_slots[i]) != 0) {
+				_epoch_release_slot(&_slots[i]);
+				return NULL;
+			}
+			return &_slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Enters a read-side critical section: objects reachable from now on
+ * won't be freed until the matching epoch_exit(). Critical sections
+ * can be nested. Each thread takes one of the EPOCH_MAX_THREADS slots
+ * until it exits: when none is left, E_CANNOT_PROCEED is returned and
+ * the caller must not read anything shared.
+ */
+int
+epoch_enter(void) {
+	if (_my_depth++ > 0)
+		return 0;
+
+	if (_my_slot == NULL && (_my_slot = _epoch_claim_slot()) == NULL) {
+		_my_depth = 0;
+		return E_CANNOT_PROCEED;
+	}
+
+	__atomic_store_n(&_my_slot->epoch, __atomic_load_n(&_epoch, __ATOMIC_ACQUIRE),
+			__ATOMIC_SEQ_CST);
+	/* the announcement must be visible before reading any pointer */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+void
+epoch_exit(void) {
+	if (_my_depth == 0 || --_my_depth > 0)
+		return;
+
+	__atomic_store_n(&_my_slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Schedules 'ptr' to be freed with 'free_fn' once no reader can still
+ * reach it. 'ptr' must already be unreachable for new readers. It's
+ * freed right away when there are no readers around. Can be called
+ * from any thread.
+ */
+void
+epoch_retire(void *ptr, void (*free_fn)(void *)) {
+	struct epoch_retired *r;
+
+	r = (struct epoch_retired *)malloc(sizeof(struct epoch_retired));
+	r->ptr = ptr;
+	r->free_fn = free_fn;
+
+	pthread_mutex_lock(&_retired_lock);
+	r->epoch = __atomic_fetch_add(&_epoch, 1, __ATOMIC_ACQ_REL);
+	r->next = _retired;
+	_retired = r;
+	_retired_no++;
+	pthread_mutex_unlock(&_retired_lock);
+
+	epoch_reclaim();
+}
+
+/*
+ * Frees the retired objects no reader can reach anymore. Returns the
+ * number of freed objects. They're taken off the list first and freed
+ * without _retired_lock held, since freeing them may retire more.
+ */
+unsigned int
+epoch_reclaim(void) {
+	struct epoch_retired *r, **prev, *done = NULL;
+	unsigned long oldest = 0, e, limit;
+	unsigned int i, freed = 0;
+
+	/* objects retired by other threads after the scan aren't safe yet */
+	limit = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* the oldest epoch still observed by a reader */
+	for (i = 0; i < EPOCH_MAX_THREADS; i++) {
+		e = __atomic_load_n(&_slots[i].epoch, __ATOMIC_ACQUIRE);
+		if (e != 0 && (oldest == 0 || e < oldest))
+			oldest = e;
+	}
+
+	pthread_mutex_lock(&_retired_lock);
+	prev = &_retired;
+	while ((r = *prev) != NULL) {
+		if (r->epoch < limit && (oldest == 0 || r->epoch < oldest)) {
+			*prev = r->next;
+			r->next = done;
+			done = r;
+			_retired_no--;
+		} else prev = &r->next;
+	}
+	pthread_mutex_unlock(&_retired_lock);
+
+	while ((r = done) != NULL) {
+		done = r->next;
+		r->free_fn(r->ptr);
+		free(r);
+		freed++;
+	}
+
+	return freed;
+}
+
+/* Returns the number of retired objects which haven't been freed yet */
+unsigned int
+epoch_pending(void) {
+	unsigned int pending;
+
+	pthread_mutex_lock(&_retired_lock);
+	pending = _retired_no;
+	pthread_mutex_unlock(&_retired_lock);
+
+	return pending;
+}
@@ -0,0 +1,21 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch based reclamation: readers wrap their accesses to shared data
+ * in epoch_enter()/epoch_exit(), writers hand what they unlinked to
+ * epoch_retire() instead of freeing it. Retired objects are freed once
+ * every reader which could still see them has left its critical
+ * section. Writers must still be serialized among themselves, but any
+ * thread can retire and reclaim.
+ */
+
+#define EPOCH_MAX_THREADS 128
+
+int epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *, void (*)(void *));
+unsigned int epoch_reclaim(void);
+unsigned int epoch_pending(void);
+
+#endif /* EPOCH_H */
@@ -16,5 +16,10 @@
 #define E_INVALID_NAME        -13 /* name contains invalid characters */
 #define E_TOO_MANY_ARGS       -14 /* too many arguments passed */
 #define E_CANT_GET_EXT_FILE   -15 /* can't access to an external file */
+#define E_READ_ONLY           -16 /* the node can't be modified */
+#define E_CHECKSUM            -17 /* the content doesn't match its checksum */
+#define E_QUOTA               -18 /* the quota of a directory would be exceeded */
+#define E_NO_ATTR             -19 /* the node has no such attribute */
+#define E_NO_INDEX            -20 /* the attribute isn't indexed */
 
 #endif /* _ERRORS_H */
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "errors.h"
+#include "node.h"
+#include "expire.h"
+
+/*
+ * Every armed timer sits either in a slot of the wheel or, once its
+ * time has come, in the _due list. expire_run() moves the wheel
+ * forward, unlinks the nodes in _due and then deletes them a batch at
+ * a time, so a lot of nodes expiring together never means a long
+ * pause. Timers are changed by the same single writer that changes
+ * the tree.
+ *
+ * Unlinked subtrees wait in _graveyard, and are taken apart one node
+ * at a time: a node is deleted once its children have been moved to
+ * the graveyard themselves. The nodes at the top of the graveyard
+ * have _grave as their father, so that nodes below them are known to
+ * be gone already if their timers fire.
+ */
+static struct node_timer *_wheel[EXPIRE_LEVELS][EXPIRE_SLOTS];
+static struct node_timer *_due = NULL;
+static unsigned long _clock = 0;
+static unsigned long _armed = 0;
+
+static struct node_list *_graveyard = NULL;
+static unsigned long _buried = 0;
+static struct node _grave;
+
+/* Seconds on a clock which never goes backwards */
+unsigned long
+expire_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void
+_timer_link(struct node_timer **list, struct node_timer *t) {
+	t->list = list;
+	t->prev = NULL;
+	t->next = *list;
+	if (*list != NULL)
+		(*list)->prev = t;
+	*list = t;
+}
+
+static void
+_timer_unlink(struct node_timer *t) {
+	if (t->prev != NULL)
+		t->prev->next = t->next;
+	else *t->list = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	t->list = NULL;
+}
+
+/*
+ * Puts a timer in the slot of the lowest level whose range covers its
+ * expiry time, or in _due if it's already expired.
+ */
+static void
+_timer_schedule(struct node_timer *t) {
+	unsigned long delta, expires = t->expires;
+	unsigned int level;
+
+	if (expires <= _clock) {
+		_timer_link(&_due, t);
+		return;
+	}
+
+	delta = expires - _clock;
+	for (level = 0; level < EXPIRE_LEVELS - 1; level++)
+		if (delta < 1UL << (EXPIRE_SLOT_BITS * (level + 1)))
+			break;
+
+	/* too far away: wait in the farthest slot and be cascaded again */
+	if (delta >= 1UL << (EXPIRE_SLOT_BITS * EXPIRE_LEVELS))
+		expires = _clock + (1UL << (EXPIRE_SLOT_BITS * EXPIRE_LEVELS)) - 1;
+
+	_timer_link(&_wheel[level][(expires >> (EXPIRE_SLOT_BITS * level)) & (EXPIRE_SLOTS - 1)], t);
+}
+
+/* Moves the timers of a slot to the levels below (or to _due) */
+static void
+_wheel_cascade(unsigned int level, unsigned int slot) {
+	struct node_timer *t = _wheel[level][slot], *next;
+
+	_wheel[level][slot] = NULL;
+	for (; t != NULL; t = next) {
+		next = t->next;
+		_timer_schedule(t);
+	}
+}
+
+/* Moves the wheel forward by one tick */
+static void
+_wheel_tick(void) {
+	unsigned int level;
+
+	_clock++;
+
+	/* higher levels first: what they cascade may land in a lower slot due now */
+	for (level = EXPIRE_LEVELS - 1; level > 0; level--)
+		if ((_clock & ((1UL << (EXPIRE_SLOT_BITS * level)) - 1)) == 0)
+			_wheel_cascade(level, (_clock >> (EXPIRE_SLOT_BITS * level)) & (EXPIRE_SLOTS - 1));
+
+	_wheel_cascade(0, _clock & (EXPIRE_SLOTS - 1));
+}
+
+/*
+ * Makes a node expire at 'when' (see expire_now()): it will be deleted
+ * by the first expire_run() after that. 0 removes the expiry time.
+ */
+int
+node_set_expiry(struct node *node, unsigned long when) {
+	if (node->readonly)
+		return E_READ_ONLY;
+
+	if (when == 0) {
+		node_cleartimer(node);
+		return 0;
+	}
+
+	if (node->timer == NULL) {
+		node->timer = (struct node_timer *)malloc(sizeof(struct node_timer));
+		if (node->timer == NULL)
+			return E_CANNOT_PROCEED;
+		node->timer->node = node;
+		_armed++;
+	} else _timer_unlink(node->timer);
+
+	if (_clock == 0)
+		_clock = expire_now();
+
+	node->timer->expires = when;
+	_timer_schedule(node->timer);
+	return 0;
+}
+
+/* Makes a node expire 'ttl' seconds from now (0 means never) */
+int
+node_set_ttl(struct node *node, unsigned long ttl) {
+	return node_set_expiry(node, (ttl > 0) ? expire_now() + ttl : 0);
+}
+
+void
+node_cleartimer(struct node *node) {
+	if (node->timer == NULL)
+		return;
+
+	_timer_unlink(node->timer);
+	free(node->timer);
+	node->timer = NULL;
+	_armed--;
+}
+
+/*
+ * Clears the timers of a subtree being unlinked from the tree, so
+ * that none of its nodes can expire while it waits to be freed.
+ */
+void
+expire_detach(struct node *node) {
+	struct node_list *nl;
+
+	if (_armed == 0)
+		return;
+
+	node_cleartimer(node);
+	for (nl = node->childrens; nl != NULL; nl = nl->next)
+		expire_detach(nl->node);
+}
+
+/* Tells whether a node is in a subtree waiting in the graveyard */
+static int
+_is_buried(struct node *node) {
+	for (; node != NULL; node = node->father)
+		if (node == &_grave)
+			return 1;
+
+	return 0;
+}
+
+/* Puts a node unlinked from the tree at the top of the graveyard */
+static int
+_bury(struct node *node) {
+	struct node_list *nl = node_list_create();
+
+	if (nl == NULL)
+		return E_CANNOT_PROCEED;
+
+	node_set_father(node, &_grave);
+	nl->node = node;
+	nl->next = _graveyard;
+	_graveyard = nl;
+	_buried++;
+	return 0;
+}
+
+/*
+ * Takes one step in emptying the graveyard: moves the first child of
+ * the node on top to the graveyard, or deletes the node if it has no
+ * children left. Returns 1 if a node was deleted.
+ */
+static unsigned int
+_graveyard_step(void) {
+	struct node_list *nl = _graveyard;
+	struct node *node = nl->node, *child;
+
+	if (node->childrens != NULL) {
+		child = node->childrens->node;
+		if (_bury(child) == 0) {
+			node_unlink_child(node, child);
+			return 0;
+		}
+	}
+
+	/* out of memory for the graveyard: delete the rest in one go */
+	_graveyard = nl->next;
+	_buried--;
+	node_list_delete(nl);
+
+	expire_detach(node);
+	node->father = NULL;
+	node_retire(node);
+	return 1;
+}
+
+/*
+ * Moves the wheel up to 'now' and deletes at most 'budget' nodes
+ * among the expired ones and the subtrees below them. The others are
+ * left for the next call. Returns the number of deleted nodes.
+ */
+unsigned int
+expire_run(unsigned long now, unsigned int budget) {
+	struct node *node;
+	unsigned int deleted = 0;
+
+	if (_armed == 0 && _graveyard == NULL) {
+		_clock = now;
+		return 0;
+	}
+
+	while (_clock < now)
+		_wheel_tick();
+
+	while (deleted < budget && (_graveyard != NULL || _due != NULL)) {
+		if (_graveyard != NULL) {
+			deleted += _graveyard_step();
+			continue;
+		}
+
+		node = _due->node;
+		node_cleartimer(node);
+
+		/* roots are deleted by their owner, not here */
+		if (node->father == NULL || _is_buried(node))
+			continue;
+		if (node_unlink_child(node->father, node) == 0 && _bury(node) < 0) {
+			node->father = NULL;
+			expire_detach(node);
+			node_retire(node);
+			deleted++;
+		}
+	}
+
+	return deleted;
+}
+
+/*
+ * Returns the number of nodes with an expiry time, plus the subtrees
+ * unlinked but not deleted yet.
+ */
+unsigned long
+expire_pending(void) {
+	return _armed + _buried;
+}
@@ -0,0 +1,35 @@
+#ifndef EXPIRE_H
+#define EXPIRE_H
+
+#include "node.h"
+
+/*
+ * Hierarchical timing wheel: EXPIRE_LEVELS wheels of EXPIRE_SLOTS
+ * slots, one tick per second. Level 0 covers the next 64 seconds,
+ * level 1 the next 64 * 64 and so on (about 194 days in total);
+ * farther expiry times wait in the last slot of the last level.
+ */
+#define EXPIRE_LEVELS     4
+#define EXPIRE_SLOT_BITS  6
+#define EXPIRE_SLOTS      (1 << EXPIRE_SLOT_BITS)
+
+/* nodes deleted by expire_run() at most, when called by the shell */
+#define EXPIRE_BATCH 256
+
+/* The expiry time of a node with a TTL, in the list 'list' points to */
+struct node_timer {
+	struct node *node;
+	unsigned long expires;
+	struct node_timer **list;
+	struct node_timer *prev, *next;
+};
+
+unsigned long expire_now(void);
+int node_set_ttl(struct node *, unsigned long);
+int node_set_expiry(struct node *, unsigned long);
+void node_cleartimer(struct node *);
+void expire_detach(struct node *);
+unsigned int expire_run(unsigned long, unsigned int);
+unsigned long expire_pending(void);
+
+#endif /* EXPIRE_H */
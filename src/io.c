@@ -1,8 +1,19 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
+#include "common.h"
 #include "node.h"
 #include "io.h"
 #include "errors.h"
+#include "crc32c.h"
+#include "epoch.h"
 
 KFILE
 kopen(struct node *root, char *path) {
@@ -28,16 +39,44 @@ kclose(KFILE kfile) {
 	free(kfile);
 }
 
+/* Returns the current read position */
 long
 ktell(KFILE kfile) {
+	return kfile->rpos;
 }
 
 void
 krewind(KFILE kfile) {
+	kfile->rpos = kfile->wpos = 0;
 }
 
+/*
+ * Moves both the read and the write position. Seeking past the
+ * end of the file is allowed, seeking before its start is not.
+ */
 int
 kseek(KFILE kfile, int offset, short int relative_to) {
+	long base;
+
+	switch (relative_to) {
+		case KF_SEEK_START:
+			base = 0;
+			break;
+		case KF_SEEK_CURR:
+			base = kfile->rpos;
+			break;
+		case KF_SEEK_EOF:
+			base = kfile->node->size;
+			break;
+		default:
+			return E_INVALID_SYNTAX;
+	}
+
+	if (base + offset < 0)
+		return E_OUT_OF_BOUNDS;
+
+	kfile->rpos = kfile->wpos = base + offset;
+	return 0;
 }
 
 KFILE
@@ -46,18 +85,401 @@ _alloc_kfile(struct node *node) {
 	kfile = (KFILE)malloc(sizeof(struct _KFILE));
 
 	kfile->node = node;
+	kfile->rpos = 0;
+	kfile->wpos = 0;
+	kfile->ra_next = 0;
+	kfile->ra_chunk = 0;
+	kfile->ra_window = 0;
+	kfile->rsv_chunk = NULL;
 	return kfile;
 }
 
+/*
+ * Returns the chunk holding the byte at 'offset' or NULL if the
+ * node's chunks don't reach that far. Every chunk but the last
+ * one is CHUNK_SIZE long, so the position in the list is known
+ * in advance.
+ */
+static Chunk *
+_chunk_at(struct node *node, unsigned long offset) {
+	Chunk *chunk = node->first_chunk;
+	unsigned long i;
+
+	for (i = offset / CHUNK_SIZE; chunk != NULL && i > 0; i--)
+		chunk = chunk->next;
+
+	return chunk;
+}
+
+/*
+ * Fills the 'index'th chunk of a node from its backing host file.
+ * Bytes past the end of the host file are left zeroed. On errors the
+ * chunk is left without memory, so that the next access tries again.
+ * The content is read aside and published at once, and only one
+ * thread at a time fills a chunk: the others wait for it and find the
+ * chunk already filled.
+ */
+static int
+_kfile_fill(struct node *node, Chunk *chunk, unsigned long index, int write) {
+	unsigned int filled = 0;
+	ssize_t done;
+	Chunk fill;
+	int fd, ret = 0;
+
+	while (__atomic_test_and_set(&chunk->filling, __ATOMIC_ACQUIRE))
+		sched_yield();
+	if (__atomic_load_n(&chunk->memory, __ATOMIC_ACQUIRE) != NULL)
+		goto out;
+
+	fd = open(node->backing, O_RDONLY);
+	if (fd < 0) {
+		ret = E_CANT_GET_EXT_FILE;
+		goto out;
+	}
+
+	memset(&fill, 0, sizeof(Chunk));
+	fill.size = chunk->size;
+	if (_populate_chunk(&fill) < 0) {
+		close(fd);
+		ret = E_CANNOT_PROCEED;
+		goto out;
+	}
+
+	while (filled < fill.size) {
+		done = pread(fd, (char *)fill.memory + filled, fill.size - filled,
+				index * CHUNK_SIZE + filled);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0) {
+			close(fd);
+			_depopulate_chunk(&fill);
+			ret = E_CANT_GET_EXT_FILE;
+			goto out;
+		}
+		if (done == 0)
+			break;
+		filled += done;
+	}
+	close(fd);
+
+	chunk->crc = _chunk_crc(&fill);
+	chunk->placement = fill.placement;
+	chunk->numa_node = fill.numa_node;
+	__atomic_store_n(&chunk->memory, fill.memory, __ATOMIC_RELEASE);
+	if (!write) {
+		chunk->priority = node_cache_priority(node);
+		kcache_insert(chunk);
+	}
+
+out:
+	__atomic_clear(&chunk->filling, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/*
+ * Makes sure the 'index'th chunk of a node can be accessed: chunks
+ * of a node bound to a host file are filled on first access and
+ * stay evictable until they're written, other chunks without memory
+ * are holes which read as zeros and get memory on first write.
+ */
+static int
+_kfile_prepare(struct node *node, Chunk *chunk, unsigned long index, int write) {
+	if (__atomic_load_n(&chunk->memory, __ATOMIC_ACQUIRE) == NULL) {
+		if (node->backing != NULL) {
+			if (_kfile_fill(node, chunk, index, write) < 0)
+				return E_CANT_GET_EXT_FILE;
+		} else if (write && _populate_chunk(chunk) < 0)
+			return E_CANNOT_PROCEED;
+	} else if (chunk->cached) {
+		if (write)
+			kcache_remove(chunk);
+		else kcache_touch(chunk);
+	} else if (write && chunk->shared != NULL) {
+		/* copy on write */
+		if (_unshare_chunk(chunk) < 0)
+			return E_CANNOT_PROCEED;
+	}
+
+	return 0;
+}
+
+/* Checks the quotas above a node before it grows up to 'size' bytes */
+static int
+_kfile_quota(struct node *node, unsigned long size) {
+	if (size <= node->size)
+		return 0;
+
+	return node_quota_check(node, size - node->size, 0);
+}
+
+/*
+ * Binds an empty file node to the host file at 'path': the node takes
+ * the size of the host file, and its chunks are filled from it the
+ * first time they're read. Chunks which haven't been modified can be
+ * evicted (see kcache_set_limit()) and will be filled again if needed.
+ */
+int
+kbind(struct node *node, const char *path) {
+	struct stat st;
+
+	if (node->type != N_FILE)
+		return E_INVALID_TYPE;
+	if (node->readonly)
+		return E_READ_ONLY;
+	if (node->first_chunk != NULL || node->backing != NULL)
+		return E_CONSTRAINT_VIOLATED;
+
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return E_CANT_GET_EXT_FILE;
+	if (_kfile_quota(node, st.st_size) < 0)
+		return E_QUOTA;
+
+	node->backing = strdup(path);
+	node_set_size(node, st.st_size);
+	node->first_chunk = kalloc_lazy(st.st_size);
+
+	return 0;
+}
+
+/*
+ * Makes sure the node has enough chunks to hold 'size' bytes. The
+ * last chunk is grown up to CHUNK_SIZE before appending new ones.
+ * Chunks which lie entirely before 'data' (i.e. nobody is going to
+ * write them now) are appended as holes, without any memory behind.
+ * Nodes bound to a host file never get holes, since their chunks
+ * without memory are filled from the host file.
+ */
+static int
+_kfile_reserve(struct node *node, unsigned long size, unsigned long data) {
+	Chunk *chunk = node->first_chunk, *last = NULL;
+	unsigned long capacity = 0, missing, len;
+	unsigned int old_size;
+
+	while (chunk != NULL) {
+		capacity += chunk->size;
+		last = chunk;
+		chunk = chunk->next;
+	}
+
+	if (capacity >= size)
+		return 0;
+
+	if (last != NULL && last->size < CHUNK_SIZE) {
+		missing = size - capacity;
+		old_size = last->size;
+		if (_grow_chunk(last, (missing > CHUNK_SIZE - old_size) ?
+					CHUNK_SIZE : old_size + missing) < 0)
+			return E_CANNOT_PROCEED;
+		capacity += last->size - old_size;
+	}
+
+	while (capacity < size) {
+		missing = size - capacity;
+		len = (missing > CHUNK_SIZE) ? CHUNK_SIZE : missing;
+		if (node->backing == NULL && capacity + len <= data)
+			chunk = kalloc_lazy(len);
+		else chunk = kalloc(len);
+		if (chunk == NULL)
+			return E_CANNOT_PROCEED;
+
+		if (last == NULL)
+			node->first_chunk = chunk;
+		else last->next = chunk;
+		last = chunk;
+
+		capacity += chunk->size;
+	}
+
+	return 0;
+}
+
+/*
+ * Transfers data between the node, starting at 'offset', and the
+ * 'iovcnt' buffers in 'iov'. The chunk list is walked only once, so
+ * buffers and chunk boundaries can be crossed in any combination.
+ * Reads stop at the end of the file, writes extend it.
+ * Chunks of a bound node can be evicted by other readers at any time:
+ * reads load their memory once per chunk, inside an epoch which keeps
+ * it from being freed, and fill the chunk again if it was evicted
+ * before they got to it.
+ */
+static long
+_kio(struct node *node, unsigned long offset, const struct kiovec *iov,
+		int iovcnt, int write) {
+	Chunk *chunk;
+	void *memory = NULL;
+	unsigned long want = 0, total = 0, index;
+	unsigned int chunk_off, iov_off = 0, len, done;
+	int i, evictable;
+	long ret = 0;
+
+	if (node->type != N_FILE)
+		return E_INVALID_TYPE;
+
+	for (i = 0; i < iovcnt; i++)
+		want += iov[i].len;
+
+	if (write) {
+		if (node->readonly)
+			return E_READ_ONLY;
+		if (_kfile_quota(node, offset + want) < 0)
+			return E_QUOTA;
+		if (want > 0 && _kfile_reserve(node, offset + want, offset) < 0)
+			return E_CANNOT_PROCEED;
+	} else {
+		if (offset >= node->size)
+			return 0;
+		if (want > node->size - offset)
+			want = node->size - offset;
+	}
+
+	evictable = !write && node->backing != NULL;
+	if (evictable && epoch_enter() != 0)
+		return E_CANNOT_PROCEED;
+
+	index = offset / CHUNK_SIZE;
+	chunk = _chunk_at(node, offset);
+	chunk_off = offset % CHUNK_SIZE;
+	i = 0;
+
+	while (total < want && chunk != NULL && i < iovcnt) {
+		len = iov[i].len - iov_off;
+		if (len > want - total)
+			len = want - total;
+
+		if (chunk_off == 0 || total == 0 || memory == NULL) {
+			if (_kfile_prepare(node, chunk, index, write) < 0) {
+				if (total == 0)
+					ret = E_CANT_GET_EXT_FILE;
+				break;
+			}
+			memory = __atomic_load_n(&chunk->memory, __ATOMIC_ACQUIRE);
+			if (memory == NULL && evictable)
+				continue;
+		}
+
+		if (write)
+			done = _raw_kwrite(chunk, chunk_off, (char *)iov[i].base + iov_off, len);
+		else done = _raw_kread_memory(chunk, memory, chunk_off, len,
+				(char *)iov[i].base + iov_off);
+
+		total += done;
+		chunk_off += done;
+		iov_off += done;
+
+		if (chunk_off >= chunk->size) {
+			chunk = chunk->next;
+			chunk_off = 0;
+			index++;
+		}
+		if (iov_off >= iov[i].len) {
+			i++;
+			iov_off = 0;
+		}
+	}
+
+	if (evictable)
+		epoch_exit();
+
+	if (ret < 0)
+		return ret;
+
+	if (write && offset + total > node->size)
+		node_set_size(node, offset + total);
+
+	return total;
+}
+
+/*
+ * Called after a cursor read of 'done' bytes at 'offset'. Reads which
+ * start where the previous one ended double the read-ahead window (up
+ * to KF_READAHEAD_CHUNKS chunks), any other read resets it. Then:
+ * - the bytes right after the cursor get a prefetch hint, since the
+ *   hardware prefetcher stops at page boundaries;
+ * - chunks in the window which still have to be filled from a host
+ *   file are announced to the kernel, so that they're read from disk
+ *   while we're busy with the current one.
+ */
+static void
+_kfile_readahead(KFILE kfile, unsigned long offset, unsigned long done) {
+	struct node *node = kfile->node;
+	Chunk *chunk;
+	void *memory;
+	unsigned long end = offset + done, index, last;
+	unsigned int off, n;
+	int fd = -1;
+
+	if (offset != kfile->ra_next) {
+		kfile->ra_window = 0;
+		kfile->ra_chunk = 0;
+		kfile->ra_next = end;
+		return;
+	}
+	kfile->ra_next = end;
+
+	if (kfile->ra_window == 0)
+		kfile->ra_window = 1;
+	else if (kfile->ra_window < KF_READAHEAD_CHUNKS)
+		kfile->ra_window *= 2;
+
+	if (end >= node->size)
+		return;
+
+	index = end / CHUNK_SIZE;
+	chunk = _chunk_at(node, end);
+	off = end % CHUNK_SIZE;
+
+	for (n = 0; chunk != NULL && n < KF_PREFETCH_BYTES; n += 64) {
+		if (off >= chunk->size) {
+			chunk = chunk->next;
+			off = 0;
+			if (chunk == NULL)
+				break;
+		}
+		/* a hint only: the memory may be evicted, but it never faults */
+		memory = __atomic_load_n(&chunk->memory, __ATOMIC_RELAXED);
+		if (memory != NULL)
+			__builtin_prefetch((char *)memory + off);
+		off += 64;
+	}
+
+	if (node->backing == NULL)
+		return;
+
+	/* chunks already announced aren't announced again */
+	last = index + kfile->ra_window;
+	if (kfile->ra_chunk <= index)
+		kfile->ra_chunk = index + 1;
+
+	chunk = _chunk_at(node, kfile->ra_chunk * CHUNK_SIZE);
+	for (; chunk != NULL && kfile->ra_chunk <= last; chunk = chunk->next) {
+		if (__atomic_load_n(&chunk->memory, __ATOMIC_RELAXED) == NULL) {
+			if (fd < 0 && (fd = open(node->backing, O_RDONLY)) < 0)
+				return;
+			posix_fadvise(fd, kfile->ra_chunk * CHUNK_SIZE, chunk->size,
+					POSIX_FADV_WILLNEED);
+		}
+		kfile->ra_chunk++;
+	}
+
+	if (fd >= 0)
+		close(fd);
+}
+
 /*
  * Read from the current position the specified number of
  * bytes, and save the content in 'buffer'
  */
 unsigned int
 kread(KFILE kfile, unsigned int size, void *buffer) {
-	if (kfile->node->type != N_FILE)
-		return E_INVALID_TYPE;
-	return _raw_kread(kfile->node->first_chunk, size, buffer);
+	struct kiovec iov = { buffer, size };
+	long ret = _kio(kfile->node, kfile->rpos, &iov, 1, 0);
+
+	if (ret > 0) {
+		_kfile_readahead(kfile, kfile->rpos, ret);
+		kfile->rpos += ret;
+	}
+	return ret;
 }
 
 /*
@@ -66,11 +488,526 @@ kread(KFILE kfile, unsigned int size, void *buffer) {
  */
 unsigned int
 kwrite(KFILE kfile, void *data, unsigned int size) {
-	if (kfile->node->type != N_FILE)
+	struct kiovec iov = { data, size };
+	long ret = _kio(kfile->node, kfile->wpos, &iov, 1, 1);
+
+	if (ret > 0)
+		kfile->wpos += ret;
+	return ret;
+}
+
+/*
+ * Read 'size' bytes starting at 'offset' without moving the file
+ * positions. Since the KFILE is never modified, many readers can
+ * share the same file pointer.
+ */
+unsigned int
+kpread(KFILE kfile, unsigned long offset, unsigned int size, void *buffer) {
+	struct kiovec iov = { buffer, size };
+	return _kio(kfile->node, offset, &iov, 1, 0);
+}
+
+/*
+ * Write 'size' bytes starting at 'offset' without moving the file
+ * positions. Writing past the end of the file extends it.
+ */
+unsigned int
+kpwrite(KFILE kfile, unsigned long offset, void *data, unsigned int size) {
+	struct kiovec iov = { data, size };
+	return _kio(kfile->node, offset, &iov, 1, 1);
+}
+
+/*
+ * Scatter read: fills the 'iovcnt' buffers in order, starting from
+ * the current read position. Returns the total number of read bytes.
+ */
+long
+kreadv(KFILE kfile, const struct kiovec *iov, int iovcnt) {
+	long ret = _kio(kfile->node, kfile->rpos, iov, iovcnt, 0);
+
+	if (ret > 0) {
+		_kfile_readahead(kfile, kfile->rpos, ret);
+		kfile->rpos += ret;
+	}
+	return ret;
+}
+
+/*
+ * Gather write: writes the 'iovcnt' buffers in order, starting from
+ * the current write position. Returns the total number of written bytes.
+ */
+long
+kwritev(KFILE kfile, const struct kiovec *iov, int iovcnt) {
+	long ret = _kio(kfile->node, kfile->wpos, iov, iovcnt, 1);
+
+	if (ret > 0)
+		kfile->wpos += ret;
+	return ret;
+}
+
+/* Like kreadv, but starting at 'offset' and without moving the file positions */
+long
+kpreadv(KFILE kfile, unsigned long offset, const struct kiovec *iov, int iovcnt) {
+	return _kio(kfile->node, offset, iov, iovcnt, 0);
+}
+
+/* Like kwritev, but starting at 'offset' and without moving the file positions */
+long
+kpwritev(KFILE kfile, unsigned long offset, const struct kiovec *iov, int iovcnt) {
+	return _kio(kfile->node, offset, iov, iovcnt, 1);
+}
+
+/*
+ * Writes up to 'size' bytes read from the host file descriptor 'fd',
+ * starting from the current write position. Data is read straight
+ * into the node's chunks, without any intermediate buffer. Returns
+ * the number of bytes written (less than 'size' if 'fd' hits EOF).
+ * Chunks given memory here hold zeros, so their checksum is patched
+ * with the new bytes alone; chunks which already had data are
+ * checksummed again once they've been written.
+ */
+long
+kwritefd(KFILE kfile, int fd, unsigned long size) {
+	struct node *node = kfile->node;
+	Chunk *chunk, *fresh = NULL, *stale = NULL;
+	unsigned long total = 0, index;
+	unsigned int chunk_off, len;
+	ssize_t done;
+	long ret = 0;
+
+	if (node->type != N_FILE)
+		return E_INVALID_TYPE;
+	if (node->readonly)
+		return E_READ_ONLY;
+
+	if (_kfile_quota(node, kfile->wpos + size) < 0)
+		return E_QUOTA;
+	if (size > 0 && _kfile_reserve(node, kfile->wpos + size, kfile->wpos) < 0)
+		return E_CANNOT_PROCEED;
+
+	chunk = _chunk_at(node, kfile->wpos);
+	chunk_off = kfile->wpos % CHUNK_SIZE;
+
+	index = kfile->wpos / CHUNK_SIZE;
+
+	while (total < size && chunk != NULL) {
+		len = chunk->size - chunk_off;
+		if (len > size - total)
+			len = size - total;
+
+		if (chunk->memory == NULL && node->backing == NULL)
+			fresh = chunk;
+		if (_kfile_prepare(node, chunk, index, 1) < 0)
+			break;
+
+		done = read(fd, (char *)chunk->memory + chunk_off, len);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0) {
+			ret = E_CANT_GET_EXT_FILE;
+			break;
+		}
+		if (done == 0)
+			break;
+
+		if (chunk == fresh)
+			_chunk_crc_patch(chunk, chunk_off, done,
+					crc32c_update(0, (char *)chunk->memory + chunk_off, done));
+		else stale = chunk;
+
+		total += done;
+		chunk_off += done;
+		if (chunk_off >= chunk->size) {
+			if (stale == chunk)
+				chunk->crc = _chunk_crc(chunk);
+			chunk = chunk->next;
+			chunk_off = 0;
+			index++;
+		}
+	}
+	if (stale != NULL && stale == chunk)
+		chunk->crc = _chunk_crc(chunk);
+
+	kfile->wpos += total;
+	if (kfile->wpos > node->size)
+		node_set_size(node, kfile->wpos);
+
+	return (ret < 0) ? ret : (long)total;
+}
+
+/*
+ * Reads exactly 'size' bytes from the host file descriptor 'fd' into
+ * a new list of chunks, stored in 'chunks'. Nothing but the new chunks
+ * is touched, so readers on any thread can load files in parallel;
+ * the writer then gives the chunks to a node with kattach().
+ */
+int
+kload(int fd, unsigned long size, Chunk **chunks) {
+	Chunk *last = NULL, *chunk = NULL;
+	unsigned long total = 0;
+	unsigned int len, filled;
+	ssize_t done;
+
+	*chunks = NULL;
+	while (total < size) {
+		len = (size - total > CHUNK_SIZE) ? CHUNK_SIZE : size - total;
+		chunk = kalloc_lazy(len);
+		if (chunk == NULL || _populate_chunk(chunk) < 0)
+			goto fail;
+
+		if (last == NULL)
+			*chunks = chunk;
+		else last->next = chunk;
+		last = chunk;
+
+		for (filled = 0; filled < len; filled += done) {
+			done = read(fd, (char *)chunk->memory + filled, len - filled);
+			if (done < 0 && errno == EINTR)
+				done = 0;
+			else if (done <= 0)
+				goto fail;
+		}
+		chunk->crc = _chunk_crc(chunk);
+		total += len;
+	}
+
+	return 0;
+
+fail:
+	if (chunk != NULL && chunk != last)
+		kfree(chunk);
+	kfree(*chunks);
+	*chunks = NULL;
+	return E_CANT_GET_EXT_FILE;
+}
+
+/*
+ * Gives an empty file node the 'size' bytes held in 'chunks' (see
+ * kload()). On failure the chunks are left to the caller.
+ */
+int
+kattach(struct node *node, Chunk *chunks, unsigned long size) {
+	if (node->type != N_FILE)
+		return E_INVALID_TYPE;
+	if (node->readonly)
+		return E_READ_ONLY;
+	if (node->first_chunk != NULL || node->backing != NULL)
+		return E_CONSTRAINT_VIOLATED;
+	if (_kfile_quota(node, size) < 0)
+		return E_QUOTA;
+
+	node->first_chunk = chunks;
+	node_set_size(node, size);
+
+	return 0;
+}
+
+/*
+ * Returns in 'span' a pointer to the chunk memory at the write
+ * position, so that a producer can write there directly instead of
+ * going through a buffer and kwrite(). The span holds at most 'size'
+ * bytes and ends with the chunk, so it can be shorter: its length is
+ * returned. Nothing is written until kwrite_commit(), and the span is
+ * only valid until then (no other write or truncation of the file may
+ * happen in between). A span which is never committed is settled by
+ * the next kwrite_reserve(), as if it was committed with no bytes.
+ * The span is given private memory here, and the tree holding the
+ * file must not be cloned nor snapshotted until it's committed: the
+ * copy would share the span with the producer.
+ */
+long
+kwrite_reserve(KFILE kfile, unsigned int size, void **span) {
+	struct node *node = kfile->node;
+	Chunk *chunk;
+	unsigned int chunk_off, len;
+
+	if (node->type != N_FILE)
+		return E_INVALID_TYPE;
+	if (node->readonly)
+		return E_READ_ONLY;
+
+	if (kfile->rsv_chunk != NULL)
+		kwrite_commit(kfile, 0);
+	*span = NULL;
+	if (size == 0)
+		return 0;
+
+	if (_kfile_quota(node, kfile->wpos + size) < 0)
+		return E_QUOTA;
+	if (_kfile_reserve(node, kfile->wpos + size, kfile->wpos) < 0)
+		return E_CANNOT_PROCEED;
+
+	chunk = _chunk_at(node, kfile->wpos);
+	if (_kfile_prepare(node, chunk, kfile->wpos / CHUNK_SIZE, 1) < 0 ||
+			_unshare_chunk(chunk) < 0)
+		return E_CANNOT_PROCEED;
+
+	chunk_off = kfile->wpos % CHUNK_SIZE;
+	len = chunk->size - chunk_off;
+	if (len > size)
+		len = size;
+
+	kfile->rsv_crc = crc32c_update(0, (char *)chunk->memory + chunk_off, len);
+	kfile->rsv_chunk = chunk;
+	kfile->rsv_len = len;
+
+	*span = (char *)chunk->memory + chunk_off;
+	return len;
+}
+
+/*
+ * Publishes the first 'used' bytes of the span returned by the last
+ * kwrite_reserve(), as if they had been written with kwrite(). The
+ * bytes of the span past 'used' and past the end of the file are
+ * zeroed again, whatever the producer left there. The checksum is
+ * updated from the bytes actually in the span.
+ */
+int
+kwrite_commit(KFILE kfile, unsigned int used) {
+	struct node *node = kfile->node;
+	Chunk *chunk = kfile->rsv_chunk;
+	unsigned int chunk_off = kfile->wpos % CHUNK_SIZE;
+	unsigned long keep;
+	char *span;
+
+	if (chunk == NULL)
+		return (used == 0) ? 0 : E_CONSTRAINT_VIOLATED;
+	if (used > kfile->rsv_len)
+		return E_OUT_OF_BOUNDS;
+
+	span = (char *)chunk->memory + chunk_off;
+	keep = (node->size > kfile->wpos + used) ? node->size - kfile->wpos : used;
+	if (keep < kfile->rsv_len)
+		memset(span + keep, 0, kfile->rsv_len - keep);
+	_chunk_crc_patch(chunk, chunk_off, kfile->rsv_len,
+			kfile->rsv_crc ^ crc32c_update(0, span, kfile->rsv_len));
+
+	kfile->rsv_chunk = NULL;
+	kfile->wpos += used;
+	if (kfile->wpos > node->size)
+		node_set_size(node, kfile->wpos);
+
+	return 0;
+}
+
+/*
+ * Sets the size of a file. Chunks past the new end are freed, and the
+ * last chunk is shrunk. Growing a file appends holes: they take no
+ * memory and read as zeros until they're written.
+ */
+int
+ktruncate(KFILE kfile, unsigned long size) {
+	struct node *node = kfile->node;
+	Chunk *last;
+	unsigned long index;
+	unsigned int keep;
+
+	if (node->type != N_FILE)
+		return E_INVALID_TYPE;
+	if (node->readonly)
+		return E_READ_ONLY;
+	if (_kfile_quota(node, size) < 0)
+		return E_QUOTA;
+
+	index = (size > 0) ? (size - 1) / CHUNK_SIZE : 0;
+	keep = size - index * CHUNK_SIZE;
+	last = (size > 0) ? _chunk_at(node, size - 1) : NULL;
+
+	if (size == 0) {
+		kfree(node->first_chunk);
+		node->first_chunk = NULL;
+	} else if (last != NULL && last->size >= keep) {
+		kfree(last->next);
+		last->next = NULL;
+
+		if (last->size > keep) {
+			/* the host file must not show up again if the file grows */
+			if (node->backing != NULL &&
+					_kfile_prepare(node, last, index, 1) < 0)
+				return E_CANT_GET_EXT_FILE;
+			if (_shrink_chunk(last, keep) < 0)
+				return E_CANNOT_PROCEED;
+		}
+	} else if (_kfile_reserve(node, size, size) < 0)
+		return E_CANNOT_PROCEED;
+
+	node_set_size(node, size);
+	return 0;
+}
+
+/*
+ * Gives memory to the 'len' bytes starting at 'offset' without
+ * changing the file size, so that writing them later never has to
+ * allocate, copy a shared chunk or fault pages in.
+ */
+int
+kfallocate(KFILE kfile, unsigned long offset, unsigned long len) {
+	struct node *node = kfile->node;
+	Chunk *chunk;
+	unsigned long index, end = offset + len;
+
+	if (node->type != N_FILE)
+		return E_INVALID_TYPE;
+	if (node->readonly)
+		return E_READ_ONLY;
+	if (len == 0)
+		return 0;
+	if (_kfile_quota(node, end) < 0)
+		return E_QUOTA;
+
+	if (_kfile_reserve(node, end, 0) < 0)
+		return E_CANNOT_PROCEED;
+
+	index = offset / CHUNK_SIZE;
+	chunk = _chunk_at(node, offset);
+	for (; chunk != NULL && index * CHUNK_SIZE < end; chunk = chunk->next) {
+		if (_kfile_prepare(node, chunk, index, 1) < 0)
+			return E_CANNOT_PROCEED;
+		_prefault_chunk(chunk);
+		index++;
+	}
+
+	return 0;
+}
+
+/*
+ * Maps the memory of a chunk at 'addr', without copying it: only
+ * chunks with a mapping of their own (see _map_chunk()) can be mapped
+ * twice. The chunk is pinned on the view's 'pin' list, so that writes
+ * to the file copy it instead of showing through (see kclone()).
+ */
+static int
+_kmap_chunk(struct kmap *map, Chunk *chunk, char *addr, unsigned long len) {
+	long page = sysconf(_SC_PAGESIZE);
+	Chunk *next, *pin;
+
+	if (chunk->memory == NULL || chunk->placement != KALLOC_PLACE_MAPPED ||
+			CHUNK_SIZE % page != 0)
+		return E_CANNOT_PROCEED;
+
+	/* only this chunk, not the ones after it */
+	next = chunk->next;
+	chunk->next = NULL;
+	pin = kclone(chunk);
+	chunk->next = next;
+	if (pin == NULL)
+		return E_CANNOT_PROCEED;
+
+	len = (len + page - 1) / page * page;
+	if (mremap(chunk->memory, 0, len, MREMAP_MAYMOVE | MREMAP_FIXED, addr) == MAP_FAILED) {
+		kfree(pin);
+		return E_CANNOT_PROCEED;
+	}
+
+	pin->next = map->pin;
+	map->pin = pin;
+
+	return 0;
+}
+
+/*
+ * Gives a contiguous view of the content of a file, as it is now:
+ * later writes to the file don't show through. With KMMAP_READ the
+ * view can only be read, and the chunks with a mapping of their own
+ * are mapped in it in place; with KMMAP_PRIVATE it can be written too,
+ * without changing the file. Everything else is copied in the view,
+ * holes read as zeros.
+ */
+int
+kmmap(struct node *node, int mode, struct kmap *map) {
+	struct _KFILE kfile = { .node = node };
+	unsigned long off, index;
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned int len;
+	Chunk *chunk;
+
+	if (node->type != N_FILE)
+		return E_INVALID_TYPE;
+	if (mode != KMMAP_READ && mode != KMMAP_PRIVATE)
+		return E_INVALID_SYNTAX;
+
+	map->addr = NULL;
+	map->length = node->size;
+	map->mapped = 0;
+	map->pin = NULL;
+	if (node->size == 0)
+		return 0;
+
+	map->mapped = (node->size + page - 1) / page * page;
+	map->addr = mmap(NULL, map->mapped, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map->addr == MAP_FAILED) {
+		map->addr = NULL;
+		return E_CANNOT_PROCEED;
+	}
+
+	chunk = node->first_chunk;
+	for (off = 0, index = 0; off < node->size; off += len, index++) {
+		len = (node->size - off > CHUNK_SIZE) ? CHUNK_SIZE : node->size - off;
+		if (chunk != NULL && _kfile_prepare(node, chunk, index, 0) < 0) {
+			kmunmap(map);
+			return E_CANT_GET_EXT_FILE;
+		}
+
+		/* holes are left alone, the view reads as zeros already */
+		if (chunk != NULL && chunk->memory != NULL && (mode == KMMAP_PRIVATE ||
+				_kmap_chunk(map, chunk, (char *)map->addr + off, len) < 0)) {
+			if (kpread(&kfile, off, len, (char *)map->addr + off) != len) {
+				kmunmap(map);
+				return E_CANT_GET_EXT_FILE;
+			}
+		}
+
+		if (chunk != NULL)
+			chunk = chunk->next;
+	}
+
+	if (mode == KMMAP_READ && mprotect(map->addr, map->mapped, PROT_READ) < 0) {
+		kmunmap(map);
+		return E_CANNOT_PROCEED;
+	}
+
+	return 0;
+}
+
+/* Releases a view returned by kmmap() */
+void
+kmunmap(struct kmap *map) {
+	if (map->addr != NULL)
+		munmap(map->addr, map->mapped);
+	if (map->pin != NULL)
+		kfree(map->pin);
+
+	map->addr = NULL;
+	map->pin = NULL;
+}
+
+/*
+ * Checks the content of a file against the checksums kept while it
+ * was written. Chunks without memory have nothing to check.
+ */
+int
+kverify(struct node *node) {
+	Chunk *chunk;
+	void *memory;
+	int ret = 0;
+
+	if (node->type != N_FILE)
 		return E_INVALID_TYPE;
 
-	if (kfile->node->first_chunk == NULL)
-		kfile->node->first_chunk = kalloc(size);
+	/* clean chunks can be evicted meanwhile (see _kio()) */
+	if (epoch_enter() != 0)
+		return E_CANNOT_PROCEED;
+
+	for (chunk = node->first_chunk; chunk != NULL; chunk = chunk->next) {
+		memory = __atomic_load_n(&chunk->memory, __ATOMIC_ACQUIRE);
+		if (memory != NULL &&
+				crc32c_update(CRC32C_INIT, memory, chunk->size) != chunk->crc) {
+			ret = E_CHECKSUM;
+			break;
+		}
+	}
 
-	return _raw_kwrite(kfile->node->first_chunk, data, size);
+	epoch_exit();
+	return ret;
 }
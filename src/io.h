@@ -4,11 +4,54 @@
 #include "node.h"
 #include "kalloc.h"
 
+/*
+ * Reads and writes move two independent positions: kread continues
+ * where the last kread stopped, kwrite where the last kwrite stopped.
+ * kseek and krewind move both of them.
+ * The ra_* fields follow kread/kreadv to detect sequential reads and
+ * prefetch the chunks ahead of them.
+ * The rsv_* fields describe the span given by kwrite_reserve(), until
+ * it's committed.
+ */
 struct _KFILE {
 	struct node *node;
+	unsigned long rpos;
+	unsigned long wpos;
+
+	unsigned long ra_next;
+	unsigned long ra_chunk;
+	unsigned int ra_window;
+
+	Chunk *rsv_chunk;
+	unsigned int rsv_len;
+	unsigned int rsv_crc;
 };
 typedef struct _KFILE *KFILE;
 
+/* a buffer for vectored I/O (see kreadv/kwritev) */
+struct kiovec {
+	void *base;
+	unsigned int len;
+};
+
+/*
+ * A contiguous view of a file (see kmmap): a mapping of 'mapped'
+ * bytes. 'pin' holds the chunks mapped in place in the view, if any.
+ */
+struct kmap {
+	void *addr;
+	unsigned long length;
+	unsigned long mapped;
+	Chunk *pin;
+};
+
+#define KMMAP_READ    1
+#define KMMAP_PRIVATE 2
+
+/* read-ahead: maximum number of chunks and bytes prefetched */
+#define KF_READAHEAD_CHUNKS 8
+#define KF_PREFETCH_BYTES   4096
+
 /* these are used by kseek for relative seeking */
 #define KF_SEEK_START 1
 #define KF_SEEK_CURR  2
@@ -21,6 +64,23 @@ void krewind(KFILE);
 int kseek(KFILE, int, short int);
 unsigned int kread(KFILE, unsigned int, void *);
 unsigned int kwrite(KFILE, void *, unsigned int);
+unsigned int kpread(KFILE, unsigned long, unsigned int, void *);
+unsigned int kpwrite(KFILE, unsigned long, void *, unsigned int);
+long kreadv(KFILE, const struct kiovec *, int);
+long kwritev(KFILE, const struct kiovec *, int);
+long kpreadv(KFILE, unsigned long, const struct kiovec *, int);
+long kpwritev(KFILE, unsigned long, const struct kiovec *, int);
+long kwritefd(KFILE, int, unsigned long);
+int kload(int, unsigned long, Chunk **);
+int kattach(struct node *, Chunk *, unsigned long);
+long kwrite_reserve(KFILE, unsigned int, void **);
+int kwrite_commit(KFILE, unsigned int);
+int kbind(struct node *, const char *);
+int ktruncate(KFILE, unsigned long);
+int kfallocate(KFILE, unsigned long, unsigned long);
+int kverify(struct node *);
+int kmmap(struct node *, int, struct kmap *);
+void kmunmap(struct kmap *);
 
 KFILE _alloc_kfile(struct node *);
 
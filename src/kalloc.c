@@ -1,8 +1,16 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 
 #include "common.h"
+#include "errors.h"
 #include "kalloc.h"
+#include "crc32c.h"
+#include "epoch.h"
 
 /*
  * TODO: actually the whole kalloc/kfree mechanism is just a wrapper
@@ -10,17 +18,441 @@
  * manager on the top of brk()/sbrk().
  */
 
-int _mem_count = 0;
+long _mem_count = 0;
 
 /*
- * Allocates a set of memory chunks for the specified size.
+ * LRU lists of the chunks filled from a host file which haven't been
+ * modified since, one for each eviction priority (see chunk->priority):
+ * most recently used chunks are at the head. When _lru_limit is not 0,
+ * the lists never hold more than _lru_limit bytes, and chunks are
+ * evicted from the lowest priority list first.
+ * Chunks are freed from any thread (see the magazines below), so the
+ * lists, _lru_bytes and chunk->cached are only changed under _lru_lock.
+ * Other readers may still be copying out of an evicted chunk, so its
+ * memory is handed to epoch_retire() (once _lru_lock is released)
+ * rather than freed.
+ */
+static Chunk *_lru_head[KCACHE_PRIORITIES], *_lru_tail[KCACHE_PRIORITIES];
+static unsigned long _lru_bytes = 0, _lru_limit = 0;
+static pthread_mutex_t _lru_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct _kcache_retired {
+	void *memory;
+	unsigned int size;
+	unsigned char placement;
+	struct _kcache_retired *next;
+};
+
+/*
+ * Placement policy for chunk memory (see kalloc_set_policy()). Chunks
+ * smaller than KALLOC_HUGE_PAGE_SIZE always come from malloc(); bigger
+ * ones are mapped on their own when a policy is set, so that they can
+ * be backed by huge pages and bound to a NUMA node.
+ */
+static int _huge_policy = KALLOC_HUGE_NONE;
+static int _numa_policy = KALLOC_NUMA_FIRST_TOUCH;
+static struct kalloc_stats _stats;
+
+/* mbind() modes, from <numaif.h> which isn't always installed */
+#define MPOL_PREFERRED_  1
+#define MPOL_INTERLEAVE_ 3
+
+/*
+ * Returns the number of possible NUMA nodes (the highest node id in
+ * /sys/devices/system/node/online plus one). Machines without NUMA
+ * support have a single node.
+ */
+static unsigned int
+_numa_nodes(void) {
+	FILE *f;
+	int c;
+	unsigned int id = 0, max = 0;
+
+	if (_stats.nodes > 0)
+		return _stats.nodes;
+
+	f = fopen("/sys/devices/system/node/online", "r");
+	if (f != NULL) {
+		/* a list of ranges such as "0-1,4": only the highest id matters */
+		while ((c = fgetc(f)) != EOF) {
+			if (c >= '0' && c <= '9')
+				id = id * 10 + (c - '0');
+			else {
+				if (id > max)
+					max = id;
+				id = 0;
+			}
+		}
+		if (id > max)
+			max = id;
+		fclose(f);
+	}
+
+	_stats.nodes = (max < KALLOC_MAX_NUMA_NODES) ? max + 1 : KALLOC_MAX_NUMA_NODES;
+	return _stats.nodes;
+}
+
+/* Returns the NUMA node the calling thread is running on */
+static unsigned int
+_numa_current(void) {
+	unsigned int cpu, node = 0;
+
+#ifdef SYS_getcpu
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		node = 0;
+#endif
+	return (node < _numa_nodes()) ? node : 0;
+}
+
+/*
+ * Length of the mapping behind a mapped chunk. Mappings always cover
+ * a whole chunk, so that growing the last chunk of a file never has to
+ * move it (untouched pages don't take any memory).
+ */
+static size_t
+_map_length(unsigned char placement) {
+	size_t align = (placement == KALLOC_PLACE_HUGETLB) ?
+		KALLOC_HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+
+	return (CHUNK_SIZE + align - 1) / align * align;
+}
+
+/*
+ * Maps the memory for a chunk following the current policy, binding
+ * it to 'node' (or interleaving it when node is KALLOC_NODE_INTERLEAVED).
+ * Returns NULL if the memory can't be mapped.
+ */
+static void *
+_map_chunk(unsigned char *placement, unsigned int node) {
+	size_t length, extra = 0;
+	char *memory = MAP_FAILED, *aligned;
+	unsigned long mask;
+
+#ifdef MAP_HUGETLB
+	if (_huge_policy == KALLOC_HUGE_EXPLICIT) {
+		*placement = KALLOC_PLACE_HUGETLB;
+		memory = mmap(NULL, _map_length(*placement), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		/* no huge pages reserved: fall back to transparent ones */
+	}
+#endif
+
+	if (memory == MAP_FAILED) {
+		*placement = KALLOC_PLACE_MAPPED;
+		length = _map_length(*placement);
+
+		/* transparent huge pages are only used for aligned ranges */
+		if (_huge_policy != KALLOC_HUGE_NONE) {
+			*placement = KALLOC_PLACE_THP;
+			extra = KALLOC_HUGE_PAGE_SIZE;
+		}
+
+		/*
+		 * plain mappings are shared (with nobody), so that their pages
+		 * can be mapped again in place by kmmap()
+		 */
+		memory = mmap(NULL, length + extra, PROT_READ | PROT_WRITE,
+				((extra > 0) ? MAP_PRIVATE : MAP_SHARED) | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			return NULL;
+
+		if (extra > 0) {
+			aligned = (char *)(((unsigned long)memory + KALLOC_HUGE_PAGE_SIZE - 1) &
+					~((unsigned long)KALLOC_HUGE_PAGE_SIZE - 1));
+			if (aligned > memory)
+				munmap(memory, aligned - memory);
+			munmap(aligned + length, memory + extra - aligned);
+			memory = aligned;
+#ifdef MADV_HUGEPAGE
+			madvise(memory, length, MADV_HUGEPAGE);
+#endif
+		}
+	}
+
+	/* must happen before the first access to be of any use */
+#ifdef SYS_mbind
+	if (_numa_policy == KALLOC_NUMA_INTERLEAVE) {
+		mask = (_numa_nodes() >= 64) ? ~0UL : (1UL << _numa_nodes()) - 1;
+		syscall(SYS_mbind, memory, _map_length(*placement), MPOL_INTERLEAVE_,
+				&mask, sizeof(mask) * 8 + 1, 0);
+	} else if (_numa_policy == KALLOC_NUMA_LOCAL) {
+		mask = 1UL << node;
+		syscall(SYS_mbind, memory, _map_length(*placement), MPOL_PREFERRED_,
+				&mask, sizeof(mask) * 8 + 1, 0);
+	}
+#else
+	(void)mask;
+#endif
+
+	return memory;
+}
+
+/*
+ * Adds (or removes, with a negative delta) bytes to the placement
+ * stats. Chunks are allocated and freed by any thread.
+ */
+static void
+_account(Chunk *chunk, long delta) {
+	unsigned long *bytes = NULL;
+
+	__atomic_fetch_add(&_mem_count, delta, __ATOMIC_RELAXED);
+
+	switch (chunk->placement) {
+	case KALLOC_PLACE_HEAP:    bytes = &_stats.heap_bytes; break;
+	case KALLOC_PLACE_MAPPED:  bytes = &_stats.mapped_bytes; break;
+	case KALLOC_PLACE_THP:     bytes = &_stats.thp_bytes; break;
+	case KALLOC_PLACE_HUGETLB: bytes = &_stats.hugetlb_bytes; break;
+	}
+	if (bytes != NULL)
+		__atomic_fetch_add(bytes, delta, __ATOMIC_RELAXED);
+
+	if (chunk->numa_node == KALLOC_NODE_INTERLEAVED)
+		__atomic_fetch_add(&_stats.interleaved_bytes, delta, __ATOMIC_RELAXED);
+	else __atomic_fetch_add(&_stats.node_bytes[chunk->numa_node], delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * Per thread caches ("magazines") of free chunk headers and of free
+ * CHUNK_SIZE heap buffers, so that the common kalloc()/kfree() never
+ * touches shared state. A thread whose magazine is full or empty
+ * moves half a magazine at once from or to the depot, which is shared
+ * and guarded by a spinlock. Headers and buffers in the depot are
+ * linked through their first word.
+ */
+struct kalloc_magazine {
+	unsigned int rounds, size;
+	void *round[KALLOC_MAGAZINE_SIZE];
+};
+
+struct kalloc_depot {
+	void *head;
+	unsigned int count, limit;
+};
+
+static __thread struct kalloc_magazine _headers = { 0, KALLOC_MAGAZINE_SIZE, { NULL } };
+static __thread struct kalloc_magazine _buffers = { 0, KALLOC_MAGAZINE_BUFFERS, { NULL } };
+static __thread int _magazines_used = 0;
+
+static struct kalloc_depot _header_depot = { NULL, 0, 0 };
+static struct kalloc_depot _buffer_depot = { NULL, 0, KALLOC_DEPOT_BUFFERS };
+static char _depot_lock = 0;
+
+static pthread_key_t _magazine_key;
+static pthread_once_t _magazine_once = PTHREAD_ONCE_INIT;
+
+static void
+_depot_lock_acquire(void) {
+	while (__atomic_test_and_set(&_depot_lock, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void
+_depot_lock_release(void) {
+	__atomic_clear(&_depot_lock, __ATOMIC_RELEASE);
+}
+
+/*
+ * Moves up to 'n' rounds of a magazine to its depot. What doesn't fit
+ * in a depot with a limit is freed.
+ */
+static void
+_magazine_flush(struct kalloc_magazine *mag, struct kalloc_depot *depot, unsigned int n) {
+	void *head = NULL, *item;
+
+	if (n > mag->rounds)
+		n = mag->rounds;
+
+	_depot_lock_acquire();
+	while (n > 0 && (depot->limit == 0 || depot->count < depot->limit)) {
+		item = mag->round[--mag->rounds];
+		*(void **)item = depot->head;
+		depot->head = item;
+		depot->count++;
+		n--;
+	}
+	_depot_lock_release();
+
+	while (n-- > 0) {
+		item = mag->round[--mag->rounds];
+		*(void **)item = head;
+		head = item;
+	}
+	while (head != NULL) {
+		item = *(void **)head;
+		free(head);
+		head = item;
+	}
+}
+
+/* Refills an empty magazine with up to half of its size from the depot */
+static void
+_magazine_fill(struct kalloc_magazine *mag, struct kalloc_depot *depot) {
+	void *item;
+
+	if (__atomic_load_n(&depot->head, __ATOMIC_RELAXED) == NULL)
+		return;
+
+	_depot_lock_acquire();
+	while (mag->rounds < mag->size / 2 + 1 && depot->head != NULL) {
+		item = depot->head;
+		depot->head = *(void **)item;
+		depot->count--;
+		mag->round[mag->rounds++] = item;
+	}
+	_depot_lock_release();
+}
+
+/* Gives the magazines of an exiting thread back to the depots */
+static void
+_magazine_release(void *unused) {
+	(void)unused;
+
+	_magazine_flush(&_headers, &_header_depot, _headers.rounds);
+	_magazine_flush(&_buffers, &_buffer_depot, _buffers.rounds);
+}
+
+static void
+_magazine_init(void) {
+	pthread_key_create(&_magazine_key, _magazine_release);
+}
+
+/* Makes sure the magazines of this thread are released when it exits */
+static void
+_magazine_register(void) {
+	if (_magazines_used)
+		return;
+
+	pthread_once(&_magazine_once, _magazine_init);
+	pthread_setspecific(_magazine_key, &_magazines_used);
+	_magazines_used = 1;
+}
+
+/* Takes an object from a magazine, or returns NULL if there's none */
+static void *
+_magazine_get(struct kalloc_magazine *mag, struct kalloc_depot *depot) {
+	if (mag->rounds == 0)
+		_magazine_fill(mag, depot);
+	if (mag->rounds == 0)
+		return NULL;
+
+	return mag->round[--mag->rounds];
+}
+
+/* Puts an object (allocated with malloc()) in a magazine */
+static void
+_magazine_put(struct kalloc_magazine *mag, struct kalloc_depot *depot, void *item) {
+	_magazine_register();
+
+	if (mag->rounds == mag->size)
+		_magazine_flush(mag, depot, mag->size / 2);
+	mag->round[mag->rounds++] = item;
+}
+
+/* Returns a zeroed chunk header */
+static Chunk *
+_chunk_header(void) {
+	Chunk *chunk = (Chunk *)_magazine_get(&_headers, &_header_depot);
+
+	if (chunk == NULL)
+		return (Chunk *)calloc(1, sizeof(Chunk));
+
+	memset(chunk, 0, sizeof(Chunk));
+	return chunk;
+}
+
+/*
+ * Returns 'size' bytes of zeroed memory for 'chunk', following the
+ * placement policy, and records in the chunk where they come from.
+ * The memory is not accounted yet.
+ */
+static void *
+_mem_alloc(Chunk *chunk, unsigned int size) {
+	void *memory = NULL;
+	unsigned int node;
+
+	node = (_numa_nodes() > 1) ? _numa_current() : 0;
+
+	if (size >= KALLOC_HUGE_PAGE_SIZE && (_huge_policy != KALLOC_HUGE_NONE ||
+				_numa_policy != KALLOC_NUMA_FIRST_TOUCH)) {
+		if (_numa_policy == KALLOC_NUMA_INTERLEAVE)
+			node = KALLOC_NODE_INTERLEAVED;
+		memory = _map_chunk(&chunk->placement, node);
+	}
+
+	if (memory == NULL) {
+		chunk->placement = KALLOC_PLACE_HEAP;
+		if (node == KALLOC_NODE_INTERLEAVED)
+			node = 0;
+		if (size == CHUNK_SIZE &&
+				(memory = _magazine_get(&_buffers, &_buffer_depot)) != NULL)
+			memset(memory, 0, size);
+		else memory = calloc(1, size);
+	}
+
+	chunk->numa_node = node;
+	return memory;
+}
+
+/* Releases 'size' bytes of memory returned from _mem_alloc() */
+static void
+_mem_release(void *memory, unsigned int size, unsigned char placement) {
+	if (placement != KALLOC_PLACE_HEAP)
+		munmap(memory, _map_length(placement));
+	else if (size == CHUNK_SIZE)
+		_magazine_put(&_buffers, &_buffer_depot, memory);
+	else free(memory);
+}
+
+/*
+ * Allocates a set of memory chunks for the specified size. Every chunk
+ * holds at most CHUNK_SIZE bytes, so the returned list is made of
+ * CHUNK_SIZE sized chunks followed by a (possibly smaller) last one.
  * Memory allocated with kalloc() can be freed with kfree()
  */
 Chunk *
 kalloc(int size) {
-	Chunk *chunk = _alloc_chunk(size);
-	_mem_count += size;
-	return chunk;
+	Chunk *first = NULL, *last = NULL, *chunk;
+	int chunk_size;
+
+	while (size > 0) {
+		chunk_size = (size > CHUNK_SIZE) ? CHUNK_SIZE : size;
+		chunk = _alloc_chunk(chunk_size);
+
+		if (last == NULL)
+			first = chunk;
+		else last->next = chunk;
+		last = chunk;
+
+		size -= chunk_size;
+	}
+
+	return first;
+}
+
+/*
+ * Allocates the list of chunks for 'size' bytes, without any memory
+ * behind them: memory is given to a chunk only when it's populated
+ * (see _populate_chunk()).
+ */
+Chunk *
+kalloc_lazy(unsigned long size) {
+	Chunk *first = NULL, *last = NULL, *chunk;
+	unsigned int chunk_size;
+
+	while (size > 0) {
+		chunk_size = (size > CHUNK_SIZE) ? CHUNK_SIZE : size;
+		chunk = _chunk_header();
+		chunk->size = chunk_size;
+
+		if (last == NULL)
+			first = chunk;
+		else last->next = chunk;
+		last = chunk;
+
+		size -= chunk_size;
+	}
+
+	return first;
 }
 
 /*
@@ -30,60 +462,555 @@ kalloc(int size) {
  */
 Chunk *
 _alloc_chunk(const int size) {
-	Chunk *chunk = (Chunk *)malloc(sizeof(Chunk));
+	Chunk *chunk = _chunk_header();
 	chunk->size = size;
-	chunk->memory = (void *)malloc(size);
+	chunk->memory = _mem_alloc(chunk, size);
+	chunk->crc = crc32c_shift(CRC32C_INIT, size);
+	_account(chunk, size);
 	return chunk;
 }
 
+/* Gives zeroed memory to a chunk allocated with kalloc_lazy() */
+int
+_populate_chunk(Chunk *chunk) {
+	if (chunk->memory != NULL)
+		return 0;
+
+	chunk->memory = _mem_alloc(chunk, chunk->size);
+	if (chunk->memory == NULL)
+		return E_CANNOT_PROCEED;
+
+	chunk->crc = crc32c_shift(CRC32C_INIT, chunk->size);
+	_account(chunk, chunk->size);
+	return 0;
+}
+
+/* Gives back the memory of a chunk which isn't in the LRU list */
+static void
+_drop_memory(Chunk *chunk) {
+	_account(chunk, -(long)chunk->size);
+	_mem_release(chunk->memory, chunk->size, chunk->placement);
+	chunk->memory = NULL;
+}
+
+/* Takes the memory back from a chunk, which becomes a hole again */
+void
+_depopulate_chunk(Chunk *chunk) {
+	if (chunk->memory == NULL)
+		return;
+
+	kcache_remove(chunk);
+	_drop_memory(chunk);
+}
+
+/*
+ * Enlarges a chunk up to 'size' bytes (which can't be more than
+ * CHUNK_SIZE), preserving its content. Used to fill the last chunk
+ * of a list before appending new ones. A chunk in the LRU list is
+ * taken out of it, since the list accounts for its old size.
+ */
+int
+_grow_chunk(Chunk *chunk, const unsigned int size) {
+	void *memory;
+	Chunk moved;
+
+	if (size > CHUNK_SIZE)
+		return E_OUT_OF_BOUNDS;
+	if (size <= chunk->size)
+		return 0;
+
+	if (chunk->shared != NULL && _unshare_chunk(chunk) < 0)
+		return E_CANNOT_PROCEED;
+	kcache_remove(chunk);
+
+	if (chunk->memory != NULL && chunk->placement != KALLOC_PLACE_HEAP) {
+		/* mappings always cover a whole chunk */
+		memset((char *)chunk->memory + chunk->size, 0, size - chunk->size);
+		_account(chunk, size - chunk->size);
+	} else if (chunk->memory != NULL && size >= KALLOC_HUGE_PAGE_SIZE &&
+			chunk->size < KALLOC_HUGE_PAGE_SIZE &&
+			(_huge_policy != KALLOC_HUGE_NONE || _numa_policy != KALLOC_NUMA_FIRST_TOUCH)) {
+		/* big enough to follow the placement policy: move it once */
+		memory = _mem_alloc(&moved, size);
+		if (memory == NULL)
+			return E_CANNOT_PROCEED;
+
+		memcpy(memory, chunk->memory, chunk->size);
+		_account(chunk, -(long)chunk->size);
+		_mem_release(chunk->memory, chunk->size, chunk->placement);
+		chunk->memory = memory;
+		chunk->placement = moved.placement;
+		chunk->numa_node = moved.numa_node;
+		_account(chunk, size);
+	} else if (chunk->memory != NULL) {
+		memory = realloc(chunk->memory, size);
+		if (memory == NULL)
+			return E_CANNOT_PROCEED;
+
+		memset((char *)memory + chunk->size, 0, size - chunk->size);
+		chunk->memory = memory;
+		_account(chunk, size - chunk->size);
+	}
+
+	/* the new bytes are zeros */
+	if (chunk->memory != NULL)
+		chunk->crc = crc32c_shift(chunk->crc, size - chunk->size);
+	chunk->size = size;
+
+	return 0;
+}
+
+/*
+ * Shrinks a chunk to 'size' bytes (more than 0), giving back the
+ * memory past the new end. The bytes in between are zeroed again if
+ * the chunk grows later (see _grow_chunk()).
+ */
+int
+_shrink_chunk(Chunk *chunk, const unsigned int size) {
+	void *memory;
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned long from;
+
+	if (size == 0)
+		return E_OUT_OF_BOUNDS;
+	if (size >= chunk->size)
+		return 0;
+
+	if (chunk->memory == NULL) {
+		chunk->size = size;
+		return 0;
+	}
+
+	if (chunk->shared != NULL && _unshare_chunk(chunk) < 0)
+		return E_CANNOT_PROCEED;
+	kcache_remove(chunk);
+
+	if (chunk->placement == KALLOC_PLACE_HEAP) {
+		memory = realloc(chunk->memory, size);
+		if (memory != NULL)
+			chunk->memory = memory;
+	} else {
+		/* mappings stay whole, the pages past the end are dropped */
+		from = ((unsigned long)size + page - 1) / page * page;
+		if (from < chunk->size)
+			madvise((char *)chunk->memory + from, chunk->size - from,
+					(chunk->placement == KALLOC_PLACE_MAPPED) ? MADV_REMOVE : MADV_DONTNEED);
+	}
+
+	_account(chunk, -(long)(chunk->size - size));
+	chunk->size = size;
+	chunk->crc = _chunk_crc(chunk);
+
+	return 0;
+}
+
+/*
+ * Touches every page of a chunk, so that the kernel doesn't have to
+ * fault them in when they're written for the first time.
+ */
+void
+_prefault_chunk(Chunk *chunk) {
+	volatile char *memory = (volatile char *)chunk->memory;
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned int i;
+
+	if (memory == NULL)
+		return;
+
+	for (i = 0; i < chunk->size; i += page)
+		memory[i] = memory[i];
+}
+
+/* Removes a chunk from the list of chunks sharing its memory */
+static void
+_unlink_shared(Chunk *chunk) {
+	Chunk *prev = chunk->shared;
+
+	while (prev->shared != chunk)
+		prev = prev->shared;
+
+	/* the only remaining user owns the memory again */
+	prev->shared = (chunk->shared == prev) ? NULL : chunk->shared;
+	chunk->shared = NULL;
+}
+
+/*
+ * Duplicates a list of chunks. The new chunks share the memory of the
+ * original ones until either copy is modified (see _unshare_chunk()),
+ * so cloning doesn't depend on the amount of data. Returns NULL if
+ * there's no memory left for the new headers.
+ */
+Chunk *
+kclone(Chunk *chunk) {
+	Chunk *first = NULL, *last = NULL, *copy;
+
+	for (; chunk != NULL; chunk = chunk->next) {
+		copy = _chunk_header();
+		if (copy == NULL) {
+			kfree(first);
+			return NULL;
+		}
+		/*
+		 * shared memory can't be evicted behind the back of its users,
+		 * and readers may evict it until it's out of the cache
+		 */
+		kcache_remove(chunk);
+		copy->size = chunk->size;
+		copy->memory = __atomic_load_n(&chunk->memory, __ATOMIC_ACQUIRE);
+		copy->crc = chunk->crc;
+		copy->placement = chunk->placement;
+		copy->numa_node = chunk->numa_node;
+
+		if (copy->memory != NULL) {
+			copy->shared = (chunk->shared != NULL) ? chunk->shared : chunk;
+			chunk->shared = copy;
+		}
+
+		if (last == NULL)
+			first = copy;
+		else last->next = copy;
+		last = copy;
+	}
+
+	return first;
+}
+
+/*
+ * Gives a private copy of its memory to a chunk sharing it with other
+ * chunks. Must be called before modifying a shared chunk.
+ */
+int
+_unshare_chunk(Chunk *chunk) {
+	void *memory;
+	Chunk copy;
+
+	if (chunk->shared == NULL)
+		return 0;
+
+	memory = _mem_alloc(&copy, chunk->size);
+	if (memory == NULL)
+		return E_CANNOT_PROCEED;
+
+	memcpy(memory, chunk->memory, chunk->size);
+	_unlink_shared(chunk);
+	chunk->memory = memory;
+	chunk->placement = copy.placement;
+	chunk->numa_node = copy.numa_node;
+	_account(chunk, chunk->size);
+
+	return 0;
+}
+
 /*
  * Frees the memory allocated from the list of chunks whose the
  * chunk parameter is the first chunk in the list
  */
 void
 kfree(Chunk *chunk) {
-	_mem_count -= chunk->size;
-	free(chunk->memory);
-	free(chunk);
+	Chunk *next;
+
+	while (chunk != NULL) {
+		next = chunk->next;
+
+		if (chunk->cached)
+			kcache_remove(chunk);
+		if (chunk->shared != NULL)
+			/* somebody else is still using the memory */
+			_unlink_shared(chunk);
+		else if (chunk->memory != NULL) {
+			_account(chunk, -(long)chunk->size);
+			_mem_release(chunk->memory, chunk->size, chunk->placement);
+		}
+		_magazine_put(&_headers, &_header_depot, chunk);
 
-	/* invalidate the pointer to the chunk */
-	chunk = NULL;
+		chunk = next;
+	}
 }
 
 
 /*
- * Read the specified size from chunk.
- * It returns the effective number of read bytes (i.e. if 'size' is greater
- * than the actual allocated memory, the whole allocated memory).
+ * Computes the checksum of the memory of a chunk from scratch. It
+ * matches chunk->crc unless the memory has been corrupted (or written
+ * without going through _raw_kwrite() or _chunk_crc_patch()).
+ */
+unsigned int
+_chunk_crc(Chunk *chunk) {
+	void *memory = __atomic_load_n(&chunk->memory, __ATOMIC_ACQUIRE);
+
+	if (memory == NULL)
+		return crc32c_shift(CRC32C_INIT, chunk->size);
+
+	return crc32c_update(CRC32C_INIT, memory, chunk->size);
+}
+
+/*
+ * Updates the checksum of a chunk after its 'len' bytes at 'offset'
+ * have changed. 'delta' is the crc32c_delta() of the old and the new
+ * bytes. Costs nothing for writes at the end of the chunk.
+ */
+void
+_chunk_crc_patch(Chunk *chunk, unsigned int offset, unsigned int len, unsigned int delta) {
+	chunk->crc ^= crc32c_shift(delta, chunk->size - offset - len);
+}
+
+/*
+ * Read up to 'size' bytes from chunk, starting at 'offset'.
+ * It returns the effective number of read bytes (i.e. if the requested
+ * range goes past the allocated memory, only the bytes up to the end
+ * of the chunk).
  * Do not use this function directly, we provided you kread which
  * will make your life much easier.
  */
 unsigned int
-_raw_kread(Chunk *c, unsigned int size, void *buffer) {
-	unsigned int read_bytes = 0, copy_size;
-	Chunk *chunk = c;
+_raw_kread(Chunk *chunk, unsigned int offset, unsigned int size, void *buffer) {
+	return _raw_kread_memory(chunk,
+			__atomic_load_n(&chunk->memory, __ATOMIC_ACQUIRE),
+			offset, size, buffer);
+}
 
-	copy_size = (size <= chunk->size) ? size : chunk->size;
-	memcpy(buffer, chunk->memory, copy_size);
+/*
+ * Same as _raw_kread(), but copies from 'memory', which the caller
+ * loaded from chunk->memory earlier: an evicted chunk's memory stays
+ * valid until the caller leaves its epoch (see kcache_insert()).
+ */
+unsigned int
+_raw_kread_memory(Chunk *chunk, const void *memory, unsigned int offset,
+		unsigned int size, void *buffer) {
+	unsigned int copy_size;
 
-	return read_bytes;
+	if (offset >= chunk->size)
+		return 0;
+
+	copy_size = (size <= chunk->size - offset) ? size : chunk->size - offset;
+	if (memory == NULL)
+		memset(buffer, 0, copy_size);
+	else memcpy(buffer, (const char *)memory + offset, copy_size);
+
+	return copy_size;
 }
 
 /*
- * Writes the specified 'size' number of bytes in the allocated chunk.
- * Returns the actual number of written bytes (i.e. if 'size' is greater
- * than the actual allocated memory, the whole allocated memory).
+ * Writes the specified 'size' number of bytes in the allocated chunk,
+ * starting at 'offset'.
+ * Returns the actual number of written bytes (i.e. if the requested
+ * range goes past the allocated memory, only the bytes up to the end
+ * of the chunk).
  * Do not use this function directly, we provided you kwrite which
  * will make your life much easier.
  * Please note that this function does NOT allocate the needed memory.
  */
 unsigned int
-_raw_kwrite(Chunk *c, void *data, unsigned int size) {
-	Chunk *chunk = c;
-	unsigned int written_bytes = 0, copy_size;
+_raw_kwrite(Chunk *chunk, unsigned int offset, void *data, unsigned int size) {
+	unsigned int copy_size;
+
+	if (offset >= chunk->size || chunk->memory == NULL)
+		return 0;
 
-	copy_size = (size <= chunk->size) ? size : chunk->size;
-	memcpy(chunk->memory, data, copy_size);
+	copy_size = (size <= chunk->size - offset) ? size : chunk->size - offset;
+	_chunk_crc_patch(chunk, offset, copy_size,
+			crc32c_delta((char *)chunk->memory + offset, data, copy_size));
+	memcpy((char *)chunk->memory + offset, data, copy_size);
 
-	return written_bytes;
+	return copy_size;
+}
+
+/* Takes a chunk out of its LRU list, with _lru_lock held */
+static void
+_kcache_unlink(Chunk *chunk) {
+	if (chunk->lru_prev != NULL)
+		chunk->lru_prev->lru_next = chunk->lru_next;
+	else _lru_head[chunk->priority] = chunk->lru_next;
+	if (chunk->lru_next != NULL)
+		chunk->lru_next->lru_prev = chunk->lru_prev;
+	else _lru_tail[chunk->priority] = chunk->lru_prev;
+
+	chunk->lru_prev = chunk->lru_next = NULL;
+	__atomic_store_n(&chunk->cached, 0, __ATOMIC_RELAXED);
+	_lru_bytes -= chunk->size;
+}
+
+/* Adds a chunk at the head of its LRU list, with _lru_lock held */
+static void
+_kcache_link(Chunk *chunk) {
+	chunk->lru_prev = NULL;
+	chunk->lru_next = _lru_head[chunk->priority];
+	if (_lru_head[chunk->priority] != NULL)
+		_lru_head[chunk->priority]->lru_prev = chunk;
+	else _lru_tail[chunk->priority] = chunk;
+	_lru_head[chunk->priority] = chunk;
+	__atomic_store_n(&chunk->cached, 1, __ATOMIC_RELAXED);
+	_lru_bytes += chunk->size;
+}
+
+/*
+ * Drops the memory of a chunk in the LRU list, with _lru_lock held.
+ * The memory is queued on 'retired', for _kcache_retire() to hand to
+ * epoch_retire() once the lock is released.
+ */
+static int
+_kcache_evict(Chunk *chunk, struct _kcache_retired **retired) {
+	struct _kcache_retired *r;
+
+	r = (struct _kcache_retired *)malloc(sizeof(struct _kcache_retired));
+	if (r == NULL)
+		return E_CANNOT_PROCEED;
+
+	_kcache_unlink(chunk);
+	r->memory = chunk->memory;
+	r->size = chunk->size;
+	r->placement = chunk->placement;
+	r->next = *retired;
+	*retired = r;
+
+	_account(chunk, -(long)chunk->size);
+	__atomic_store_n(&chunk->memory, NULL, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void
+_kcache_free(void *ptr) {
+	struct _kcache_retired *r = (struct _kcache_retired *)ptr;
+
+	_mem_release(r->memory, r->size, r->placement);
+	free(r);
+}
+
+static void
+_kcache_retire(struct _kcache_retired *retired) {
+	struct _kcache_retired *next;
+
+	for (; retired != NULL; retired = next) {
+		next = retired->next;
+		epoch_retire(retired, _kcache_free);
+	}
+}
+
+/*
+ * Returns the least recently used chunk of the lowest priority list
+ * (but never 'except'), or NULL if there's none.
+ */
+static Chunk *
+_kcache_victim(Chunk *except) {
+	unsigned int i;
+
+	for (i = 0; i < KCACHE_PRIORITIES; i++) {
+		if (_lru_tail[i] != NULL && _lru_tail[i] != except)
+			return _lru_tail[i];
+		if (_lru_tail[i] != NULL && _lru_tail[i]->lru_prev != NULL)
+			return _lru_tail[i]->lru_prev;
+	}
+
+	return NULL;
+}
+
+/*
+ * Adds a freshly populated chunk at the head of the LRU list of its
+ * priority. If the lists are now over their limit, the least recently
+ * used chunks are evicted (never the one just added).
+ */
+void
+kcache_insert(Chunk *chunk) {
+	struct _kcache_retired *retired = NULL;
+	Chunk *victim;
+
+	if (chunk->priority >= KCACHE_PRIORITIES)
+		chunk->priority = KCACHE_PRIORITIES - 1;
+
+	pthread_mutex_lock(&_lru_lock);
+	if (!chunk->cached) {
+		_kcache_link(chunk);
+		while (_lru_limit > 0 && _lru_bytes > _lru_limit) {
+			victim = _kcache_victim(chunk);
+			if (victim == NULL || _kcache_evict(victim, &retired) < 0)
+				break;
+		}
+	}
+	pthread_mutex_unlock(&_lru_lock);
+
+	_kcache_retire(retired);
+}
+
+/* Moves a chunk at the head of its LRU list */
+void
+kcache_touch(Chunk *chunk) {
+	if (!__atomic_load_n(&chunk->cached, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&_lru_lock);
+	if (chunk->cached && _lru_head[chunk->priority] != chunk) {
+		_kcache_unlink(chunk);
+		_kcache_link(chunk);
+	}
+	pthread_mutex_unlock(&_lru_lock);
+}
+
+/*
+ * Removes a chunk from the LRU list, so that it won't be evicted
+ * (i.e. because it's about to be modified). Its memory is kept.
+ * Chunks which aren't cached don't take the lock.
+ */
+void
+kcache_remove(Chunk *chunk) {
+	if (!__atomic_load_n(&chunk->cached, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&_lru_lock);
+	if (chunk->cached)
+		_kcache_unlink(chunk);
+	pthread_mutex_unlock(&_lru_lock);
+}
+
+/*
+ * Sets the maximum number of bytes kept in evictable chunks (0 means
+ * no limit) and evicts chunks until the new limit is met.
+ */
+void
+kcache_set_limit(unsigned long bytes) {
+	struct _kcache_retired *retired = NULL;
+
+	pthread_mutex_lock(&_lru_lock);
+	_lru_limit = bytes;
+
+	while (_lru_limit > 0 && _lru_bytes > _lru_limit)
+		if (_kcache_evict(_kcache_victim(NULL), &retired) < 0)
+			break;
+	pthread_mutex_unlock(&_lru_lock);
+
+	_kcache_retire(retired);
+}
+
+/* Returns the number of bytes currently held by evictable chunks */
+unsigned long
+kcache_get_bytes(void) {
+	unsigned long bytes;
+
+	pthread_mutex_lock(&_lru_lock);
+	bytes = _lru_bytes;
+	pthread_mutex_unlock(&_lru_lock);
+
+	return bytes;
+}
+
+/*
+ * Sets where the memory of the chunks allocated from now on comes
+ * from. 'huge' is one of KALLOC_HUGE_* and 'numa' one of KALLOC_NUMA_*:
+ * explicit huge pages need a pool reserved by the administrator
+ * (vm.nr_hugepages), transparent ones are used when no pool is there.
+ */
+int
+kalloc_set_policy(int huge, int numa) {
+	if (huge < KALLOC_HUGE_NONE || huge > KALLOC_HUGE_EXPLICIT ||
+			numa < KALLOC_NUMA_FIRST_TOUCH || numa > KALLOC_NUMA_INTERLEAVE)
+		return E_INVALID_SYNTAX;
+
+	_huge_policy = huge;
+	_numa_policy = numa;
+	return 0;
+}
+
+/* Fills 'stats' with the number of bytes allocated per placement */
+void
+kalloc_get_stats(struct kalloc_stats *stats) {
+	_numa_nodes();
+	memcpy(stats, &_stats, sizeof(struct kalloc_stats));
 }
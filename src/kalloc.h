@@ -1,16 +1,104 @@
 #ifndef KMALLOC_H
 #define KMALLOC_H
 
+#define KALLOC_HUGE_PAGE_SIZE 2097152
+#define KALLOC_MAX_NUMA_NODES 64
+#define KALLOC_NODE_INTERLEAVED 255
+
+/*
+ * Free chunk headers and CHUNK_SIZE heap buffers kept by each thread
+ * for reuse, and buffers kept in the shared depot (see kalloc.c)
+ */
+#define KALLOC_MAGAZINE_SIZE 32
+#define KALLOC_MAGAZINE_BUFFERS 4
+#define KALLOC_DEPOT_BUFFERS 8
+
+/* evictable chunks with a lower priority are dropped first */
+#define KCACHE_PRIORITIES 4
+#define KCACHE_DEFAULT_PRIORITY 1
+
+/* Huge pages policy */
+#define KALLOC_HUGE_NONE        0
+#define KALLOC_HUGE_TRANSPARENT 1
+#define KALLOC_HUGE_EXPLICIT    2
+
+/* NUMA policy */
+#define KALLOC_NUMA_FIRST_TOUCH 0
+#define KALLOC_NUMA_LOCAL       1
+#define KALLOC_NUMA_INTERLEAVE  2
+
+/* Where the memory of a chunk comes from */
+#define KALLOC_PLACE_HEAP    0
+#define KALLOC_PLACE_MAPPED  1
+#define KALLOC_PLACE_THP     2
+#define KALLOC_PLACE_HUGETLB 3
+
+struct kalloc_stats {
+	unsigned long heap_bytes;
+	unsigned long mapped_bytes;
+	unsigned long thp_bytes;
+	unsigned long hugetlb_bytes;
+	unsigned long interleaved_bytes;
+	unsigned int nodes;
+	unsigned long node_bytes[KALLOC_MAX_NUMA_NODES];
+};
+
+/*
+ * A chunk whose memory is NULL has no memory behind it yet: reading
+ * it gives zeros. Chunks filled from a host file (see kbind) are kept
+ * in a LRU list while they're clean, and can be dropped at any time
+ * (those with the lowest 'priority' first): their memory is retired
+ * through epoch_retire(), so readers must load it once and hold an
+ * epoch while they copy from it. Readers racing on the same empty
+ * chunk take turns through 'filling', so that it's filled only once.
+ * Chunks sharing the same memory (see kclone) are linked in a circular
+ * list through 'shared', which is NULL for chunks owning their memory.
+ * 'placement' and 'numa_node' tell where the memory comes from.
+ * 'crc' is the raw CRC32C register for the 'size' bytes of memory, kept
+ * up to date by every write (see crc32c.h); it's meaningless while
+ * memory is NULL.
+ */
 typedef struct _chunk {
 	unsigned int size;
 	void *memory;
+	struct _chunk *next;
+	struct _chunk *shared;
+
+	unsigned int crc;
+
+	unsigned char placement;
+	unsigned char numa_node;
+
+	unsigned char cached;
+	unsigned char priority;
+	unsigned char filling;
+	struct _chunk *lru_prev;
+	struct _chunk *lru_next;
 } Chunk;
 
 Chunk *kalloc(int);
+Chunk *kalloc_lazy(unsigned long);
 void kfree(Chunk *);
-unsigned int _raw_kread(Chunk *, unsigned int, void *);
-unsigned int _raw_kwrite(Chunk *, void *, unsigned int);
+Chunk *kclone(Chunk *);
+void kcache_insert(Chunk *);
+void kcache_touch(Chunk *);
+void kcache_remove(Chunk *);
+void kcache_set_limit(unsigned long);
+unsigned long kcache_get_bytes(void);
+int kalloc_set_policy(int, int);
+void kalloc_get_stats(struct kalloc_stats *);
+unsigned int _raw_kread(Chunk *, unsigned int, unsigned int, void *);
+unsigned int _raw_kread_memory(Chunk *, const void *, unsigned int, unsigned int, void *);
+unsigned int _raw_kwrite(Chunk *, unsigned int, void *, unsigned int);
 
 Chunk *_alloc_chunk(const int);
+int _populate_chunk(Chunk *);
+void _depopulate_chunk(Chunk *);
+int _unshare_chunk(Chunk *);
+int _grow_chunk(Chunk *, const unsigned int);
+int _shrink_chunk(Chunk *, const unsigned int);
+void _prefault_chunk(Chunk *);
+unsigned int _chunk_crc(Chunk *);
+void _chunk_crc_patch(Chunk *, unsigned int, unsigned int, unsigned int);
 
 #endif /* KMALLOC_H */
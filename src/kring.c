@@ -0,0 +1,291 @@
+#include <stdlib.h>
+
+#include "errors.h"
+#include "epoch.h"
+#include "kring.h"
+
+static void *_kring_worker(void *);
+
+/*
+ * Creates a ring with room for at least 'entries' queued operations
+ * (rounded up to a power of two, so indexes can be masked), and starts
+ * its workers. Returns NULL if any of that fails.
+ */
+struct kring *
+kring_create(unsigned int entries) {
+	struct kring *ring;
+	unsigned int size = 1;
+
+	if (entries == 0)
+		return NULL;
+
+	while (size < entries)
+		size <<= 1;
+
+	ring = (struct kring *)malloc(sizeof(struct kring));
+	if (ring == NULL)
+		return NULL;
+
+	ring->entries = size;
+	ring->mask = size - 1;
+	ring->sq_head = ring->sq_submitted = ring->sq_tail = 0;
+	ring->cq_head = ring->cq_tail = 0;
+	ring->nworkers = 0;
+	ring->running = 0;
+	ring->closing = 0;
+	ring->stop = 0;
+	ring->sq = (struct kring_sqe *)calloc(size, sizeof(struct kring_sqe));
+	ring->cq = (struct kring_cqe *)calloc(size, sizeof(struct kring_cqe));
+	if (ring->sq == NULL || ring->cq == NULL)
+		goto fail;
+
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->submitted, NULL);
+	pthread_cond_init(&ring->completed, NULL);
+	for (; ring->nworkers < KRING_WORKERS; ring->nworkers++)
+		if (pthread_create(&ring->workers[ring->nworkers], NULL, _kring_worker, ring) != 0)
+			break;
+
+	/* a ring without workers would never complete anything */
+	if (ring->nworkers == 0) {
+		pthread_mutex_destroy(&ring->lock);
+		pthread_cond_destroy(&ring->submitted);
+		pthread_cond_destroy(&ring->completed);
+		goto fail;
+	}
+
+	return ring;
+
+fail:
+	free(ring->sq);
+	free(ring->cq);
+	free(ring);
+	return NULL;
+}
+
+/*
+ * Destroys the ring, once the workers are done with the operations
+ * already submitted (as far as there's room for their completions).
+ * Queued operations which haven't been submitted are dropped, files
+ * opened through the ring are NOT closed.
+ */
+void
+kring_destroy(struct kring *ring) {
+	unsigned int i;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->stop = 1;
+	pthread_cond_broadcast(&ring->submitted);
+	pthread_mutex_unlock(&ring->lock);
+	for (i = 0; i < ring->nworkers; i++)
+		pthread_join(ring->workers[i], NULL);
+
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->submitted);
+	pthread_cond_destroy(&ring->completed);
+	free(ring->sq);
+	free(ring->cq);
+	free(ring);
+}
+
+/*
+ * Returns the next free submission entry, or NULL if the submission
+ * queue is full. The entry is queued as soon as it's returned.
+ */
+struct kring_sqe *
+kring_get_sqe(struct kring *ring) {
+	struct kring_sqe *sqe;
+
+	if (ring->sq_tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries)
+		return NULL;
+
+	sqe = &ring->sq[ring->sq_tail++ & ring->mask];
+	sqe->root = NULL;
+	sqe->path = NULL;
+	sqe->file = NULL;
+	sqe->buf = NULL;
+	sqe->len = 0;
+	sqe->offset = 0;
+	sqe->user_data = NULL;
+
+	return sqe;
+}
+
+static long
+_kring_stat(struct kring_sqe *sqe) {
+	struct kring_stat *st = (struct kring_stat *)sqe->buf;
+	struct node *node;
+
+	node = node_path_find(sqe->root, sqe->path);
+	if (node == NULL)
+		return E_FILE_NOT_FOUND;
+
+	st->type = node->type;
+	st->size = node->size;
+	st->children_no = node->children_no;
+
+	return 0;
+}
+
+static void
+_kring_execute(struct kring_sqe *sqe, struct kring_cqe *cqe) {
+	struct kiovec iov = { sqe->buf, sqe->len };
+
+	cqe->user_data = sqe->user_data;
+	cqe->file = NULL;
+
+	switch (sqe->op) {
+		case KR_OPEN:
+			cqe->file = kopen(sqe->root, sqe->path);
+			cqe->res = (cqe->file == NULL) ? E_FILE_NOT_FOUND : 0;
+			break;
+		case KR_CLOSE:
+			kclose(sqe->file);
+			cqe->res = 0;
+			break;
+		case KR_READ:
+			cqe->res = kpreadv(sqe->file, sqe->offset, &iov, 1);
+			break;
+		case KR_WRITE:
+			/* only the writer may change the tree */
+			cqe->res = E_READ_ONLY;
+			break;
+		case KR_STAT:
+			cqe->res = _kring_stat(sqe);
+			break;
+		default:
+			cqe->res = E_INVALID_SYNTAX;
+	}
+}
+
+/*
+ * Tells whether a worker can take the next submitted operation: there
+ * must be room for its completion, and a KR_CLOSE runs alone.
+ */
+static int
+_kring_can_take(struct kring *ring) {
+	if (ring->sq_head == ring->sq_submitted || ring->closing)
+		return 0;
+	if (ring->cq_tail - ring->cq_head + ring->running >= ring->entries)
+		return 0;
+
+	return ring->sq[ring->sq_head & ring->mask].op != KR_CLOSE || ring->running == 0;
+}
+
+/*
+ * Takes the submitted operations one at a time and executes them
+ * without holding the lock. The submission entry is copied first, so
+ * its slot can be reused right away.
+ */
+static void *
+_kring_worker(void *ptr) {
+	struct kring *ring = (struct kring *)ptr;
+	struct kring_sqe sqe;
+	struct kring_cqe cqe;
+	int safe;
+
+	pthread_mutex_lock(&ring->lock);
+	for (;;) {
+		if (!_kring_can_take(ring)) {
+			if (ring->stop)
+				break;
+			pthread_cond_wait(&ring->submitted, &ring->lock);
+			continue;
+		}
+
+		sqe = ring->sq[ring->sq_head & ring->mask];
+		__atomic_store_n(&ring->sq_head, ring->sq_head + 1, __ATOMIC_RELEASE);
+		ring->running++;
+		if (sqe.op == KR_CLOSE)
+			ring->closing = 1;
+		pthread_mutex_unlock(&ring->lock);
+
+		/* without an epoch slot the tree can't be read safely */
+		safe = (epoch_enter() == 0);
+		if (safe) {
+			_kring_execute(&sqe, &cqe);
+			epoch_exit();
+		} else {
+			cqe.user_data = sqe.user_data;
+			cqe.file = NULL;
+			cqe.res = E_CANNOT_PROCEED;
+		}
+
+		pthread_mutex_lock(&ring->lock);
+		ring->cq[ring->cq_tail++ & ring->mask] = cqe;
+		ring->running--;
+		if (sqe.op == KR_CLOSE)
+			ring->closing = 0;
+		pthread_cond_broadcast(&ring->completed);
+		/* a KR_CLOSE may be waiting for this one */
+		if (ring->running == 0)
+			pthread_cond_broadcast(&ring->submitted);
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
+/*
+ * Hands the queued operations to the workers and returns right away.
+ * Returns the number of submitted operations.
+ */
+unsigned int
+kring_submit(struct kring *ring) {
+	unsigned int n;
+
+	pthread_mutex_lock(&ring->lock);
+	n = ring->sq_tail - ring->sq_submitted;
+	ring->sq_submitted = ring->sq_tail;
+	if (n > 0)
+		pthread_cond_broadcast(&ring->submitted);
+	pthread_mutex_unlock(&ring->lock);
+
+	return n;
+}
+
+/*
+ * Copies up to 'max' completions in 'cqes' and removes them from the
+ * completion queue, without waiting for any. Returns the number of
+ * reaped completions.
+ */
+unsigned int
+kring_reap(struct kring *ring, struct kring_cqe *cqes, unsigned int max) {
+	unsigned int reaped = 0;
+
+	pthread_mutex_lock(&ring->lock);
+	while (reaped < max && ring->cq_head != ring->cq_tail)
+		cqes[reaped++] = ring->cq[ring->cq_head++ & ring->mask];
+
+	/* workers may be waiting for room */
+	if (reaped > 0)
+		pthread_cond_broadcast(&ring->submitted);
+	pthread_mutex_unlock(&ring->lock);
+
+	return reaped;
+}
+
+/*
+ * Waits until at least 'min' completions can be reaped, or until all
+ * the submitted operations are complete if they're fewer (or the
+ * completion queue is full). Returns the number of completions which
+ * can be reaped.
+ */
+unsigned int
+kring_wait(struct kring *ring, unsigned int min) {
+	unsigned int ready;
+
+	pthread_mutex_lock(&ring->lock);
+	while ((ready = ring->cq_tail - ring->cq_head) < min && ready < ring->entries &&
+			(ring->sq_head != ring->sq_submitted || ring->running > 0))
+		pthread_cond_wait(&ring->completed, &ring->lock);
+	pthread_mutex_unlock(&ring->lock);
+
+	return ready;
+}
+
+/* Returns the number of queued operations not submitted yet */
+unsigned int
+kring_pending(const struct kring *ring) {
+	return ring->sq_tail - ring->sq_submitted;
+}
@@ -0,0 +1,85 @@
+#ifndef KRING_H
+#define KRING_H
+
+#include <pthread.h>
+
+#include "node.h"
+#include "io.h"
+
+/*
+ * A submission/completion ring in front of the k* API. Operations are
+ * queued with kring_get_sqe() and handed to the ring's pool of worker
+ * threads by kring_submit(), which doesn't wait for them. Their results
+ * are reaped from the completion queue with kring_reap() (or waited
+ * for with kring_wait()), in the order they complete. Buffers and files
+ * of an operation belong to the ring until its completion is reaped.
+ *
+ * The workers only read the tree (inside an epoch): the ring never
+ * modifies it, so that the single writer rule (see epoch.h) holds.
+ * KR_WRITE operations are rejected with E_READ_ONLY. A KR_CLOSE waits
+ * for the operations submitted before it and runs alone, so it never
+ * frees a file which is being read.
+ */
+
+/* number of worker threads of each ring */
+#define KRING_WORKERS 4
+
+/* KR_WRITE is kept for completeness, but always fails (see above) */
+enum kring_op { KR_OPEN, KR_CLOSE, KR_READ, KR_WRITE, KR_STAT };
+
+struct kring_stat {
+	enum node_type type;
+	unsigned long size;
+	unsigned int children_no;
+};
+
+struct kring_sqe {
+	enum kring_op op;
+	struct node *root;  /* KR_OPEN, KR_STAT */
+	char *path;         /* KR_OPEN, KR_STAT */
+	KFILE file;         /* KR_CLOSE, KR_READ, KR_WRITE */
+	void *buf;          /* KR_READ, KR_WRITE, KR_STAT (a struct kring_stat) */
+	unsigned int len;
+	unsigned long offset;
+	void *user_data;    /* copied as is in the completion */
+};
+
+struct kring_cqe {
+	void *user_data;
+	long res;           /* transferred bytes, 0 or a negative error code */
+	KFILE file;         /* the opened file for KR_OPEN */
+};
+
+/*
+ * Entries from sq_head to sq_submitted are submitted but not taken by
+ * a worker yet, those from sq_submitted to sq_tail are queued but not
+ * submitted. 'running' operations are being executed: each of them has
+ * a completion entry set aside.
+ */
+struct kring {
+	unsigned int entries;
+	unsigned int mask;
+	unsigned int sq_head, sq_submitted, sq_tail;
+	unsigned int cq_head, cq_tail;
+	struct kring_sqe *sq;
+	struct kring_cqe *cq;
+
+	pthread_t workers[KRING_WORKERS];
+	unsigned int nworkers;
+	pthread_mutex_t lock;
+	pthread_cond_t submitted;  /* work to do, room in the cq or stop */
+	pthread_cond_t completed;
+	unsigned int running;
+	int closing;  /* a KR_CLOSE is running */
+	int stop;
+};
+
+struct kring *kring_create(unsigned int);
+void kring_destroy(struct kring *);
+struct kring_sqe *kring_get_sqe(struct kring *);
+unsigned int kring_submit(struct kring *);
+unsigned int kring_reap(struct kring *, struct kring_cqe *, unsigned int);
+unsigned int kring_wait(struct kring *, unsigned int);
+unsigned int kring_pending(const struct kring *);
+
+#endif /* KRING_H */
@@ -1,58 +1,348 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "common.h"
 #include "errors.h"
 #include "node.h"
 #include "parser.h"
+#include "epoch.h"
+#include "pool.h"
+#include "xattr.h"
+#include "expire.h"
+
+/*
+ * Children lists are read without locks: writers fully set up an
+ * entry before publishing it with a release store, readers follow the
+ * links with acquire loads. Unlinked entries are freed through
+ * epoch_retire(), so a reader inside epoch_enter()/epoch_exit() never
+ * touches freed memory.
+ */
+#define _publish(ptr, value) __atomic_store_n(&(ptr), (value), __ATOMIC_RELEASE)
+#define _follow(ptr) __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+
+static int _node_insert(struct node *, struct node *);
+static void _skip_free(struct node_skip *);
+
+static struct pool _node_pool = POOL_INITIALIZER(struct node);
+static struct pool _node_list_pool = POOL_INITIALIZER(struct node_list);
 
 struct node *
 node_create(char *name, enum node_type type) {
 	struct node *n;
 
-	n = (struct node *)malloc(sizeof(struct node));
+	n = (struct node *)pool_alloc(&_node_pool);
+	if (n == NULL)
+		return NULL;
+
 	n->type = type;
 	n->children_no = 0;
 	n->father = NULL;
 	n->first_chunk = NULL;
+	n->size = 0;
+	n->backing = NULL;
+	n->readonly = 0;
+	n->tree_bytes = 0;
+	n->tree_files = (type == N_FILE) ? 1 : 0;
+	n->tree_dirs = (type == N_DIRECTORY) ? 1 : 0;
+	n->quota = NULL;
+	n->xattrs = NULL;
+	n->timer = NULL;
 
 	/* defer initalizations of childrens until we're actually adding
 	 * a new children
 	 */
 	n->childrens = NULL;
+	n->index = NULL;
 
-	if (node_set_name(n, name) < 0)
+	n->name = n->name_buf;
+	if (node_set_name(n, name) < 0) {
+		pool_free(n);
 		return NULL;
+	}
 
 	return n;
 }
 
+/*
+ * Lookup table for the characters allowed in a node name. A "white
+ * list" approach in this case is easier to understand (for future
+ * reference): [A-Za-z0-9._-]
+ */
+static const unsigned char _name_chars[256] = {
+	['-'] = 1, ['.'] = 1, ['_'] = 1,
+	['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1,
+	['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+	['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1,
+	['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1,
+	['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+	['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1,
+	['Y'] = 1, ['Z'] = 1,
+	['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1,
+	['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1,
+	['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+	['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1,
+	['y'] = 1, ['z'] = 1,
+};
+
+#ifdef __SSE2__
+/*
+ * Checks 16 name characters at once. A byte 'c' is in the range
+ * [lo, lo + span] iff the unsigned value (c - lo) is <= span, and
+ * x <= span iff max(x, span) == span.
+ */
+#define _SSE2_IN_RANGE(v, lo, span) \
+	_mm_cmpeq_epi8(_mm_max_epu8(_mm_sub_epi8((v), _mm_set1_epi8(lo)), \
+				_mm_set1_epi8(span)), _mm_set1_epi8(span))
+
+static inline int
+_name_block_valid_sse2(const char *p) {
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i ok;
+
+	ok = _mm_or_si128(_SSE2_IN_RANGE(v, 'A', 'Z' - 'A'),
+			_SSE2_IN_RANGE(v, 'a', 'z' - 'a'));
+	ok = _mm_or_si128(ok, _SSE2_IN_RANGE(v, '0', '9' - '0'));
+	/* '-' and '.' are adjacent in the ASCII table */
+	ok = _mm_or_si128(ok, _SSE2_IN_RANGE(v, '-', '.' - '-'));
+	ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+
+	return _mm_movemask_epi8(ok) == 0xFFFF;
+}
+#endif
+
+#ifdef __AVX2__
+#define _AVX2_IN_RANGE(v, lo, span) \
+	_mm256_cmpeq_epi8(_mm256_max_epu8(_mm256_sub_epi8((v), _mm256_set1_epi8(lo)), \
+				_mm256_set1_epi8(span)), _mm256_set1_epi8(span))
+
+static inline int
+_name_block_valid_avx2(const char *p) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i ok;
+
+	ok = _mm256_or_si256(_AVX2_IN_RANGE(v, 'A', 'Z' - 'A'),
+			_AVX2_IN_RANGE(v, 'a', 'z' - 'a'));
+	ok = _mm256_or_si256(ok, _AVX2_IN_RANGE(v, '0', '9' - '0'));
+	ok = _mm256_or_si256(ok, _AVX2_IN_RANGE(v, '-', '.' - '-'));
+	ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+
+	return (unsigned int)_mm256_movemask_epi8(ok) == 0xFFFFFFFFu;
+}
+#endif
+
+/*
+ * Returns 1 if the first 'len' characters of 'name' are all allowed
+ * in a node name. Full blocks are checked with SIMD instructions when
+ * available, the remaining tail goes through the lookup table.
+ */
+static int
+_name_is_valid(const char *name, unsigned int len) {
+	unsigned int i = 0;
+
+#ifdef __AVX2__
+	for (; i + 32 <= len; i += 32)
+		if (!_name_block_valid_avx2(name + i))
+			return 0;
+#endif
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16)
+		if (!_name_block_valid_sse2(name + i))
+			return 0;
+#endif
+	for (; i < len; i++)
+		if (!_name_chars[(unsigned char)name[i]])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * FNV-1a hash of a node name. It's stored in the node together with
+ * the name length so that lookups can discard most of the siblings
+ * without looking at their names at all.
+ */
+unsigned int
+node_name_hash(const char *name, unsigned int len) {
+	unsigned int i, hash = 2166136261u;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * strcmp() replacement between a node name and the name of a list
+ * entry: lengths are known, so compare the shortest name plus its
+ * terminator in one memcmp() call.
+ */
+static inline int
+_name_cmp(const struct node *a, const struct node_list *b) {
+	unsigned int len = (a->name_len < b->name_len) ? a->name_len : b->name_len;
+	return memcmp(a->name, b->name, len + 1);
+}
+
+/* Points a list entry to a node, taking its current name as the key */
+static inline void
+_entry_set(struct node_list *nl, struct node *node) {
+	nl->node = node;
+	nl->name = node->name;
+	nl->name_len = node->name_len;
+	nl->name_hash = node->name_hash;
+}
+
+static char *
+_name_alloc(const char *name, size_t len) {
+	char *buf = (char *)malloc(len + 1);
+
+	if (buf != NULL)
+		memcpy(buf, name, len + 1);
+	return buf;
+}
+
+/*
+ * Gives 'node' the name 'name', which is taken over by the node. The
+ * old one isn't freed: it's returned, since list entries and readers
+ * may still use it.
+ */
+static char *
+_name_swap(struct node *node, char *name, size_t len) {
+	char *old = node->name;
+
+	_publish(node->name, name);
+	node->name_len = len;
+	node->name_hash = node_name_hash(name, len);
+	return old;
+}
+
+/*
+ * Sets the name of a node which isn't in any directory (node_rename()
+ * renames the others). A name is never changed in place once the
+ * node has been renamed, as lock-free readers may still be using it.
+ */
 int
 node_set_name(struct node *node, char *name) {
-	unsigned int i;
-	char c;
+	size_t len = strlen(name);
+	char *buf;
 
-	if (strlen(name) > MAX_NAME_LENGTH)
+	/* leave room for the trailing '\0' */
+	if (len >= MAX_NAME_LENGTH)
 		return E_CONSTRAINT_VIOLATED;
 
-	for (i = 0; i < strlen(name); i++) {
-		/* A"white list" approach in this case is easier
-		 * to understand (for future reference)
-		 */
-		c = name[i];
-		if ((c >= 'A' && c <= 'Z') ||
-				(c >= 'a' && c <= 'z') ||
-				(c >= '0' && c <= '9') ||
-				(c == '.') ||
-				(c == '-') ||
-				(c == '_')) continue;
-		else return E_INVALID_NAME;
+	if (!_name_is_valid(name, len))
+		return E_INVALID_NAME;
+
+	if (node->name == node->name_buf) {
+		memcpy(node->name_buf, name, len + 1);
+		node->name_len = len;
+		node->name_hash = node_name_hash(name, len);
+	} else {
+		if ((buf = _name_alloc(name, len)) == NULL)
+			return E_CANNOT_PROCEED;
+		epoch_retire(_name_swap(node, buf, len), free);
 	}
 
-	strcpy(node->name, name);
 	return 0;
 }
 
+/*
+ * Adds the given deltas to the subtree totals of 'node' and of all
+ * its ancestors.
+ */
+static void
+_node_account(struct node *node, long bytes, long files, long dirs) {
+	for (; node != NULL; node = node->father) {
+		node->tree_bytes += bytes;
+		node->tree_files += files;
+		node->tree_dirs += dirs;
+	}
+}
+
+/* Returns 1 if 'node' is in the subtree of 'ancestor' */
+int
+node_is_below(struct node *node, struct node *ancestor) {
+	for (; node != NULL; node = node->father)
+		if (node == ancestor)
+			return 1;
+	return 0;
+}
+
+/* Returns 1 if adding 'bytes' and 'nodes' to 'node' breaks its quota */
+static int
+_quota_exceeded(struct node *node, long bytes, long nodes) {
+	struct node_quota *q = node->quota;
+
+	if (q == NULL)
+		return 0;
+
+	return (q->max_bytes > 0 && bytes > 0 && node->tree_bytes + bytes > q->max_bytes) ||
+		(q->max_nodes > 0 && nodes > 0 && node->tree_files + node->tree_dirs + nodes > q->max_nodes);
+}
+
+/*
+ * Checks whether 'bytes' and 'nodes' can be added below 'node' without
+ * breaking the quota of any of its ancestors (itself included). It's
+ * as cheap as keeping the totals up to date, so it's done on every
+ * allocation: returns E_QUOTA if a quota would be exceeded.
+ */
+int
+node_quota_check(struct node *node, long bytes, long nodes) {
+	for (; node != NULL; node = node->father)
+		if (_quota_exceeded(node, bytes, nodes))
+			return E_QUOTA;
+
+	return 0;
+}
+
+/*
+ * Sets the limits on the subtree of 'node' (0 for no limit) and the
+ * eviction priority of the chunks cached below it. Limits lower than
+ * the current usage only prevent further growth.
+ */
+int
+node_set_quota(struct node *node, unsigned long max_bytes,
+		unsigned long max_nodes, unsigned char priority) {
+	if (priority >= KCACHE_PRIORITIES)
+		return E_OUT_OF_BOUNDS;
+
+	if (node->quota == NULL) {
+		node->quota = (struct node_quota *)malloc(sizeof(struct node_quota));
+		if (node->quota == NULL)
+			return E_CANNOT_PROCEED;
+	}
+
+	node->quota->max_bytes = max_bytes;
+	node->quota->max_nodes = max_nodes;
+	node->quota->priority = priority;
+	return 0;
+}
+
+/* Eviction priority of the chunks of a node: from the closest quota */
+unsigned char
+node_cache_priority(struct node *node) {
+	for (; node != NULL; node = node->father)
+		if (node->quota != NULL)
+			return node->quota->priority;
+
+	return KCACHE_DEFAULT_PRIORITY;
+}
+
+/* Set the size of a file node, updating its ancestors' totals */
+void
+node_set_size(struct node *node, unsigned long size) {
+	_node_account(node, (long)size - (long)node->size, 0, 0);
+	node->size = size;
+}
+
 /* Set a node's father */
 void
 node_set_father(struct node *node, struct node *father) {
@@ -73,107 +363,428 @@ node_delete(struct node *n) {
 
 			node_delete(subnode);
 
-			free(nl);
+			pool_free(nl);
 			nl = next;
 		}
 	}
 
+	if (n->index != NULL)
+		_skip_free(n->index);
+	if (n->name != n->name_buf)
+		free(n->name);
 	if ((n->type == N_FILE) && (n->first_chunk != NULL))
 		kfree(n->first_chunk);
+	if (n->backing != NULL)
+		free(n->backing);
+	if (n->quota != NULL)
+		free(n->quota);
+	node_clearxattrs(n);
+	node_cleartimer(n);
 
-	free(n);
+	pool_free(n);
 	n = NULL;
 }
 
-void
-node_delete_child(struct node *father, struct node *children) {
-	struct node_list *nl = father->childrens, *delnl;
-	struct node_list *prev = NULL;
+/* Frees an unlinked children list entry and its node */
+static void
+_node_list_reclaim(void *ptr) {
+	struct node_list *nl = (struct node_list *)ptr;
 
-	while (nl != NULL) {
-		if (nl->node == children) {
-			if (prev != NULL) {
-				/* we're in the middle or at the end of the linked list */
-				prev->next = nl->next;
-			} else {
-				/* we're at the first item of the linked list */
-				father->childrens = nl->next;
-			}
-
-			delnl = nl;
+	node_delete(nl->node);
+	pool_free(nl);
+}
+
+/* Returns the entry of 'children' in the children list of 'father' */
+static struct node_list *
+_node_entry(struct node *father, struct node *children) {
+	struct node_list *nl = father->childrens;
+
+	if (father->index != NULL)
+		nl = node_seek_children(father, children->name);
+
+	while (nl != NULL && nl->node != children)
+		nl = nl->next;
+
+	return nl;
+}
+
+/*
+ * Skip list index over the children of big directories, so that
+ * looking up, inserting and seeking take O(log n) instead of walking
+ * the whole list. Towers only point to list entries: the list itself
+ * stays the reference, and readers can always fall back to it. Like
+ * the list, towers are published fully set up and retired through the
+ * epoch when removed. One entry in four gets a tower, one in sixteen
+ * a tower two high and so on.
+ */
+static unsigned int
+_skip_height(void) {
+	static unsigned int seed = 2463534242u;
+	unsigned int height = 0;
+
+	do {
+		/* xorshift32 */
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		if ((seed & 3) != 0)
 			break;
+	} while (++height < NODE_SKIP_LEVELS);
+
+	return height;
+}
+
+static struct node_skip *
+_skip_alloc(struct node_list *entry, unsigned int height) {
+	struct node_skip *tower;
+
+	tower = (struct node_skip *)calloc(1, sizeof(struct node_skip) +
+			height * sizeof(struct node_skip *));
+	if (tower == NULL)
+		return NULL;
+
+	tower->entry = entry;
+	tower->height = height;
+	return tower;
+}
+
+/*
+ * Returns the last entry whose name comes before 'name' among those
+ * with a tower, or NULL if there's none: the list can be walked from
+ * there. When 'preds' is not NULL, it gets the last tower before
+ * 'name' at every level.
+ */
+static struct node_list *
+_skip_lower(struct node_skip *index, const char *name, struct node_skip **preds) {
+	struct node_skip *tower = index, *next;
+	int level;
+
+	for (level = NODE_SKIP_LEVELS - 1; level >= 0; level--) {
+		while ((next = _follow(tower->next[level])) != NULL &&
+				strcmp(next->entry->name, name) < 0)
+			tower = next;
+		if (preds != NULL)
+			preds[level] = tower;
+	}
+
+	return tower->entry;
+}
+
+/* Gives a tower to a newly linked entry, if it's lucky */
+static void
+_skip_insert(struct node_skip *index, struct node_list *nl, struct node_skip **preds) {
+	struct node_skip *tower;
+	unsigned int height = _skip_height(), level;
+
+	if (height == 0 || (tower = _skip_alloc(nl, height)) == NULL)
+		return;
+
+	for (level = 0; level < height; level++)
+		tower->next[level] = preds[level]->next[level];
+	for (level = 0; level < height; level++)
+		_publish(preds[level]->next[level], tower);
+	nl->skip = tower;
+}
+
+/* Takes the tower of an entry out of the index (before any rename) */
+static void
+_skip_remove(struct node *father, struct node_list *nl) {
+	struct node_skip *preds[NODE_SKIP_LEVELS], *tower = nl->skip;
+	unsigned int level;
+
+	if (tower == NULL || father->index == NULL)
+		return;
+
+	_skip_lower(father->index, nl->name, preds);
+	for (level = 0; level < tower->height; level++)
+		if (preds[level]->next[level] == tower)
+			_publish(preds[level]->next[level], tower->next[level]);
+
+	nl->skip = NULL;
+	epoch_retire(tower, free);
+}
+
+/* Builds the index of a directory from its children list */
+static void
+_skip_build(struct node *father) {
+	struct node_skip *index, *last[NODE_SKIP_LEVELS], *tower;
+	struct node_list *nl;
+	unsigned int level, height;
+
+	index = _skip_alloc(NULL, NODE_SKIP_LEVELS);
+	if (index == NULL)
+		return;
+
+	for (level = 0; level < NODE_SKIP_LEVELS; level++)
+		last[level] = index;
+
+	for (nl = father->childrens; nl != NULL; nl = nl->next) {
+		height = _skip_height();
+		if (height == 0 || (tower = _skip_alloc(nl, height)) == NULL)
+			continue;
+
+		for (level = 0; level < height; level++) {
+			last[level]->next[level] = tower;
+			last[level] = tower;
 		}
-		prev = nl;
-		nl = nl->next;
+		nl->skip = tower;
 	}
 
-	node_delete(children);
-	free(delnl);
+	_publish(father->index, index);
+}
+
+/* Frees the index of a directory nobody can reach anymore */
+static void
+_skip_free(struct node_skip *index) {
+	struct node_skip *tower, *next;
+
+	for (tower = index->next[0]; tower != NULL; tower = next) {
+		next = tower->next[0];
+		free(tower);
+	}
+	free(index);
+}
+
+/*
+ * Removes an entry from the children list of 'father'. Readers may
+ * still be looking at it, so it's up to the caller to retire it.
+ */
+static void
+_node_unlink(struct node *father, struct node_list *nl) {
+	struct node *children = nl->node;
+
+	_skip_remove(father, nl);
+	if (nl->prev != NULL)
+		_publish(nl->prev->next, nl->next);
+	else _publish(father->childrens, nl->next);
+	if (nl->next != NULL)
+		nl->next->prev = nl->prev;
 	father->children_no--;
+	_node_account(father, -(long)children->tree_bytes,
+			-(long)children->tree_files, -(long)children->tree_dirs);
 }
 
+/*
+ * Unlinks 'children' from its father and deletes it. The entry is
+ * removed from the list before anything is freed, and it's freed only
+ * when no reader can be looking at it anymore.
+ */
+void
+node_delete_child(struct node *father, struct node *children) {
+	struct node_list *nl = _node_entry(father, children);
+
+	if (nl == NULL)
+		return;
+
+	_node_unlink(father, nl);
+	expire_detach(children);
+	epoch_retire(nl, _node_list_reclaim);
+}
+
+/*
+ * Unlinks 'children' from its father without deleting it: the caller
+ * disposes of it, with node_retire() since readers may still be
+ * inside it.
+ */
 int
-node_add_child(struct node *father, struct node *children) {
-	struct node_list *tmp, *nl, *tmpnl, *prev;
-	unsigned int children_no = node_get_children_no(father);
-	unsigned int inserted;
-	short int name_comparison;
+node_unlink_child(struct node *father, struct node *children) {
+	struct node_list *nl = _node_entry(father, children);
+
+	if (nl == NULL)
+		return E_FILE_NOT_FOUND;
 
+	_node_unlink(father, nl);
+	epoch_retire(nl, pool_free);
+	return 0;
+}
+
+/*
+ * Adds 'children' to 'father', keeping the children list sorted in
+ * alphabetical order. The new list entry is completely set up before
+ * being linked, so whoever walks the list sees either the old or the
+ * new list, never something in between.
+ */
+int
+node_add_child(struct node *father, struct node *children) {
 	if (father->type == N_FILE) {
 		return E_FILE_CHILD;
 	}
 
-	if (children_no == 0) {
-		/* this is the first child, so initalizes the children
-		 * list (we have deferred its initalization) */
-		father->childrens = node_list_create();
+	if (father->readonly)
+		return E_READ_ONLY;
 
-		father->childrens->node = children;
-		father->childrens->prev = NULL;
-		father->childrens->next = NULL;
-	} else {
-		/* there are childrens already, so insert this node in the
-		 * proper place in alphabetical order
-		 */
-
-		nl = node_list_create();
-		nl->node = children;
-
-		tmpnl = father->childrens;
-		prev = NULL;
-
-		inserted = 0;
-		while (tmpnl != NULL) {
-			/* insert the node in the proper alphabetical place */
-			name_comparison = strcmp(children->name, tmpnl->node->name);
-			if (name_comparison < 0) {
-				if (prev == NULL)
-					father->childrens = nl;
-				else prev->next = nl;
-
-				nl->next = tmpnl;
-				inserted = 1;
-				break;
-			} else if (name_comparison == 0) {
-				/* a node with the same name already exists, exit
-				 * with a proper error code
-				 */
-				return E_NAME_EXISTS;
-			}
-
-			prev = tmpnl;
-			tmpnl = tmpnl->next;
-		}
+	if (node_quota_check(father, children->tree_bytes,
+				children->tree_files + children->tree_dirs) < 0)
+		return E_QUOTA;
 
-		if (!inserted)
-			node_get_nth_children_nl(father, children_no - 1)->next = nl;
+	return _node_insert(father, children);
+}
+
+/* Links 'children' in the sorted children list of 'father' */
+static int
+_node_insert(struct node *father, struct node *children) {
+	struct node_list *nl, *tmpnl, *prev;
+	struct node_skip *preds[NODE_SKIP_LEVELS];
+	int name_comparison;
+
+	/* find the proper alphabetical place */
+	prev = NULL;
+	if (father->index != NULL)
+		prev = _skip_lower(father->index, children->name, preds);
+	tmpnl = (prev != NULL) ? prev->next : father->childrens;
+	while (tmpnl != NULL) {
+		name_comparison = _name_cmp(children, tmpnl);
+		if (name_comparison == 0) {
+			/* a node with the same name already exists, exit
+			 * with a proper error code
+			 */
+			return E_NAME_EXISTS;
+		} else if (name_comparison < 0)
+			break;
+
+		prev = tmpnl;
+		tmpnl = tmpnl->next;
 	}
-	father->children_no += 1;
+
+	nl = node_list_create();
+	if (nl == NULL)
+		return E_CANNOT_PROCEED;
+	_entry_set(nl, children);
+	nl->prev = prev;
+	nl->next = tmpnl;
 	node_set_father(children, father);
 
+	/* publish the new entry */
+	if (tmpnl != NULL)
+		tmpnl->prev = nl;
+	if (prev != NULL)
+		_publish(prev->next, nl);
+	else _publish(father->childrens, nl);
+	father->children_no += 1;
+	_node_account(father, children->tree_bytes,
+			children->tree_files, children->tree_dirs);
+
+	if (father->index != NULL)
+		_skip_insert(father->index, nl, preds);
+	else if (father->children_no >= NODE_INDEX_MIN)
+		_skip_build(father);
+
 	return 0;
 }
 
+/* Deletes a node replaced by node_move() once no reader can see it */
+static void
+_node_reclaim(void *ptr) {
+	node_delete((struct node *)ptr);
+}
+
+/*
+ * Deletes a node unlinked with node_unlink_child() (and everything
+ * still below it) once no reader can be looking at it.
+ */
+void
+node_retire(struct node *node) {
+	epoch_retire(node, _node_reclaim);
+}
+
+/*
+ * Moves 'node' into the directory 'father' with the new name 'name'
+ * (NULL keeps the current one). Only the children lists change, file
+ * data is never touched. If 'father' already has a child called
+ * 'name', of the same type and with no children, it's replaced: a
+ * reader looking the name up finds either node, never none of them.
+ * The node gets a new entry, keyed by the new name, before the old
+ * one is unlinked, so the lists stay sorted for readers throughout.
+ */
+int
+node_move(struct node *node, struct node *father, char *name) {
+	struct node *old_father = node->father, *target = NULL, *n;
+	struct node_list *nl, *old_nl, *target_nl = NULL;
+	char *old_name = node->name, *new_name = node->name;
+	unsigned short old_len = node->name_len;
+	size_t len;
+	int ret;
+
+	if (name == NULL)
+		name = node->name;
+	len = strlen(name);
+	if (len >= MAX_NAME_LENGTH)
+		return E_CONSTRAINT_VIOLATED;
+	if (!_name_is_valid(name, len))
+		return E_INVALID_NAME;
+
+	if (old_father == NULL)
+		return E_CONSTRAINT_VIOLATED;
+	if (father->type == N_FILE)
+		return E_FILE_CHILD;
+	if (old_father->readonly || father->readonly)
+		return E_READ_ONLY;
+
+	/* a directory can't be moved below itself */
+	for (n = father; n != NULL; n = n->father)
+		if (n == node)
+			return E_CONSTRAINT_VIOLATED;
+
+	/* only the directories which don't hold the node yet grow */
+	for (n = father; n != NULL && !node_is_below(node, n); n = n->father)
+		if (_quota_exceeded(n, node->tree_bytes,
+					node->tree_files + node->tree_dirs))
+			return E_QUOTA;
+
+	nl = node_seek_children(father, name);
+	if (nl != NULL && strcmp(nl->name, name) == 0) {
+		target_nl = nl;
+		target = nl->node;
+	}
+
+	if (target == node)
+		return 0;
+	if (target != NULL && (target->type != node->type || target->children_no > 0))
+		return E_NAME_EXISTS;
+
+	old_nl = _node_entry(old_father, node);
+
+	/* the new name goes in a buffer of its own, the old one is in use */
+	if (strcmp(name, node->name) != 0) {
+		if ((new_name = _name_alloc(name, len)) == NULL)
+			return E_CANNOT_PROCEED;
+		_name_swap(node, new_name, len);
+	}
+	if (target != NULL) {
+		/* the new node takes the place of the old one */
+		_publish(target_nl->node, node);
+		_publish(target_nl->name, new_name);
+		node_set_father(node, father);
+		_node_account(father, (long)node->tree_bytes - (long)target->tree_bytes,
+				(long)node->tree_files - (long)target->tree_files,
+				(long)node->tree_dirs - (long)target->tree_dirs);
+		target->father = NULL;
+		expire_detach(target);
+		epoch_retire(target, _node_reclaim);
+	} else if ((ret = _node_insert(father, node)) < 0) {
+		if (new_name != old_name)
+			epoch_retire(_name_swap(node, old_name, old_len), free);
+		return ret;
+	}
+
+	/* only now the node disappears from its old place */
+	_node_unlink(old_father, old_nl);
+	epoch_retire(old_nl, pool_free);
+	if (new_name != old_name && old_name != node->name_buf)
+		epoch_retire(old_name, free);
+
+	return 0;
+}
+
+/* Renames a node, keeping it in the same directory (see node_move) */
+int
+node_rename(struct node *node, char *name) {
+	if (node->father == NULL)
+		return node_set_name(node, name);
+
+	return node_move(node, node->father, name);
+}
+
 unsigned int
 node_children_num(struct node *node) {
 	unsigned int num = 0;
@@ -187,24 +798,131 @@ node_children_num(struct node *node) {
 	return num;
 }
 
+/*
+ * Looks up a child by name. It takes no locks, so it can run while
+ * another thread adds or deletes children, as long as the caller is
+ * inside epoch_enter()/epoch_exit() for as long as it uses the result.
+ */
 struct node *
 node_find_children(struct node *father, char *name) {
 	struct node *node = NULL;
 	struct node_list *tmpnl;
+	unsigned int len = strlen(name), hash;
 
-	tmpnl = father->childrens;
+	if (len >= MAX_NAME_LENGTH)
+		return NULL;
+	hash = node_name_hash(name, len);
+
+	if (_follow(father->index) != NULL) {
+		tmpnl = node_seek_children(father, name);
+		if (tmpnl != NULL && strcmp(tmpnl->name, name) == 0)
+			node = _follow(tmpnl->node);
+		return node;
+	}
+
+	tmpnl = _follow(father->childrens);
 	while (tmpnl != NULL) {
-		if (!strcmp(tmpnl->node->name, name)) {
-			node = tmpnl->node;
+		/* compare the names only when both hash and length match */
+		if (tmpnl->name_hash == hash && tmpnl->name_len == len &&
+				!memcmp(_follow(tmpnl->name), name, len)) {
+			node = _follow(tmpnl->node);
 			break;
 		}
 
-		tmpnl = tmpnl->next;
+		tmpnl = _follow(tmpnl->next);
 	}
 
 	return node;
 }
 
+/*
+ * Returns the first entry of the children of 'father' whose name
+ * doesn't come before 'name' (in strcmp() order), or NULL if there's
+ * none: the entries from there on can be walked through 'next'. It's
+ * O(log n) for big directories, and lock-free like
+ * node_find_children().
+ */
+struct node_list *
+node_seek_children(struct node *father, const char *name) {
+	struct node_skip *index = _follow(father->index);
+	struct node_list *nl = NULL;
+
+	if (index != NULL)
+		nl = _skip_lower(index, name, NULL);
+	nl = (nl != NULL) ? _follow(nl->next) : _follow(father->childrens);
+
+	while (nl != NULL && strcmp(_follow(nl->name), name) < 0)
+		nl = _follow(nl->next);
+
+	return nl;
+}
+
+/*
+ * Starts reading the children of 'node' with node_readdir(), from the
+ * first one. 'node' must not be deleted while it's being read.
+ */
+int
+node_opendir(struct node *node, struct node_dir *dir) {
+	if (node->type != N_DIRECTORY)
+		return E_INVALID_TYPE;
+
+	dir->dir = node;
+	dir->last[0] = '\0';
+	dir->started = 0;
+	return 0;
+}
+
+/*
+ * Makes node_readdir() go on from the first child whose name comes
+ * after 'name' (from the first child at all when it's NULL), as if
+ * 'name' had just been returned.
+ */
+void
+node_seekdir(struct node_dir *dir, const char *name) {
+	dir->started = (name != NULL);
+	snprintf(dir->last, sizeof(dir->last), "%s", (name != NULL) ? name : "");
+}
+
+/*
+ * Fills 'entries' with up to 'max' of the next children of a directory,
+ * in name order, and returns how many it filled: 0 once they're over,
+ * E_CANNOT_PROCEED if the thread can't read the tree safely.
+ * Each call seeks once and then copies, so reading a whole directory
+ * is linear and allocates nothing. It takes no locks: children added
+ * after the last entry returned will be read, those before it won't,
+ * and no entry is ever returned twice.
+ */
+int
+node_readdir(struct node_dir *dir, struct node_dirent *entries, unsigned int max) {
+	struct node_list *nl;
+	struct node *node;
+	unsigned int n = 0;
+
+	if (max == 0)
+		return 0;
+	if (epoch_enter() != 0)
+		return E_CANNOT_PROCEED;
+
+	nl = node_seek_children(dir->dir, dir->last);
+	if (nl != NULL && dir->started && strcmp(_follow(nl->name), dir->last) == 0)
+		nl = _follow(nl->next);
+
+	for (; nl != NULL && n < max; nl = _follow(nl->next), n++) {
+		node = _follow(nl->node);
+		memcpy(entries[n].name, _follow(nl->name), nl->name_len + 1);
+		entries[n].type = node->type;
+		entries[n].size = (node->type == N_FILE) ? node->size : node->children_no;
+	}
+
+	if (n > 0) {
+		memcpy(dir->last, entries[n - 1].name, sizeof(dir->last));
+		dir->started = 1;
+	}
+
+	epoch_exit();
+	return n;
+}
+
 /* Returns a node's father or NULL if it's a root node */
 struct node *
 node_get_father(const struct node *children) {
@@ -236,11 +954,25 @@ node_get_children_no(struct node *n) {
 struct node_list *
 node_list_create() {
 	struct node_list *nl;
-	nl = (struct node_list *)malloc(sizeof(struct node_list));
+	nl = (struct node_list *)pool_alloc(&_node_list_pool);
+	if (nl == NULL)
+		return NULL;
+
 	nl->next = NULL;
+	nl->prev = NULL;
+	nl->skip = NULL;
+	nl->name = NULL;
+	nl->name_len = 0;
+	nl->name_hash = 0;
 	return nl;
 }
 
+/* Frees a list entry created with node_list_create() (not its node) */
+void
+node_list_delete(struct node_list *nl) {
+	pool_free(nl);
+}
+
 struct node *
 node_list_add_sibling(struct node_list *list, struct node *node) {
 	struct node_list *nl = node_list_create();
@@ -250,7 +982,7 @@ node_list_add_sibling(struct node_list *list, struct node *node) {
 		tmp = tmp->next;
 
 	tmp->next = nl;
-	nl->node = node;
+	_entry_set(nl, node);
 
 	return node;
 }
@@ -279,3 +1011,96 @@ node_path_find(struct node *root, char *path) {
 	return parent;
 }
 
+
+/*
+ * Clones 'src' and its subtree. On failure whatever was cloned is
+ * deleted again and NULL is returned.
+ */
+static struct node *
+_node_clone(struct node *src, char *name, unsigned char readonly) {
+	struct node *n, *child;
+	struct node_list *nl, *entry, *last = NULL;
+
+	n = node_create(name, src->type);
+	if (n == NULL)
+		return NULL;
+
+	n->size = src->size;
+	n->tree_bytes = src->tree_bytes;
+	n->tree_files = src->tree_files;
+	n->tree_dirs = src->tree_dirs;
+	n->readonly = readonly;
+	if (src->backing != NULL && (n->backing = strdup(src->backing)) == NULL)
+		goto fail;
+	if (src->first_chunk != NULL && (n->first_chunk = kclone(src->first_chunk)) == NULL)
+		goto fail;
+	if (node_copyxattrs(n, src) < 0)
+		goto fail;
+
+	/* children are already sorted, so append them in the same order */
+	for (nl = src->childrens; nl != NULL; nl = nl->next) {
+		child = _node_clone(nl->node, nl->node->name, readonly);
+		if (child == NULL)
+			goto fail;
+
+		entry = node_list_create();
+		if (entry == NULL) {
+			node_delete(child);
+			goto fail;
+		}
+		node_set_father(child, n);
+		_entry_set(entry, child);
+
+		if (last == NULL)
+			n->childrens = entry;
+		else {
+			last->next = entry;
+			entry->prev = last;
+		}
+		last = entry;
+		n->children_no++;
+	}
+	if (n->children_no >= NODE_INDEX_MIN)
+		_skip_build(n);
+
+	return n;
+
+fail:
+	node_delete(n);
+	return NULL;
+}
+
+/*
+ * Duplicates the subtree starting at 'src', giving the new root the
+ * name 'name'. File contents aren't copied: the clones share their
+ * chunks' memory with the originals until one of them is written,
+ * so no write reservation may be open below 'src' (see
+ * kwrite_reserve()). Returns NULL if 'name' is not valid or memory
+ * runs out.
+ */
+struct node *
+node_clone(struct node *src, char *name) {
+	return _node_clone(src, name, 0);
+}
+
+/*
+ * Takes a point-in-time snapshot of the subtree starting at 'src'.
+ * The snapshot is a read-only clone: it's not linked anywhere, so
+ * readers can walk it while writers keep modifying 'src', and it keeps
+ * the file contents as they were when the snapshot was taken (writes
+ * to 'src' copy the chunks they modify). Old contents are freed by
+ * node_snapshot_release(), once no other snapshot shares them.
+ * Taking the snapshot links its chunks to those of 'src', so it must
+ * be done by the writer (see node.h), and with no write reservation
+ * open below 'src' (see kwrite_reserve()). Returns NULL if memory runs
+ * out.
+ */
+struct node *
+node_snapshot(struct node *src) {
+	return _node_clone(src, src->name, 1);
+}
+
+void
+node_snapshot_release(struct node *snapshot) {
+	node_delete(snapshot);
+}
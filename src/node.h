@@ -6,36 +6,139 @@
 
 enum node_type { N_FILE, N_DIRECTORY };
 
+/* directories with more children than this get a skip list index */
+#define NODE_INDEX_MIN    64
+#define NODE_SKIP_LEVELS  16
+
+struct node_skip;
+
+/*
+ * An entry of a children list. It keeps the name its node had when it
+ * was linked: lists are sorted and searched by that name, which never
+ * changes while the entry is linked, even if the node gets renamed.
+ */
 struct node_list {
 	struct node *node;
 	struct node_list *next;
 	struct node_list *prev;
+	struct node_skip *skip;  /* the tower of this entry in the index, if any */
+	const char *name;
+	unsigned int name_hash;
+	unsigned short name_len;
 };
 
+/*
+ * A tower of a skip list over the (sorted) children list of a
+ * directory: next[i] is the following tower at least i + 1 high. The
+ * head of the skip list has no entry and is as high as it gets.
+ */
+struct node_skip {
+	struct node_list *entry;
+	unsigned int height;
+	struct node_skip *next[];
+};
+
+/*
+ * Limits on the subtree of a node (usually a root, for a tenant).
+ * A limit of 0 means no limit.
+ */
+struct node_quota {
+	unsigned long max_bytes;
+	unsigned long max_nodes;
+	unsigned char priority;  /* for the evictable chunks below (see kcache) */
+};
+
+struct node_xattrs;
+struct node_timer;
+
 struct node {
-	char name[MAX_NAME_LENGTH];
+	char *name;  /* never changed in place, see node_move() */
+	unsigned short name_len;
+	unsigned int name_hash;
+	char name_buf[MAX_NAME_LENGTH];  /* holds the first name */
 	enum node_type type;
 	struct node *father;
 	Chunk *first_chunk;
+	unsigned long size;
+	char *backing;  /* host file the chunks are filled from, if any */
+	unsigned char readonly;  /* set on snapshots */
 
 	unsigned int children_no;
 	struct node_list *childrens;
+	struct node_skip *index;  /* NULL until there are NODE_INDEX_MIN children */
+
+	/* totals of the subtree starting at this node (itself included) */
+	unsigned long tree_bytes;
+	unsigned long tree_files;
+	unsigned long tree_dirs;
+
+	struct node_quota *quota;  /* NULL when there are no limits */
+	struct node_xattrs *xattrs;  /* see xattr.h */
+	struct node_timer *timer;  /* NULL unless the node expires (see expire.h) */
+};
+
+/* An entry filled in by node_readdir() */
+struct node_dirent {
+	char name[MAX_NAME_LENGTH];
+	enum node_type type;
+	unsigned long size;  /* bytes of a file, children of a directory */
+};
+
+/*
+ * A directory being read with node_readdir(). All it remembers is the
+ * name of the last entry returned, so changes to the directory never
+ * leave it dangling: reading goes on from the first name after it.
+ */
+struct node_dir {
+	struct node *dir;
+	char last[MAX_NAME_LENGTH];
+	unsigned char started;
 };
 
 struct node *node_create(char *, enum node_type);
 int node_set_name(struct node *, char *);
 void node_set_father(struct node *, struct node *);
+void node_set_size(struct node *, unsigned long);
 void node_delete(struct node *);
 void node_delete_child(struct node *, struct node *);
+int node_unlink_child(struct node *, struct node *);
+void node_retire(struct node *);
 int node_add_child(struct node *, struct node *);
+int node_move(struct node *, struct node *, char *);
+int node_rename(struct node *, char *);
 unsigned int node_children_num(struct node *);
 struct node *node_find_children(struct node *, char *);
+struct node_list *node_seek_children(struct node *, const char *);
+unsigned int node_name_hash(const char *, unsigned int);
 struct node *node_get_father(const struct node *);
+int node_is_below(struct node *, struct node *);
 struct node_list *node_get_nth_children_nl(struct node *, int);
 struct node *node_get_nth_children(struct node *, int);
 unsigned int node_get_children_no(struct node *);
 struct node_list *node_list_create(void);
+void node_list_delete(struct node_list *);
 struct node *node_list_add_sibling(struct node_list *, struct node *);
 struct node *node_path_find(struct node *, char *path);
+int node_opendir(struct node *, struct node_dir *);
+int node_readdir(struct node_dir *, struct node_dirent *, unsigned int);
+void node_seekdir(struct node_dir *, const char *);
+int node_set_quota(struct node *, unsigned long, unsigned long, unsigned char);
+int node_quota_check(struct node *, long, long);
+unsigned char node_cache_priority(struct node *);
+struct node *node_clone(struct node *, char *);
+
+/*
+ * Snapshots are taken by the thread that modifies the tree (the single
+ * writer, see epoch.h), never concurrently with it: cloning reads the
+ * subtree and links the chunks of its files to the snapshot's. Other
+ * threads can read the snapshot freely once they're handed it.
+ * Taking a snapshot is not free: it allocates a node for each node of
+ * the subtree and a header for each chunk, so it costs O(nodes +
+ * chunks) in time and memory, and the writer is held for that long.
+ * File data is never copied when the snapshot is taken, only when
+ * either side writes a shared chunk.
+ */
+struct node *node_snapshot(struct node *);
+void node_snapshot_release(struct node *);
 
 #endif /* _NODE_H */
@@ -12,7 +12,7 @@
  */
 int
 parser_split(char *line, const char delimiter, char **splitted, unsigned int max_values) {
-	unsigned int i;
+	unsigned int i = 0;
 	unsigned int start;
 	unsigned int arg_num = 0;
 
@@ -20,9 +20,12 @@ parser_split(char *line, const char delimiter, char **splitted, unsigned int max
 		return 0;
 
 	/* skip white spaces before than the argline */
-	while ((line[i] == delimiter) || (line[i] == '\0'))
+	while (line[i] == delimiter)
 		i++;
 
+	if (!line[i])
+		return 0;
+
 	start = i;
 	while (i <= strlen(line)) {
 		if ((line[i] == delimiter) || (line[i] == '\0')) {
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define POOL_ALIGN 16
+
+/*
+ * Header at the start of every slab. Objects that were never handed
+ * out are taken from 'fresh' on, so that a new slab doesn't have to
+ * be threaded into a free list first.
+ */
+struct pool_slab {
+	struct pool *pool;
+	struct pool_slab *prev, *next;  /* in pool->partial */
+	void *free;
+	char *fresh;
+	unsigned int used;
+};
+
+#define _round(x) (((x) + POOL_ALIGN - 1) & ~(unsigned long)(POOL_ALIGN - 1))
+#define _slab_of(ptr) ((struct pool_slab *)((unsigned long)(ptr) & ~(unsigned long)(POOL_SLAB_SIZE - 1)))
+
+static void
+_pool_lock(struct pool *pool) {
+	while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void
+_pool_unlock(struct pool *pool) {
+	__atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+}
+
+/* Maps a new slab, aligned on POOL_SLAB_SIZE */
+static struct pool_slab *
+_slab_map(struct pool *pool) {
+	char *memory, *aligned;
+	struct pool_slab *slab;
+
+	memory = mmap(NULL, POOL_SLAB_SIZE * 2, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return NULL;
+
+	aligned = (char *)(((unsigned long)memory + POOL_SLAB_SIZE - 1) &
+			~(unsigned long)(POOL_SLAB_SIZE - 1));
+	if (aligned > memory)
+		munmap(memory, aligned - memory);
+	munmap(aligned + POOL_SLAB_SIZE, memory + POOL_SLAB_SIZE - aligned);
+
+	slab = (struct pool_slab *)aligned;
+	slab->pool = pool;
+	slab->prev = slab->next = NULL;
+	slab->free = NULL;
+	slab->fresh = aligned + _round(sizeof(struct pool_slab));
+	slab->used = 0;
+	pool->slabs++;
+
+	return slab;
+}
+
+static void
+_slab_unlink(struct pool *pool, struct pool_slab *slab) {
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else pool->partial = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+	slab->prev = slab->next = NULL;
+}
+
+static void
+_slab_link(struct pool *pool, struct pool_slab *slab) {
+	slab->prev = NULL;
+	slab->next = pool->partial;
+	if (pool->partial != NULL)
+		pool->partial->prev = slab;
+	pool->partial = slab;
+}
+
+/*
+ * Returns an object from the pool (not initialized), or NULL if
+ * there's no memory left.
+ */
+void *
+pool_alloc(struct pool *pool) {
+	struct pool_slab *slab;
+	void *object;
+
+	_pool_lock(pool);
+
+	if (pool->per_slab == 0) {
+		pool->size = _round(pool->size);
+		pool->per_slab = (POOL_SLAB_SIZE - _round(sizeof(struct pool_slab))) / pool->size;
+	}
+
+	slab = pool->partial;
+	if (slab == NULL) {
+		if (pool->spare != NULL) {
+			slab = pool->spare;
+			pool->spare = NULL;
+		} else slab = _slab_map(pool);
+
+		if (slab == NULL) {
+			_pool_unlock(pool);
+			return NULL;
+		}
+		_slab_link(pool, slab);
+	}
+
+	if (slab->free != NULL) {
+		object = slab->free;
+		slab->free = *(void **)object;
+	} else {
+		object = slab->fresh;
+		slab->fresh += pool->size;
+	}
+
+	if (++slab->used == pool->per_slab)
+		_slab_unlink(pool, slab);
+	pool->objects++;
+
+	_pool_unlock(pool);
+	return object;
+}
+
+/*
+ * Gives an object back to the pool it comes from. Slabs left empty
+ * are unmapped right away, so freeing a whole subtree gives back
+ * whole pages as it goes.
+ */
+void
+pool_free(void *object) {
+	struct pool_slab *slab = _slab_of(object);
+	struct pool *pool = slab->pool;
+
+	_pool_lock(pool);
+
+	if (slab->used-- == pool->per_slab)
+		_slab_link(pool, slab);
+	pool->objects--;
+
+	if (slab->used > 0) {
+		*(void **)object = slab->free;
+		slab->free = object;
+	} else {
+		_slab_unlink(pool, slab);
+		if (pool->spare == NULL) {
+			slab->free = NULL;
+			slab->fresh = (char *)slab + _round(sizeof(struct pool_slab));
+			pool->spare = slab;
+		} else {
+			munmap(slab, POOL_SLAB_SIZE);
+			pool->slabs--;
+		}
+	}
+
+	_pool_unlock(pool);
+}
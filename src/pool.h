@@ -0,0 +1,36 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Slabs are mapped on their own, aligned on their size */
+#define POOL_SLAB_SIZE 65536
+
+struct pool_slab;
+
+/*
+ * A pool of fixed size objects, carved out of POOL_SLAB_SIZE slabs.
+ * Free objects are linked through their first word. A slab goes back
+ * to the system as soon as all its objects are free (one empty slab
+ * is kept around, so that create/delete loops don't map and unmap
+ * all the time). Pools are safe to use from any thread.
+ * Unlike chunks (see kalloc.c) there are no per-thread caches in front
+ * of a pool: every call takes the pool's spinlock. Nodes and list
+ * entries are allocated by the single writer and freed by it or by
+ * epoch reclamation, so the lock is rarely contended, and objects
+ * parked in per-thread caches would keep otherwise empty slabs mapped.
+ */
+struct pool {
+	unsigned int size;
+	unsigned int per_slab;
+	struct pool_slab *partial;  /* slabs with free objects */
+	struct pool_slab *spare;    /* an empty slab kept for reuse */
+	unsigned long slabs;
+	unsigned long objects;
+	char lock;
+};
+
+#define POOL_INITIALIZER(type) { sizeof(type), 0, NULL, NULL, 0, 0, 0 }
+
+void *pool_alloc(struct pool *);
+void pool_free(void *);
+
+#endif /* POOL_H */
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
@@ -9,6 +10,7 @@
 #include "commands.h"
 #include "node.h"
 #include "parser.h"
+#include "expire.h"
 
 /* handle multiple root nodes */
 struct node_list *_nodes = NULL;
@@ -24,20 +26,57 @@ struct _commands {
 	char *command;
 	void *func;
 } commands[SHELL_N_FUNCS] = {
+	{ "bind",       cmd_bind },
+	{ "cachelimit", cmd_cache_limit },
 	{ "cd",         cmd_cd },
+	{ "clone",      cmd_clone },
 	{ "copyto",     cmd_copyto },
 	{ "createroot", cmd_create_root },
 	{ "deleteroot", cmd_delete_root },
+	{ "du",         cmd_du },
+	{ "find",       cmd_find },
 	{ "getroot",    cmd_get_root },
+	{ "import",     cmd_import },
+	{ "index",      cmd_index },
 	{ "listroot",   cmd_list_root },
 	{ "ls",         cmd_ls },
+	{ "mempolicy",  cmd_mempolicy },
 	{ "mkdir",      cmd_mkdir },
 	{ "mkfile",     cmd_mkfile },
+	{ "mv",         cmd_mv },
+	{ "quota",      cmd_quota },
+	{ "rm",         cmd_rm },
 	{ "rmdir",      cmd_rmdir },
 	{ "setroot",    cmd_set_root },
+	{ "tree",       cmd_tree },
+	{ "ttl",        cmd_ttl },
+	{ "verify",     cmd_verify },
 	{ "writeto",    cmd_writeto },
+	{ "xattr",      cmd_xattr },
 };
 
+/*
+ * Deletes a batch of expired nodes. Called by readline from time to
+ * time while it waits for input, so it never delays a command.
+ */
+static int
+_shell_expire(void) {
+	unsigned long now;
+	struct node *n;
+
+	if (expire_pending() == 0)
+		return 0;
+
+	/* don't stay in a directory which is about to go */
+	now = expire_now();
+	for (n = shell_get_curr_node(); n != NULL; n = n->father)
+		if (n->timer != NULL && n->timer->expires <= now && n->father != NULL)
+			shell_set_curr_node(shell_get_root()->node);
+
+	expire_run(now, EXPIRE_BATCH);
+	return 0;
+}
+
 void
 shell(void) {
 	unsigned int exit = 0;
@@ -45,6 +84,8 @@ shell(void) {
 
 	/* set up completion */
 	rl_attempted_completion_function = shell_completion;
+	/* expired nodes are deleted while we wait for input */
+	rl_event_hook = _shell_expire;
 
 	shell_hello();
 
@@ -113,6 +154,21 @@ shell_err_matcher(int return_code) {
 		case E_CANT_GET_EXT_FILE:
 			printf("Can't access to the specified file\n");
 			break;
+		case E_READ_ONLY:
+			printf("The node is read-only\n");
+			break;
+		case E_CHECKSUM:
+			printf("Checksum mismatch\n");
+			break;
+		case E_QUOTA:
+			printf("Quota exceeded\n");
+			break;
+		case E_NO_ATTR:
+			printf("No such attribute\n");
+			break;
+		case E_NO_INDEX:
+			printf("The attribute isn't indexed\n");
+			break;
 		}
 }
 
@@ -135,6 +191,11 @@ shell_completion(const char *text, int start, int end) {
 	 * directory. */
 	if (start == 0)
 		matches = rl_completion_matches(text, shell_command_generator);
+	else if (_current != NULL) {
+		matches = rl_completion_matches(text, shell_path_generator);
+		/* never fall back to the names of the real file system */
+		rl_attempted_completion_over = 1;
+	}
 
   return (matches);
 }
@@ -165,6 +226,55 @@ shell_command_generator(const char *text, int state) {
 	return ((char *)NULL);
 }
 
+/*
+ * Generator function for path completion: the names in the directory
+ * TEXT points to (relative to the current one) starting with its last
+ * component. They're found through node_seek_children(), so only the
+ * matching names are looked at even in huge directories.
+ */
+char *
+shell_path_generator(const char *text, int state) {
+	static struct node_list *nl;
+	static const char *base;
+	static size_t dir_len, base_len;
+	struct node *dir;
+	char *path, *match;
+
+	if (!state) {
+		nl = NULL;
+		base = strrchr(text, '/');
+		base = (base != NULL) ? base + 1 : text;
+		dir_len = base - text;
+		base_len = strlen(base);
+
+		dir = _current;
+		if (dir_len > 0) {
+			path = strndup(text, dir_len);
+			dir = (path != NULL) ? node_path_find(_current, path) : NULL;
+			free(path);
+		}
+
+		if (dir != NULL && dir->type == N_DIRECTORY)
+			nl = node_seek_children(dir, base);
+	}
+
+	if (nl == NULL || strncmp(nl->node->name, base, base_len) != 0)
+		return ((char *)NULL);
+
+	match = (char *)malloc(dir_len + nl->node->name_len + 2);
+	if (match != NULL) {
+		memcpy(match, text, dir_len);
+		strcpy(match + dir_len, nl->node->name);
+		if (nl->node->type == N_DIRECTORY) {
+			strcat(match, "/");
+			rl_completion_suppress_append = 1;
+		}
+	}
+
+	nl = nl->next;
+	return match;
+}
+
 int
 shell_parse_line(char *line) {
 	unsigned int i = 0, j = 0;
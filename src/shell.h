@@ -3,7 +3,7 @@
 
 #include "node.h"
 
-#define SHELL_N_FUNCS 12
+#define SHELL_N_FUNCS 27
 #define MAX_CMD_LEN 20
 
 void shell(void);
@@ -16,6 +16,7 @@ void shell_free_parsed_argline(char **, int);
 void shell_cleanup(void);
 char **shell_completion(const char *, int, int);
 char *shell_command_generator(const char *, int);
+char *shell_path_generator(const char *, int);
 struct node_list *shell_get_root(void);
 void shell_set_root(struct node_list *);
 unsigned int shell_get_roots_num(void);
@@ -0,0 +1,280 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "errors.h"
+#include "epoch.h"
+#include "walk.h"
+
+/*
+ * Parallel tree walk with work stealing: every worker owns a deque of
+ * directories still to be visited. It pushes the subdirectories it
+ * finds and pops them back from the same end, while idle workers
+ * steal from the other end of somebody else's deque. Each deque has
+ * its own lock, there's no global one.
+ */
+
+struct walk_deque {
+	pthread_mutex_t lock;
+	struct node **items;
+	unsigned int head, tail, capacity;
+} __attribute__((aligned(64)));
+
+struct walk_state {
+	walk_fn fn;
+	void *arg;
+	unsigned int threads;
+	unsigned long pending;  /* directories pushed but not visited yet */
+	struct walk_deque *deques;
+};
+
+struct walk_worker {
+	struct walk_state *state;
+	unsigned int id;
+};
+
+static void
+_deque_push(struct walk_deque *d, struct node *node) {
+	pthread_mutex_lock(&d->lock);
+	if (d->tail == d->capacity) {
+		/* compact, then grow if still full */
+		memmove(d->items, d->items + d->head,
+				(d->tail - d->head) * sizeof(struct node *));
+		d->tail -= d->head;
+		d->head = 0;
+		if (d->tail == d->capacity) {
+			d->capacity *= 2;
+			d->items = (struct node **)realloc(d->items,
+					d->capacity * sizeof(struct node *));
+		}
+	}
+	d->items[d->tail++] = node;
+	pthread_mutex_unlock(&d->lock);
+}
+
+static struct node *
+_deque_pop(struct walk_deque *d) {
+	struct node *node = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->tail > d->head)
+		node = d->items[--d->tail];
+	pthread_mutex_unlock(&d->lock);
+
+	return node;
+}
+
+static struct node *
+_deque_steal(struct walk_deque *d) {
+	struct node *node = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->tail > d->head)
+		node = d->items[d->head++];
+	pthread_mutex_unlock(&d->lock);
+
+	return node;
+}
+
+/* Visits a directory's children, queueing its subdirectories */
+static void
+_walk_dir(struct walk_worker *w, struct node *dir) {
+	struct walk_state *state = w->state;
+	struct node_list *nl;
+
+	for (nl = __atomic_load_n(&dir->childrens, __ATOMIC_ACQUIRE); nl != NULL;
+			nl = __atomic_load_n(&nl->next, __ATOMIC_ACQUIRE)) {
+		state->fn(nl->node, w->id, state->arg);
+
+		if (nl->node->type == N_DIRECTORY && nl->node->childrens != NULL) {
+			__atomic_add_fetch(&state->pending, 1, __ATOMIC_RELAXED);
+			_deque_push(&state->deques[w->id], nl->node);
+		}
+	}
+
+	__atomic_sub_fetch(&state->pending, 1, __ATOMIC_RELEASE);
+}
+
+static void *
+_walk_worker(void *ptr) {
+	struct walk_worker *w = (struct walk_worker *)ptr;
+	struct walk_state *state = w->state;
+	struct node *dir;
+	unsigned int i;
+
+	/* the others will do without it (the first one is already in) */
+	if (epoch_enter() != 0)
+		return NULL;
+
+	while (__atomic_load_n(&state->pending, __ATOMIC_ACQUIRE) > 0) {
+		dir = _deque_pop(&state->deques[w->id]);
+
+		for (i = 1; dir == NULL && i < state->threads; i++)
+			dir = _deque_steal(&state->deques[(w->id + i) % state->threads]);
+
+		if (dir != NULL)
+			_walk_dir(w, dir);
+		else sched_yield();
+	}
+
+	epoch_exit();
+	return NULL;
+}
+
+/* Returns the number of threads used by default: one per online CPU */
+unsigned int
+walk_threads(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		return 1;
+	return (cpus > WALK_MAX_THREADS) ? WALK_MAX_THREADS : cpus;
+}
+
+/*
+ * Calls 'fn' for 'root' and every node below it, using 'threads'
+ * threads (the calling one included). The order of the calls is not
+ * defined, and calls can run concurrently. The tree can be modified
+ * by another thread while it's being walked. Returns 0, or
+ * E_CANNOT_PROCEED if the calling thread can't read the tree safely.
+ */
+int
+walk_parallel(struct node *root, walk_fn fn, void *arg, unsigned int threads) {
+	struct walk_state state;
+	struct walk_worker workers[WALK_MAX_THREADS];
+	pthread_t tids[WALK_MAX_THREADS];
+	unsigned int i;
+
+	if (threads < 1)
+		threads = 1;
+	else if (threads > WALK_MAX_THREADS)
+		threads = WALK_MAX_THREADS;
+
+	fn(root, 0, arg);
+	if (root->type != N_DIRECTORY)
+		return 0;
+
+	/* worker 0 must be able to do the whole walk on its own */
+	if (epoch_enter() != 0)
+		return E_CANNOT_PROCEED;
+
+	state.fn = fn;
+	state.arg = arg;
+	state.threads = threads;
+	state.pending = 1;
+	/* calloc() wouldn't honour the alignment of the deques */
+	if (posix_memalign((void **)&state.deques, 64, threads * sizeof(struct walk_deque)) != 0) {
+		epoch_exit();
+		return E_CANNOT_PROCEED;
+	}
+	memset(state.deques, 0, threads * sizeof(struct walk_deque));
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_init(&state.deques[i].lock, NULL);
+		state.deques[i].capacity = 64;
+		state.deques[i].items = (struct node **)malloc(64 * sizeof(struct node *));
+	}
+	_deque_push(&state.deques[0], root);
+
+	for (i = 0; i < threads; i++) {
+		workers[i].state = &state;
+		workers[i].id = i;
+	}
+	for (i = 1; i < threads; i++)
+		if (pthread_create(&tids[i], NULL, _walk_worker, &workers[i]) != 0)
+			tids[i] = 0;
+
+	_walk_worker(&workers[0]);
+
+	for (i = 1; i < threads; i++)
+		if (tids[i] != 0)
+			pthread_join(tids[i], NULL);
+
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_destroy(&state.deques[i].lock);
+		free(state.deques[i].items);
+	}
+	free(state.deques);
+
+	epoch_exit();
+	return 0;
+}
+
+/* per-thread counters, each on its own cache line */
+struct _du_stats {
+	struct walk_stats stats;
+} __attribute__((aligned(64)));
+
+static void
+_du_visit(struct node *node, unsigned int worker, void *arg) {
+	struct walk_stats *stats = &((struct _du_stats *)arg)[worker].stats;
+
+	if (node->type == N_DIRECTORY)
+		stats->dirs++;
+	else {
+		stats->files++;
+		stats->bytes += node->size;
+	}
+}
+
+/*
+ * Computes the total size and the number of files and directories
+ * of a subtree ('root' included). Every thread sums into its own
+ * counters, which are added together at the end.
+ */
+int
+walk_du(struct node *root, struct walk_stats *total) {
+	struct _du_stats stats[WALK_MAX_THREADS];
+	unsigned int i, threads = walk_threads();
+	int ret;
+
+	memset(stats, 0, sizeof(stats));
+	memset(total, 0, sizeof(struct walk_stats));
+	if ((ret = walk_parallel(root, _du_visit, stats, threads)) != 0)
+		return ret;
+
+	for (i = 0; i < threads; i++) {
+		total->bytes += stats[i].stats.bytes;
+		total->files += stats[i].stats.files;
+		total->dirs += stats[i].stats.dirs;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes in 'buffer' the path of 'node' relative to 'root', which
+ * must be one of its ancestors. Returns the path length, or
+ * E_OUT_OF_BOUNDS if it doesn't fit in 'size' bytes.
+ */
+int
+walk_path(struct node *root, struct node *node, char *buffer, unsigned int size) {
+	unsigned int len = 0, pos;
+	struct node *n;
+
+	if (node == root) {
+		if (size < 2)
+			return E_OUT_OF_BOUNDS;
+		strcpy(buffer, NODE_SELF);
+		return 1;
+	}
+
+	for (n = node; n != root && n != NULL; n = n->father)
+		len += n->name_len + 1;
+	if (len > size)
+		return E_OUT_OF_BOUNDS;
+
+	/* fill the buffer backwards */
+	pos = len - 1;
+	buffer[pos] = '\0';
+	for (n = node; n != root && n != NULL; n = n->father) {
+		pos -= n->name_len;
+		memcpy(buffer + pos, n->name, n->name_len);
+		if (pos > 0)
+			buffer[--pos] = '/';
+	}
+
+	return len - 1;
+}
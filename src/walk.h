@@ -0,0 +1,26 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include "node.h"
+
+#define WALK_MAX_THREADS 64
+
+/*
+ * Called once for every node of the walked subtree. 'worker' is the
+ * number of the thread doing the call (0 to threads - 1), so callbacks
+ * can keep per-thread results without any locking.
+ */
+typedef void (*walk_fn)(struct node *, unsigned int worker, void *arg);
+
+struct walk_stats {
+	unsigned long bytes;
+	unsigned long files;
+	unsigned long dirs;
+};
+
+unsigned int walk_threads(void);
+int walk_parallel(struct node *, walk_fn, void *, unsigned int);
+int walk_du(struct node *, struct walk_stats *);
+int walk_path(struct node *, struct node *, char *, unsigned int);
+
+#endif /* WALK_H */
@@ -0,0 +1,615 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "node.h"
+#include "xattr.h"
+
+/*
+ * Secondary indexes: for each indexed key, a hash table from values
+ * to the nodes having them. They're kept up to date when attributes
+ * are set or removed and when nodes are deleted, so finding the nodes
+ * with a given value doesn't need a walk. Like the tree itself, they
+ * are changed by one writer at a time. Snapshots aren't indexed.
+ *
+ * Each distinct value is an xattr_value holding the list of its nodes,
+ * and each indexed node has an xattr_entry in that list, also found
+ * from a second table keyed by the node: setting or removing a value
+ * costs the same however many nodes share it. Values which are plain
+ * decimal numbers (e.g. expiry times) are also kept in ascending
+ * order in 'sorted', for xattr_index_before().
+ */
+struct xattr_entry {
+	struct node *node;
+	struct xattr_value *value;
+	struct xattr_entry *prev, *next;  /* nodes with the same value */
+	struct xattr_entry *node_next;    /* same bucket in 'nodes' */
+};
+
+struct xattr_value {
+	unsigned int hash;
+	int numeric;
+	unsigned long number;
+	struct xattr_entry *entries;
+	struct xattr_value *next;         /* same bucket in 'values' */
+	char value[];
+};
+
+struct xattr_index {
+	char key[XATTR_MAX_KEY];
+	struct xattr_value **values;
+	unsigned int values_no;
+	unsigned long nvalues;
+	struct xattr_entry **nodes;
+	unsigned int nodes_no;
+	unsigned long count;
+	struct xattr_value **sorted;
+	unsigned long nsorted, sorted_size;
+};
+
+static struct xattr_index _indexes[XATTR_MAX_INDEXES];
+static unsigned int _indexes_no = 0;
+
+static struct xattr_index *
+_index_of(const char *key) {
+	unsigned int i;
+
+	for (i = 0; i < _indexes_no; i++)
+		if (strcmp(_indexes[i].key, key) == 0)
+			return &_indexes[i];
+
+	return NULL;
+}
+
+static unsigned int
+_node_hash(struct node *node) {
+	return (unsigned int)((unsigned long)node >> 4) * 2654435761u;
+}
+
+/*
+ * Tells whether a value is a plain decimal number (no sign, no leading
+ * zeros, fitting an unsigned long), so that each number has a single
+ * spelling and numbers can be ordered.
+ */
+static int
+_value_number(const char *value, unsigned long *number) {
+	unsigned long n = 0;
+	const char *p;
+
+	if (*value == '\0' || (*value == '0' && value[1] != '\0'))
+		return 0;
+
+	for (p = value; *p != '\0'; p++) {
+		if (*p < '0' || *p > '9' || n > (~0UL - (*p - '0')) / 10)
+			return 0;
+		n = n * 10 + (*p - '0');
+	}
+
+	*number = n;
+	return 1;
+}
+
+/*
+ * Doubles the buckets of both tables of an index, when they're full.
+ * A failed grow only makes the chains longer, unless there are no
+ * buckets at all yet.
+ */
+static int
+_index_grow(struct xattr_index *index) {
+	struct xattr_value **values, *v, *vnext;
+	struct xattr_entry **nodes, *e, *enext;
+	unsigned int i, n;
+
+	if (index->nvalues >= index->values_no) {
+		n = index->values_no ? index->values_no * 2 : 64;
+		values = (struct xattr_value **)calloc(n, sizeof(struct xattr_value *));
+		if (values != NULL) {
+			for (i = 0; i < index->values_no; i++) {
+				for (v = index->values[i]; v != NULL; v = vnext) {
+					vnext = v->next;
+					v->next = values[v->hash & (n - 1)];
+					values[v->hash & (n - 1)] = v;
+				}
+			}
+			free(index->values);
+			index->values = values;
+			index->values_no = n;
+		}
+	}
+
+	if (index->count >= index->nodes_no) {
+		n = index->nodes_no ? index->nodes_no * 2 : 64;
+		nodes = (struct xattr_entry **)calloc(n, sizeof(struct xattr_entry *));
+		if (nodes != NULL) {
+			for (i = 0; i < index->nodes_no; i++) {
+				for (e = index->nodes[i]; e != NULL; e = enext) {
+					enext = e->node_next;
+					e->node_next = nodes[_node_hash(e->node) & (n - 1)];
+					nodes[_node_hash(e->node) & (n - 1)] = e;
+				}
+			}
+			free(index->nodes);
+			index->nodes = nodes;
+			index->nodes_no = n;
+		}
+	}
+
+	return (index->values_no == 0 || index->nodes_no == 0) ? E_CANNOT_PROCEED : 0;
+}
+
+/* Returns the entry of a node in an index, or NULL */
+static struct xattr_entry *
+_index_entry(struct xattr_index *index, struct node *node) {
+	struct xattr_entry *e;
+
+	if (index->nodes_no == 0)
+		return NULL;
+
+	for (e = index->nodes[_node_hash(node) & (index->nodes_no - 1)]; e != NULL; e = e->node_next)
+		if (e->node == node)
+			return e;
+
+	return NULL;
+}
+
+static struct xattr_value *
+_index_value(struct xattr_index *index, const char *value, unsigned int hash) {
+	struct xattr_value *v;
+
+	if (index->values_no == 0)
+		return NULL;
+
+	for (v = index->values[hash & (index->values_no - 1)]; v != NULL; v = v->next)
+		if (v->hash == hash && strcmp(v->value, value) == 0)
+			return v;
+
+	return NULL;
+}
+
+/* Position of 'number' in the sorted numeric values of an index */
+static unsigned long
+_index_rank(struct xattr_index *index, unsigned long number) {
+	unsigned long lo = 0, hi = index->nsorted, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->sorted[mid]->number < number)
+			lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+/* Adds a value without nodes to an index */
+static struct xattr_value *
+_index_new_value(struct xattr_index *index, const char *value, unsigned int hash) {
+	struct xattr_value *v, **sorted;
+	unsigned long size, rank;
+
+	v = (struct xattr_value *)malloc(sizeof(struct xattr_value) + strlen(value) + 1);
+	if (v == NULL)
+		return NULL;
+
+	strcpy(v->value, value);
+	v->hash = hash;
+	v->entries = NULL;
+	v->numeric = _value_number(value, &v->number);
+
+	if (v->numeric) {
+		if (index->nsorted == index->sorted_size) {
+			size = index->sorted_size ? index->sorted_size * 2 : 64;
+			sorted = (struct xattr_value **)realloc(index->sorted,
+					size * sizeof(struct xattr_value *));
+			if (sorted == NULL) {
+				free(v);
+				return NULL;
+			}
+			index->sorted = sorted;
+			index->sorted_size = size;
+		}
+
+		rank = _index_rank(index, v->number);
+		memmove(&index->sorted[rank + 1], &index->sorted[rank],
+				(index->nsorted - rank) * sizeof(struct xattr_value *));
+		index->sorted[rank] = v;
+		index->nsorted++;
+	}
+
+	v->next = index->values[hash & (index->values_no - 1)];
+	index->values[hash & (index->values_no - 1)] = v;
+	index->nvalues++;
+
+	return v;
+}
+
+/* Drops a value which has no nodes left */
+static void
+_index_drop_value(struct xattr_index *index, struct xattr_value *v) {
+	struct xattr_value **prev;
+	unsigned long rank;
+
+	for (prev = &index->values[v->hash & (index->values_no - 1)]; *prev != v; prev = &(*prev)->next);
+	*prev = v->next;
+	index->nvalues--;
+
+	if (v->numeric) {
+		rank = _index_rank(index, v->number);
+		memmove(&index->sorted[rank], &index->sorted[rank + 1],
+				(index->nsorted - rank - 1) * sizeof(struct xattr_value *));
+		index->nsorted--;
+	}
+
+	free(v);
+}
+
+/* Takes an entry out of the list of its value */
+static void
+_index_unlink(struct xattr_index *index, struct xattr_entry *e) {
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else e->value->entries = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+
+	if (e->value->entries == NULL)
+		_index_drop_value(index, e->value);
+	e->value = NULL;
+}
+
+/*
+ * Indexes a node under 'value', moving it if it was indexed under
+ * another one. Read only nodes (snapshots) are left out.
+ */
+static int
+_index_add(struct xattr_index *index, struct node *node, const char *value) {
+	unsigned int hash = node_name_hash(value, strlen(value));
+	struct xattr_entry *e;
+	struct xattr_value *v;
+
+	if (node->readonly)
+		return 0;
+	if (_index_grow(index) < 0)
+		return E_CANNOT_PROCEED;
+
+	e = _index_entry(index, node);
+	if (e != NULL && e->value->hash == hash && strcmp(e->value->value, value) == 0)
+		return 0;
+
+	v = _index_value(index, value, hash);
+	if (v == NULL && (v = _index_new_value(index, value, hash)) == NULL)
+		return E_CANNOT_PROCEED;
+
+	if (e != NULL)
+		_index_unlink(index, e);
+	else {
+		e = (struct xattr_entry *)malloc(sizeof(struct xattr_entry));
+		if (e == NULL) {
+			if (v->entries == NULL)
+				_index_drop_value(index, v);
+			return E_CANNOT_PROCEED;
+		}
+		e->node = node;
+		e->node_next = index->nodes[_node_hash(node) & (index->nodes_no - 1)];
+		index->nodes[_node_hash(node) & (index->nodes_no - 1)] = e;
+		index->count++;
+	}
+
+	e->value = v;
+	e->prev = NULL;
+	e->next = v->entries;
+	if (v->entries != NULL)
+		v->entries->prev = e;
+	v->entries = e;
+
+	return 0;
+}
+
+static void
+_index_remove(struct xattr_index *index, struct node *node) {
+	struct xattr_entry **prev, *e;
+
+	if (index->nodes_no == 0)
+		return;
+
+	prev = &index->nodes[_node_hash(node) & (index->nodes_no - 1)];
+	for (e = *prev; e != NULL; prev = &e->node_next, e = e->node_next) {
+		if (e->node == node) {
+			*prev = e->node_next;
+			_index_unlink(index, e);
+			free(e);
+			index->count--;
+			return;
+		}
+	}
+}
+
+/* Returns the "key\0value\0" pair for 'key' in a node, or NULL */
+static char *
+_xattr_pair(struct node *node, const char *key) {
+	char *p, *end;
+
+	if (node->xattrs == NULL)
+		return NULL;
+
+	p = node->xattrs->data;
+	end = p + node->xattrs->len;
+	while (p < end) {
+		if (strcmp(p, key) == 0)
+			return p;
+		p += strlen(p) + 1;
+		p += strlen(p) + 1;
+	}
+
+	return NULL;
+}
+
+/* Removes a pair from the buffer of a node */
+static void
+_xattr_cut(struct node *node, char *pair) {
+	char *value = pair + strlen(pair) + 1;
+	unsigned int len = strlen(pair) + strlen(value) + 2;
+	char *end = node->xattrs->data + node->xattrs->len;
+
+	memmove(pair, pair + len, end - (pair + len));
+	node->xattrs->len -= len;
+}
+
+/* Removes a pair from a node, taking it out of its index first */
+static void
+_xattr_drop(struct node *node, char *pair) {
+	struct xattr_index *index = _index_of(pair);
+
+	if (index != NULL)
+		_index_remove(index, node);
+
+	_xattr_cut(node, pair);
+}
+
+static int
+_xattr_valid_key(const char *key) {
+	unsigned int len = strlen(key);
+
+	return len > 0 && len < XATTR_MAX_KEY && strchr(key, '=') == NULL;
+}
+
+/*
+ * Sets the attribute 'key' of a node to 'value', replacing its old
+ * value if any. Keys can't contain '='. On failure the node keeps its
+ * old value, in the index too.
+ */
+int
+node_setxattr(struct node *node, const char *key, const char *value) {
+	struct node_xattrs *x;
+	struct xattr_index *index;
+	unsigned int klen = strlen(key), vlen = strlen(value), size;
+	char *pair;
+	int ret;
+
+	if (!_xattr_valid_key(key))
+		return E_INVALID_NAME;
+	if (vlen >= XATTR_MAX_VALUE)
+		return E_OUT_OF_BOUNDS;
+	if (node->readonly)
+		return E_READ_ONLY;
+
+	/* room for the new pair, as if the old one was still there */
+	x = node->xattrs;
+	if (x == NULL || x->len + klen + vlen + 2 > x->size) {
+		size = (x != NULL) ? x->size * 2 : 64;
+		while (size < ((x != NULL) ? x->len : 0) + klen + vlen + 2)
+			size *= 2;
+
+		x = (struct node_xattrs *)realloc(x, sizeof(struct node_xattrs) + size);
+		if (x == NULL)
+			return E_CANNOT_PROCEED;
+		if (node->xattrs == NULL)
+			x->len = 0;
+		x->size = size;
+		node->xattrs = x;
+	}
+
+	/* moves the node to its new value in the index */
+	if ((index = _index_of(key)) != NULL && (ret = _index_add(index, node, value)) < 0)
+		return ret;
+
+	if ((pair = _xattr_pair(node, key)) != NULL)
+		_xattr_cut(node, pair);
+
+	memcpy(x->data + x->len, key, klen + 1);
+	memcpy(x->data + x->len + klen + 1, value, vlen + 1);
+	x->len += klen + vlen + 2;
+
+	return 0;
+}
+
+/* Returns the value of the attribute 'key' of a node, or NULL */
+const char *
+node_getxattr(struct node *node, const char *key) {
+	char *pair = _xattr_pair(node, key);
+
+	return (pair != NULL) ? pair + strlen(pair) + 1 : NULL;
+}
+
+int
+node_removexattr(struct node *node, const char *key) {
+	char *pair;
+
+	if (node->readonly)
+		return E_READ_ONLY;
+	if ((pair = _xattr_pair(node, key)) == NULL)
+		return E_NO_ATTR;
+
+	_xattr_drop(node, pair);
+	return 0;
+}
+
+/*
+ * Returns the attribute key following 'key' (the first one when key
+ * is NULL), or NULL when there are no more. Keys come in the order
+ * they were set.
+ */
+const char *
+node_nextxattr(struct node *node, const char *key) {
+	char *p;
+
+	if (node->xattrs == NULL || node->xattrs->len == 0)
+		return NULL;
+
+	if (key == NULL)
+		return node->xattrs->data;
+
+	if ((p = _xattr_pair(node, key)) == NULL)
+		return NULL;
+
+	p += strlen(p) + 1;
+	p += strlen(p) + 1;
+	return (p < node->xattrs->data + node->xattrs->len) ? p : NULL;
+}
+
+/* Gives 'dst' (which has no attributes yet) the attributes of 'src' */
+int
+node_copyxattrs(struct node *dst, struct node *src) {
+	struct xattr_index *index;
+	const char *key;
+
+	if (src->xattrs == NULL || src->xattrs->len == 0)
+		return 0;
+
+	dst->xattrs = (struct node_xattrs *)malloc(sizeof(struct node_xattrs) + src->xattrs->len);
+	if (dst->xattrs == NULL)
+		return E_CANNOT_PROCEED;
+
+	memcpy(dst->xattrs->data, src->xattrs->data, src->xattrs->len);
+	dst->xattrs->len = dst->xattrs->size = src->xattrs->len;
+
+	for (key = node_nextxattr(dst, NULL); key != NULL; key = node_nextxattr(dst, key)) {
+		if ((index = _index_of(key)) != NULL &&
+				_index_add(index, dst, node_getxattr(dst, key)) < 0) {
+			node_clearxattrs(dst);
+			return E_CANNOT_PROCEED;
+		}
+	}
+
+	return 0;
+}
+
+/* Drops all the attributes of a node (it's about to be deleted) */
+void
+node_clearxattrs(struct node *node) {
+	struct xattr_index *index;
+	const char *key;
+
+	if (node->xattrs == NULL)
+		return;
+
+	for (key = node_nextxattr(node, NULL); key != NULL; key = node_nextxattr(node, key))
+		if ((index = _index_of(key)) != NULL)
+			_index_remove(index, node);
+
+	free(node->xattrs);
+	node->xattrs = NULL;
+}
+
+static int
+_index_subtree(struct xattr_index *index, struct node *node) {
+	struct node_list *nl;
+	const char *value = node_getxattr(node, index->key);
+
+	if (value != NULL && _index_add(index, node, value) < 0)
+		return E_CANNOT_PROCEED;
+
+	for (nl = node->childrens; nl != NULL; nl = nl->next)
+		if (_index_subtree(index, nl->node) < 0)
+			return E_CANNOT_PROCEED;
+
+	return 0;
+}
+
+/*
+ * Indexes the attribute 'key': from now on the nodes having it can be
+ * found with xattr_index_find(). Nodes which already have it are only
+ * indexed if they're below 'root' (which can be NULL), so call this
+ * once for each tree holding them. On failure some of them may be
+ * left out: calling it again adds the missing ones.
+ */
+int
+xattr_index_create(const char *key, struct node *root) {
+	struct xattr_index *index;
+
+	if (!_xattr_valid_key(key))
+		return E_INVALID_NAME;
+
+	if ((index = _index_of(key)) == NULL) {
+		if (_indexes_no == XATTR_MAX_INDEXES)
+			return E_CANNOT_PROCEED;
+
+		index = &_indexes[_indexes_no++];
+		memset(index, 0, sizeof(struct xattr_index));
+		strcpy(index->key, key);
+	}
+
+	if (root != NULL)
+		return _index_subtree(index, root);
+
+	return 0;
+}
+
+/* Stores the nodes of 'v' below 'root' in 'nodes', counting them in 'found' */
+static void
+_index_collect(struct xattr_value *v, struct node *root,
+		struct node **nodes, unsigned int max, unsigned int *found) {
+	struct xattr_entry *e;
+
+	for (e = v->entries; e != NULL; e = e->next) {
+		if (root != NULL && !node_is_below(e->node, root))
+			continue;
+
+		if (*found < max)
+			nodes[*found] = e->node;
+		(*found)++;
+	}
+}
+
+/*
+ * Stores in 'nodes' (up to 'max' of them) the nodes below 'root' (or
+ * anywhere, if it's NULL) whose attribute 'key' is 'value', and
+ * returns how many there are in total. 'key' must be indexed.
+ */
+int
+xattr_index_find(const char *key, const char *value, struct node *root,
+		struct node **nodes, unsigned int max) {
+	struct xattr_index *index = _index_of(key);
+	struct xattr_value *v;
+	unsigned int found = 0;
+
+	if (index == NULL)
+		return E_NO_INDEX;
+
+	v = _index_value(index, value, node_name_hash(value, strlen(value)));
+	if (v != NULL)
+		_index_collect(v, root, nodes, max, &found);
+
+	return found;
+}
+
+/*
+ * Same as xattr_index_find(), but for the nodes whose attribute 'key'
+ * is a decimal number lower than 'number' (e.g. an expiry time before
+ * now). They come in ascending order of their values.
+ */
+int
+xattr_index_before(const char *key, unsigned long number, struct node *root,
+		struct node **nodes, unsigned int max) {
+	struct xattr_index *index = _index_of(key);
+	unsigned long i;
+	unsigned int found = 0;
+
+	if (index == NULL)
+		return E_NO_INDEX;
+
+	for (i = 0; i < index->nsorted && index->sorted[i]->number < number; i++)
+		_index_collect(index->sorted[i], root, nodes, max, &found);
+
+	return found;
+}
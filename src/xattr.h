@@ -0,0 +1,32 @@
+#ifndef XATTR_H
+#define XATTR_H
+
+#include "node.h"
+
+#define XATTR_MAX_KEY     64
+#define XATTR_MAX_VALUE   1024
+#define XATTR_MAX_INDEXES 8
+
+/*
+ * Extended attributes of a node: 'len' bytes of "key\0value\0" pairs
+ * in a single buffer of 'size' bytes, so that a few small attributes
+ * cost a single allocation.
+ */
+struct node_xattrs {
+	unsigned int len;
+	unsigned int size;
+	char data[];
+};
+
+int node_setxattr(struct node *, const char *, const char *);
+const char *node_getxattr(struct node *, const char *);
+int node_removexattr(struct node *, const char *);
+const char *node_nextxattr(struct node *, const char *);
+int node_copyxattrs(struct node *, struct node *);
+void node_clearxattrs(struct node *);
+
+int xattr_index_create(const char *, struct node *);
+int xattr_index_find(const char *, const char *, struct node *, struct node **, unsigned int);
+int xattr_index_before(const char *, unsigned long, struct node *, struct node **, unsigned int);
+
+#endif /* XATTR_H */
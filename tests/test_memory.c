@@ -5,12 +5,33 @@
 #include <check.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "../src/common.h"
 #include "../src/kalloc.h"
 #include "../src/node.h"
 #include "../src/io.h"
+#include "../src/kring.h"
 #include "../src/errors.h"
+#include "../src/crc32c.h"
+#include "../src/pool.h"
+#include "../src/epoch.h"
+
+extern long _mem_count;
+
+/* number of chunks behind a file node */
+static unsigned int
+_chunk_count(struct node *node) {
+	Chunk *chunk;
+	unsigned int count = 0;
+
+	for (chunk = node->first_chunk; chunk != NULL; chunk = chunk->next)
+		count++;
+	return count;
+}
 
 START_TEST (mem_alloc_1byte)
 {
@@ -72,7 +93,7 @@ START_TEST (mem_multiple_reads)
 	struct node *node = node_create("node", N_FILE);
 	KFILE kfile;
 	char *orig = "I am the walrus";
-	char *buffer = (char *)malloc(strlen(orig));
+	char *buffer = (char *)calloc(1, strlen(orig) + 1);
 
 	node_add_child(root, node);
 	kfile = kopen(root, "node");
@@ -81,18 +102,1044 @@ START_TEST (mem_multiple_reads)
 	kread(kfile, 5, buffer);
 	fail_unless (strcmp(buffer, "I am ") == 0);
 
+	memset(buffer, 0, strlen(orig) + 1);
 	kread(kfile, 4, buffer);
 	fail_unless (strcmp(buffer, "the ") == 0);
 
+	memset(buffer, 0, strlen(orig) + 1);
 	kread(kfile, 6, buffer);
 	fail_unless (strcmp(buffer, "walrus") == 0);
 
+	/* nothing left to read */
+	fail_unless (kread(kfile, 1, buffer) == 0);
+
 	free(buffer);
 	kclose(kfile);
 	node_delete(root);
 }
 END_TEST
 
+START_TEST (mem_chunk_list)
+{
+	/* allocations bigger than CHUNK_SIZE are split in a list of chunks */
+	Chunk *c = kalloc(CHUNK_SIZE * 2 + 1);
+
+	fail_unless (c->size == CHUNK_SIZE);
+	fail_unless (c->next->size == CHUNK_SIZE);
+	fail_unless (c->next->next->size == 1);
+	fail_unless (c->next->next->next == NULL);
+
+	kfree(c);
+}
+END_TEST
+
+START_TEST (mem_positional_io)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *node = node_create("node", N_FILE);
+	KFILE kfile;
+	char buffer[8];
+
+	node_add_child(root, node);
+	kfile = kopen(root, "node");
+
+	kwrite(kfile, "0123456789", 10);
+	fail_unless (kpwrite(kfile, 2, "ab", 2) == 2);
+	fail_unless (root->tree_bytes == 10);
+
+	memset(buffer, 0, sizeof(buffer));
+	fail_unless (kpread(kfile, 1, 4, buffer) == 4);
+	fail_unless (strcmp(buffer, "1ab4") == 0);
+
+	/* the read position hasn't moved */
+	fail_unless (ktell(kfile) == 0);
+
+	/* reads stop at the end of the file */
+	fail_unless (kpread(kfile, 8, 4, buffer) == 2);
+	fail_unless (kpread(kfile, 10, 4, buffer) == 0);
+
+	fail_unless (kseek(kfile, -3, KF_SEEK_EOF) == 0);
+	fail_unless (ktell(kfile) == 7);
+	fail_unless (kseek(kfile, -8, KF_SEEK_CURR) == E_OUT_OF_BOUNDS);
+
+	kclose(kfile);
+	node_delete(root);
+}
+END_TEST
+
+START_TEST (mem_vectored_io_across_chunks)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *node = node_create("node", N_FILE);
+	KFILE kfile;
+	char *big = (char *)malloc(CHUNK_SIZE);
+	char head[4], tail[6];
+	struct kiovec wiov[2], riov[2];
+
+	node_add_child(root, node);
+	kfile = kopen(root, "node");
+
+	memset(big, 'x', CHUNK_SIZE);
+	wiov[0].base = big;
+	wiov[0].len = CHUNK_SIZE - 2;
+	wiov[1].base = "abcdefgh";
+	wiov[1].len = 8;
+	fail_unless (kwritev(kfile, wiov, 2) == CHUNK_SIZE + 6);
+	fail_unless (node->size == CHUNK_SIZE + 6);
+
+	/* the second buffer spans the boundary between the two chunks */
+	riov[0].base = head;
+	riov[0].len = sizeof(head);
+	riov[1].base = tail;
+	riov[1].len = sizeof(tail);
+	fail_unless (kpreadv(kfile, CHUNK_SIZE - 6, riov, 2) == 10);
+	fail_unless (memcmp(head, "xxxx", 4) == 0);
+	fail_unless (memcmp(tail, "abcdef", 6) == 0);
+
+	free(big);
+	kclose(kfile);
+	node_delete(root);
+}
+END_TEST
+
+START_TEST (mem_ring_batch)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *node = node_create("node", N_FILE);
+	struct kring *ring = kring_create(3);
+	struct kring_sqe *sqe;
+	struct kring_cqe cqes[4];
+	struct kring_stat st;
+	KFILE kfile;
+	char buffer[8];
+	unsigned int i;
+
+	node_add_child(root, node);
+	fail_unless (ring != NULL && ring->entries == 4);
+
+	sqe = kring_get_sqe(ring);
+	sqe->op = KR_OPEN;
+	sqe->root = root;
+	sqe->path = "node";
+	sqe->user_data = node;
+	sqe = kring_get_sqe(ring);
+	sqe->op = KR_OPEN;
+	sqe->root = root;
+	sqe->path = "missing";
+	sqe->user_data = NULL;
+	fail_unless (kring_submit(ring) == 2);
+	fail_unless (kring_wait(ring, 2) == 2);
+	fail_unless (kring_reap(ring, cqes, 4) == 2);
+
+	/* the workers may complete them in any order */
+	i = (cqes[0].user_data == node) ? 0 : 1;
+	fail_unless (cqes[i].user_data == node);
+	fail_unless (cqes[i].res == 0 && cqes[i].file != NULL);
+	fail_unless (cqes[1 - i].res == E_FILE_NOT_FOUND);
+	kfile = cqes[i].file;
+
+	/* the ring only reads: the file is written by this (writer) thread */
+	fail_unless (kpwrite(kfile, 0, "walrus", 6) == 6);
+
+	sqe = kring_get_sqe(ring);
+	sqe->op = KR_READ;
+	sqe->file = kfile;
+	sqe->buf = buffer;
+	sqe->len = sizeof(buffer);
+	sqe->offset = 2;
+	sqe->user_data = buffer;
+	sqe = kring_get_sqe(ring);
+	sqe->op = KR_STAT;
+	sqe->root = root;
+	sqe->path = "node";
+	sqe->buf = &st;
+	sqe->user_data = &st;
+	sqe = kring_get_sqe(ring);
+	sqe->op = KR_WRITE;
+	sqe->file = kfile;
+	sqe->buf = "walrus";
+	sqe->len = 6;
+	sqe->user_data = kfile;
+	sqe = kring_get_sqe(ring);
+	sqe->op = KR_CLOSE;
+	sqe->file = kfile;
+	sqe->user_data = ring;
+
+	/* the submission queue is full */
+	fail_unless (kring_get_sqe(ring) == NULL);
+
+	fail_unless (kring_pending(ring) == 4);
+	fail_unless (kring_submit(ring) == 4);
+	fail_unless (kring_pending(ring) == 0);
+	fail_unless (kring_wait(ring, 10) == 4);
+	fail_unless (kring_reap(ring, cqes, 4) == 4);
+
+	/* completions come in any order, but the close comes last */
+	fail_unless (cqes[3].user_data == ring && cqes[3].res == 0);
+	for (i = 0; i < 3; i++) {
+		if (cqes[i].user_data == buffer)
+			fail_unless (cqes[i].res == 4 && memcmp(buffer, "lrus", 4) == 0);
+		else if (cqes[i].user_data == &st)
+			fail_unless (cqes[i].res == 0 && st.type == N_FILE && st.size == 6);
+		else fail_unless (cqes[i].user_data == kfile && cqes[i].res == E_READ_ONLY);
+	}
+
+	kring_destroy(ring);
+	node_delete(root);
+}
+END_TEST
+
+START_TEST (mem_bound_file)
+{
+	struct node *node = node_create("node", N_FILE);
+	char path[] = "/tmp/inmemfs-bind-XXXXXX";
+	char *data = (char *)malloc(CHUNK_SIZE * 2 + 10);
+	char buffer[4];
+	struct _KFILE kfile = { .node = node };
+	Chunk *first, *second;
+	int fd;
+
+	memset(data, 'a', CHUNK_SIZE);
+	memset(data + CHUNK_SIZE, 'b', CHUNK_SIZE);
+	memset(data + CHUNK_SIZE * 2, 'c', 10);
+	fd = mkstemp(path);
+	fail_unless (write(fd, data, CHUNK_SIZE * 2 + 10) == CHUNK_SIZE * 2 + 10);
+	close(fd);
+
+	fail_unless (kbind(node, path) == 0);
+	fail_unless (node->size == CHUNK_SIZE * 2 + 10);
+	first = node->first_chunk;
+	second = first->next;
+
+	/* nothing is read until it's needed */
+	fail_unless (first->memory == NULL && second->memory == NULL);
+	fail_unless (kpread(&kfile, CHUNK_SIZE + 1, 2, buffer) == 2);
+	fail_unless (memcmp(buffer, "bb", 2) == 0);
+	fail_unless (first->memory == NULL && second->memory != NULL);
+	fail_unless (kcache_get_bytes() == CHUNK_SIZE);
+
+	/* over the limit, the least recently used chunk is dropped */
+	kcache_set_limit(CHUNK_SIZE);
+	fail_unless (kpread(&kfile, 0, 2, buffer) == 2);
+	fail_unless (memcmp(buffer, "aa", 2) == 0);
+	fail_unless (first->memory != NULL);
+	fail_unless (second->memory == NULL);
+	fail_unless (kcache_get_bytes() == CHUNK_SIZE);
+
+	/* dropped chunks are filled again */
+	fail_unless (kpread(&kfile, CHUNK_SIZE - 1, 2, buffer) == 2);
+	fail_unless (memcmp(buffer, "ab", 2) == 0);
+
+	/* written chunks can't be dropped anymore */
+	fail_unless (kpwrite(&kfile, CHUNK_SIZE * 2, "xy", 2) == 2);
+	fail_unless (kpread(&kfile, CHUNK_SIZE * 2, 4, buffer) == 4);
+	fail_unless (memcmp(buffer, "xycc", 4) == 0);
+	fail_unless (kpread(&kfile, 0, 1, buffer) == 1);
+	fail_unless (kcache_get_bytes() == CHUNK_SIZE);
+	fail_unless (node->first_chunk->next->next->memory != NULL);
+
+	kcache_set_limit(0);
+	free(data);
+	unlink(path);
+	node_delete(node);
+	fail_unless (kcache_get_bytes() == 0);
+}
+END_TEST
+
+static void *
+_bound_reader(void *arg) {
+	struct _KFILE kfile = { .node = (struct node *)arg };
+	char buffer[2];
+	unsigned int i;
+
+	for (i = 0; i < 4; i++)
+		if (kpread(&kfile, CHUNK_SIZE - 2 - i, 2, buffer) != 2 ||
+				memcmp(buffer, "zz", 2) != 0)
+			return arg;
+
+	return NULL;
+}
+
+START_TEST (mem_bound_racing_readers)
+{
+	char path[] = "/tmp/inmemfs-bind-XXXXXX";
+	char *data = (char *)malloc(CHUNK_SIZE);
+	struct node *node;
+	pthread_t threads[4];
+	void *res;
+	unsigned int round, i;
+	long before = _mem_count;
+	int fd;
+
+	memset(data, 'z', CHUNK_SIZE);
+	fd = mkstemp(path);
+	fail_unless (write(fd, data, CHUNK_SIZE) == CHUNK_SIZE);
+	close(fd);
+
+	/* the chunk is filled once, however many readers find it empty */
+	for (round = 0; round < 16; round++) {
+		node = node_create("node", N_FILE);
+		fail_unless (kbind(node, path) == 0);
+		for (i = 0; i < 4; i++)
+			pthread_create(&threads[i], NULL, _bound_reader, node);
+		for (i = 0; i < 4; i++) {
+			pthread_join(threads[i], &res);
+			fail_unless (res == NULL);
+		}
+		fail_unless (_mem_count == before + CHUNK_SIZE);
+		fail_unless (kcache_get_bytes() == CHUNK_SIZE);
+		node_delete(node);
+		fail_unless (_mem_count == before);
+		fail_unless (kcache_get_bytes() == 0);
+	}
+
+	free(data);
+	unlink(path);
+}
+END_TEST
+
+static void *
+_evicting_reader(void *arg) {
+	struct _KFILE kfile = { .node = (struct node *)arg };
+	char buffer[CHUNK_SIZE / 4];
+	unsigned int round, i, j;
+
+	/* every read fills a chunk and evicts one another reader may use */
+	for (round = 0; round < 8; round++)
+		for (i = 0; i < 4; i++) {
+			if (kpread(&kfile, i * CHUNK_SIZE + CHUNK_SIZE / 2, sizeof(buffer),
+						buffer) != sizeof(buffer))
+				return arg;
+			for (j = 0; j < sizeof(buffer); j++)
+				if (buffer[j] != 'a' + i)
+					return arg;
+		}
+
+	return NULL;
+}
+
+START_TEST (mem_bound_evicting_readers)
+{
+	char path[] = "/tmp/inmemfs-bind-XXXXXX";
+	char *data = (char *)malloc(CHUNK_SIZE * 4);
+	struct node *node = node_create("node", N_FILE);
+	pthread_t threads[4];
+	void *res;
+	unsigned int i;
+	long before = _mem_count;
+	int fd;
+
+	for (i = 0; i < 4; i++)
+		memset(data + i * CHUNK_SIZE, 'a' + i, CHUNK_SIZE);
+	fd = mkstemp(path);
+	fail_unless (write(fd, data, CHUNK_SIZE * 4) == CHUNK_SIZE * 4);
+	close(fd);
+
+	fail_unless (kbind(node, path) == 0);
+	kcache_set_limit(CHUNK_SIZE);
+	for (i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, _evicting_reader, node);
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], &res);
+		fail_unless (res == NULL);
+	}
+
+	/* evicted memory is freed once the readers are gone */
+	epoch_reclaim();
+	fail_unless (epoch_pending() == 0);
+	fail_unless (kcache_get_bytes() == CHUNK_SIZE);
+	fail_unless (_mem_count == before + CHUNK_SIZE);
+
+	kcache_set_limit(0);
+	node_delete(node);
+	fail_unless (_mem_count == before);
+	free(data);
+	unlink(path);
+}
+END_TEST
+
+START_TEST (mem_bind_errors)
+{
+	struct node *a = node_create("a", N_FILE), *b = node_create("b", N_FILE);
+	char path[] = "/tmp/inmemfs-bind-XXXXXX";
+	struct _KFILE ka = { .node = a }, kb = { .node = b };
+	char buffer[12];
+	int fd;
+
+	fd = mkstemp(path);
+	fail_unless (write(fd, "hello world!", 12) == 12);
+	close(fd);
+	fail_unless (kbind(a, path) == 0);
+	fail_unless (kbind(b, path) == 0);
+
+	/* growing a cached chunk takes it out of the cache first */
+	fail_unless (kpread(&ka, 0, 12, buffer) == 12);
+	fail_unless (kcache_get_bytes() == 12);
+	fail_unless (kpwrite(&ka, 1000, "x", 1) == 1);
+	fail_unless (kcache_get_bytes() == 0);
+	fail_unless (a->size == 1001);
+
+	/* a chunk which couldn't be filled is filled on the next read */
+	unlink(path);
+	fail_unless (kpread(&kb, 0, 5, buffer) != 5);
+	fail_unless (b->first_chunk->memory == NULL);
+	fd = open(path, O_WRONLY | O_CREAT, 0600);
+	fail_unless (write(fd, "hello world!", 12) == 12);
+	close(fd);
+	fail_unless (kpread(&kb, 0, 5, buffer) == 5);
+	fail_unless (memcmp(buffer, "hello", 5) == 0);
+
+	unlink(path);
+	node_delete(a);
+	node_delete(b);
+	fail_unless (kcache_get_bytes() == 0);
+}
+END_TEST
+
+START_TEST (mem_clone_copy_on_write)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *node = node_create("node", N_FILE);
+	struct node *clone;
+	struct _KFILE kfile = { .node = node };
+	struct _KFILE kclone_file;
+	char buffer[8];
+
+	node_add_child(root, node);
+	kwrite(&kfile, "original", 8);
+
+	clone = node_clone(node, "clone");
+	kclone_file.node = clone;
+	fail_unless (clone->size == 8);
+	fail_unless (clone->first_chunk->memory == node->first_chunk->memory);
+
+	/* writing the clone leaves the original alone */
+	fail_unless (kpwrite(&kclone_file, 0, "cl", 2) == 2);
+	fail_unless (clone->first_chunk->memory != node->first_chunk->memory);
+	fail_unless (kpread(&kfile, 0, 8, buffer) == 8);
+	fail_unless (memcmp(buffer, "original", 8) == 0);
+	fail_unless (kpread(&kclone_file, 0, 8, buffer) == 8);
+	fail_unless (memcmp(buffer, "cliginal", 8) == 0);
+
+	/* the memory survives the deletion of the original */
+	node_delete(clone);
+	clone = node_clone(node, "clone");
+	kclone_file.node = clone;
+	node_delete(root);
+	fail_unless (kpread(&kclone_file, 0, 8, buffer) == 8);
+	fail_unless (memcmp(buffer, "original", 8) == 0);
+	fail_unless (clone->first_chunk->shared == NULL);
+
+	node_delete(clone);
+}
+END_TEST
+
+START_TEST (mem_snapshot_content)
+{
+	struct node *node = node_create("node", N_FILE);
+	struct node *snapshot;
+	struct _KFILE kfile = { .node = node };
+	struct _KFILE ksnapshot = { .node = NULL };
+	char buffer[8];
+
+	kwrite(&kfile, "version1", 8);
+	snapshot = node_snapshot(node);
+	ksnapshot.node = snapshot;
+
+	kpwrite(&kfile, 7, "2", 1);
+	kwrite(&kfile, "more", 4);
+	fail_unless (kpwrite(&ksnapshot, 0, "x", 1) == E_READ_ONLY);
+
+	fail_unless (snapshot->size == 8);
+	fail_unless (kpread(&ksnapshot, 0, 8, buffer) == 8);
+	fail_unless (memcmp(buffer, "version1", 8) == 0);
+	fail_unless (kpread(&kfile, 0, 8, buffer) == 8);
+	fail_unless (memcmp(buffer, "version2", 8) == 0);
+
+	node_snapshot_release(snapshot);
+	node_delete(node);
+}
+END_TEST
+
+START_TEST (mem_snapshot_cost)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *file, *snapshot;
+	struct _KFILE kfile;
+	char name[8], *data = (char *)calloc(1, CHUNK_SIZE + 1);
+	Chunk *chunk;
+	long before;
+	unsigned int i, chunks = 0;
+
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "f%u", i);
+		file = node_create(name, N_FILE);
+		node_add_child(root, file);
+		kfile.node = file;
+		kfile.wpos = 0;
+		kwrite(&kfile, data, CHUNK_SIZE + 1);
+	}
+
+	/* a snapshot copies headers, never the data */
+	before = _mem_count;
+	snapshot = node_snapshot(root);
+	fail_unless (snapshot != NULL);
+	fail_unless (_mem_count == before);
+	fail_unless (snapshot->tree_files == 4 && snapshot->tree_bytes == 4 * (CHUNK_SIZE + 1));
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "f%u", i);
+		file = node_find_children(snapshot, name);
+		for (chunk = file->first_chunk; chunk != NULL; chunk = chunk->next, chunks++)
+			fail_unless (chunk->shared != NULL);
+	}
+	fail_unless (chunks == 8);
+
+	/* the data is copied one chunk at a time, when it's written */
+	kfile.node = node_find_children(root, "f0");
+	fail_unless (kpwrite(&kfile, CHUNK_SIZE, "x", 1) == 1);
+	fail_unless (_mem_count == before + 1);
+
+	node_snapshot_release(snapshot);
+	fail_unless (_mem_count == before);
+	node_delete(root);
+	free(data);
+}
+END_TEST
+
+START_TEST (mem_huge_page_placement)
+{
+	struct node *node = node_create("node", N_FILE);
+	struct _KFILE kfile = { .node = node };
+	struct kalloc_stats before, after;
+	Chunk *c;
+	char *buffer = (char *)malloc(3 * 1024 * 1024);
+
+	fail_unless (kalloc_set_policy(KALLOC_HUGE_EXPLICIT + 1, 0) == E_INVALID_SYNTAX);
+	fail_unless (kalloc_set_policy(KALLOC_HUGE_TRANSPARENT, KALLOC_NUMA_INTERLEAVE) == 0);
+	kalloc_get_stats(&before);
+	fail_unless (before.nodes >= 1);
+
+	c = kalloc(CHUNK_SIZE);
+	fail_unless (c->placement == KALLOC_PLACE_THP);
+	fail_unless (((unsigned long)c->memory & (KALLOC_HUGE_PAGE_SIZE - 1)) == 0);
+	fail_unless (c->numa_node == KALLOC_NODE_INTERLEAVED);
+	kalloc_get_stats(&after);
+	fail_unless (after.thp_bytes == before.thp_bytes + CHUNK_SIZE);
+	fail_unless (after.interleaved_bytes == before.interleaved_bytes + CHUNK_SIZE);
+	kfree(c);
+	kalloc_get_stats(&after);
+	fail_unless (after.thp_bytes == before.thp_bytes);
+
+	/* small chunks come from the heap, and move once they grow */
+	fail_unless (kalloc_set_policy(KALLOC_HUGE_TRANSPARENT, KALLOC_NUMA_LOCAL) == 0);
+	kwrite(&kfile, "small", 5);
+	fail_unless (node->first_chunk->placement == KALLOC_PLACE_HEAP);
+	memset(buffer, 'x', 3 * 1024 * 1024);
+	kwrite(&kfile, buffer, 3 * 1024 * 1024);
+	fail_unless (node->first_chunk->placement == KALLOC_PLACE_THP);
+	fail_unless (node->first_chunk->numa_node < KALLOC_MAX_NUMA_NODES);
+	fail_unless (kpread(&kfile, 0, 6, buffer) == 6);
+	fail_unless (memcmp(buffer, "smallx", 6) == 0);
+
+	/* with no huge pages reserved, transparent ones are used */
+	fail_unless (kalloc_set_policy(KALLOC_HUGE_EXPLICIT, KALLOC_NUMA_FIRST_TOUCH) == 0);
+	c = kalloc(KALLOC_HUGE_PAGE_SIZE);
+	fail_unless (c->placement == KALLOC_PLACE_HUGETLB || c->placement == KALLOC_PLACE_THP);
+	_raw_kwrite(c, KALLOC_HUGE_PAGE_SIZE - 1, "z", 1);
+	kfree(c);
+
+	node_delete(node);
+	free(buffer);
+	kalloc_set_policy(KALLOC_HUGE_NONE, KALLOC_NUMA_FIRST_TOUCH);
+}
+END_TEST
+
+START_TEST (mem_sequential_readahead)
+{
+	struct node *node = node_create("node", N_FILE);
+	char path[] = "/tmp/inmemfs-ra-XXXXXX";
+	char *data = (char *)malloc(CHUNK_SIZE * 2 + 10);
+	KFILE kfile;
+	int fd, i;
+
+	memset(data, 'a', CHUNK_SIZE * 2 + 10);
+	fd = mkstemp(path);
+	fail_unless (write(fd, data, CHUNK_SIZE * 2 + 10) == CHUNK_SIZE * 2 + 10);
+	close(fd);
+	fail_unless (kbind(node, path) == 0);
+	kfile = _alloc_kfile(node);
+
+	/* the window grows while reads are sequential */
+	fail_unless (kread(kfile, 1024, data) == 1024);
+	fail_unless (kfile->ra_window == 1);
+	fail_unless (kfile->ra_chunk == 2);
+	for (i = 0; i < 4; i++)
+		fail_unless (kread(kfile, 1024, data) == 1024);
+	fail_unless (kfile->ra_window == KF_READAHEAD_CHUNKS);
+	fail_unless (kfile->ra_chunk == 3);
+
+	/* reading the whole file sequentially still works */
+	while (kread(kfile, CHUNK_SIZE / 3, data) > 0)
+		;
+	fail_unless (ktell(kfile) == CHUNK_SIZE * 2 + 10);
+
+	/* seeking makes the access random */
+	kseek(kfile, 100, KF_SEEK_START);
+	fail_unless (kread(kfile, 10, data) == 10);
+	fail_unless (kfile->ra_window == 0);
+	fail_unless (kread(kfile, 10, data) == 10);
+	fail_unless (kfile->ra_window == 1);
+
+	kclose(kfile);
+	node_delete(node);
+	unlink(path);
+	free(data);
+}
+END_TEST
+
+START_TEST (mem_truncate_and_holes)
+{
+	struct node *node = node_create("node", N_FILE);
+	struct node *dir = node_create("dir", N_DIRECTORY);
+	struct _KFILE kfile = { .node = node };
+	struct _KFILE kdir = { .node = dir };
+	char buffer[8];
+	Chunk *chunk;
+
+	fail_unless (ktruncate(&kdir, 10) == E_INVALID_TYPE);
+
+	kwrite(&kfile, "hello", 5);
+	fail_unless (ktruncate(&kfile, 3) == 0);
+	fail_unless (node->size == 3 && node->first_chunk->size == 3);
+	fail_unless (ktruncate(&kfile, 6) == 0);
+	fail_unless (kpread(&kfile, 0, 8, buffer) == 6);
+	fail_unless (memcmp(buffer, "hel\0\0\0", 6) == 0);
+
+	/* growing the file appends holes */
+	fail_unless (ktruncate(&kfile, CHUNK_SIZE * 3) == 0);
+	chunk = node->first_chunk;
+	fail_unless (chunk->size == CHUNK_SIZE && chunk->memory != NULL);
+	fail_unless (chunk->next->memory == NULL && chunk->next->next->memory == NULL);
+	fail_unless (kpread(&kfile, CHUNK_SIZE * 2, 4, buffer) == 4);
+	fail_unless (memcmp(buffer, "\0\0\0\0", 4) == 0);
+
+	/* writes fill only the chunks they touch */
+	fail_unless (kpwrite(&kfile, CHUNK_SIZE * 2 + 1, "x", 1) == 1);
+	fail_unless (chunk->next->memory == NULL);
+	fail_unless (chunk->next->next->memory != NULL);
+	fail_unless (kpwrite(&kfile, CHUNK_SIZE * 5, "y", 1) == 1);
+	fail_unless (_chunk_count(node) == 6);
+	fail_unless (node->first_chunk->next->next->next->memory == NULL);
+
+	/* shrinking frees the chunks past the end */
+	fail_unless (ktruncate(&kfile, CHUNK_SIZE + 1) == 0);
+	fail_unless (_chunk_count(node) == 2);
+	fail_unless (node->size == CHUNK_SIZE + 1);
+	fail_unless (ktruncate(&kfile, 0) == 0);
+	fail_unless (node->first_chunk == NULL && node->size == 0);
+
+	node_delete(node);
+	node_delete(dir);
+}
+END_TEST
+
+START_TEST (mem_fallocate)
+{
+	struct node *node = node_create("node", N_FILE);
+	struct _KFILE kfile = { .node = node };
+	char *data = (char *)malloc(CHUNK_SIZE);
+	long before;
+
+	fail_unless (kfallocate(&kfile, 0, CHUNK_SIZE + 10) == 0);
+	fail_unless (node->size == 0);
+	fail_unless (node->first_chunk->memory != NULL);
+	fail_unless (node->first_chunk->next->memory != NULL);
+	fail_unless (kpread(&kfile, 0, 1, data) == 0);
+
+	/* writes in the preallocated range don't allocate anything */
+	before = _mem_count;
+	memset(data, 'a', CHUNK_SIZE);
+	fail_unless (kwrite(&kfile, data, CHUNK_SIZE) == CHUNK_SIZE);
+	fail_unless (kwrite(&kfile, data, 10) == 10);
+	fail_unless (_mem_count == before);
+	fail_unless (node->size == CHUNK_SIZE + 10);
+
+	/* truncating drops what's preallocated past the end too */
+	fail_unless (kfallocate(&kfile, CHUNK_SIZE * 2, 10) == 0);
+	fail_unless (_chunk_count(node) == 3);
+	fail_unless (node->size == CHUNK_SIZE + 10);
+	fail_unless (ktruncate(&kfile, node->size) == 0);
+	fail_unless (_chunk_count(node) == 2);
+
+	node_delete(node);
+	free(data);
+}
+END_TEST
+
+START_TEST (mem_checksums)
+{
+	struct node *node = node_create("node", N_FILE);
+	struct _KFILE kfile = { .node = node };
+	char *data = (char *)calloc(1, CHUNK_SIZE);
+	char path[] = "/tmp/inmemfs-crc-XXXXXX";
+	uint32_t crc = CRC32C_INIT, sw, delta;
+	unsigned int i;
+	int fd;
+
+	fail_unless (crc32c("123456789", 9) == 0xE3069283u);
+	fail_unless (crc32c_update(1234, data, 1000) == crc32c_shift(1234, 1000));
+
+	/* the same data fed at once or in small pieces */
+	for (i = 0; i < 100000; i++)
+		data[i] = i * 7;
+	for (i = 0; i < 100000; i += 7)
+		crc = crc32c_update(crc, data + i, (100000 - i < 7) ? 100000 - i : 7);
+	fail_unless (crc == crc32c_update(CRC32C_INIT, data, 100000));
+
+	/* the software version agrees with the CPU instruction */
+	fail_unless (_crc32c_use_hw(0) == 0);
+	fail_unless (crc32c("123456789", 9) == 0xE3069283u);
+	sw = crc32c_update(CRC32C_INIT, data + 3, 99990);
+	delta = crc32c_delta(data, data + 5, 1001);
+	_crc32c_use_hw(1);
+	fail_unless (sw == crc32c_update(CRC32C_INIT, data + 3, 99990));
+	fail_unless (delta == crc32c_delta(data, data + 5, 1001));
+
+	/* checksums follow appends, overwrites, holes and truncation */
+	kwrite(&kfile, data, 100000);
+	kwrite(&kfile, data, CHUNK_SIZE);
+	kpwrite(&kfile, 10, "overwrite", 9);
+	kpwrite(&kfile, CHUNK_SIZE * 3, "far", 3);
+	ktruncate(&kfile, CHUNK_SIZE + 50);
+	kwrite(&kfile, "tail", 4);
+	fail_unless (kverify(node) == 0);
+	fail_unless (node->first_chunk->crc == _chunk_crc(node->first_chunk));
+	fail_unless (node->first_chunk->next->crc == _chunk_crc(node->first_chunk->next));
+
+	/* host data read over old content and into new chunks */
+	fd = mkstemp(path);
+	fail_unless (write(fd, data, 100000) == 100000);
+	lseek(fd, 0, SEEK_SET);
+	kfile.wpos = 1000;
+	fail_unless (kwritefd(&kfile, fd, 100000) == 100000);
+	lseek(fd, 0, SEEK_SET);
+	kfile.wpos = CHUNK_SIZE * 2 + 7;
+	fail_unless (kwritefd(&kfile, fd, 100000) == 100000);
+	close(fd);
+	unlink(path);
+	fail_unless (kverify(node) == 0);
+
+	/* memory changed behind our back is caught */
+	((char *)node->first_chunk->next->memory)[20] ^= 1;
+	fail_unless (kverify(node) == E_CHECKSUM);
+
+	node_delete(node);
+	free(data);
+}
+END_TEST
+
+START_TEST (mem_load_attach)
+{
+	struct node *node = node_create("node", N_FILE);
+	struct _KFILE kfile = { .node = node };
+	char path[] = "/tmp/inmemfs-load-XXXXXX";
+	char *data = (char *)malloc(CHUNK_SIZE * 2 + 10);
+	char buffer[4];
+	Chunk *chunks;
+	long before = _mem_count;
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < CHUNK_SIZE * 2 + 10; i++)
+		data[i] = 'a' + i % 26;
+	fd = mkstemp(path);
+	fail_unless (write(fd, data, CHUNK_SIZE * 2 + 10) == CHUNK_SIZE * 2 + 10);
+
+	/* files shorter than expected aren't loaded */
+	lseek(fd, 0, SEEK_SET);
+	fail_unless (kload(fd, CHUNK_SIZE * 3, &chunks) == E_CANT_GET_EXT_FILE);
+	fail_unless (chunks == NULL && _mem_count == before);
+
+	lseek(fd, 0, SEEK_SET);
+	fail_unless (kload(fd, CHUNK_SIZE * 2 + 10, &chunks) == 0);
+	close(fd);
+	unlink(path);
+
+	fail_unless (kattach(node, chunks, CHUNK_SIZE * 2 + 10) == 0);
+	fail_unless (_chunk_count(node) == 3);
+	fail_unless (node->size == CHUNK_SIZE * 2 + 10);
+	fail_unless (kverify(node) == 0);
+	fail_unless (kpread(&kfile, CHUNK_SIZE * 2 + 6, 4, buffer) == 4);
+	fail_unless (memcmp(buffer, data + CHUNK_SIZE * 2 + 6, 4) == 0);
+
+	/* only empty files take chunks */
+	fail_unless (kattach(node, NULL, 0) == E_CONSTRAINT_VIOLATED);
+
+	node_delete(node);
+	fail_unless (_mem_count == before);
+	free(data);
+}
+END_TEST
+
+START_TEST (mem_quota_and_priority)
+{
+	struct node *low = node_create("low", N_DIRECTORY);
+	struct node *high = node_create("high", N_DIRECTORY);
+	struct node *a = node_create("a", N_FILE);
+	struct node *b = node_create("b", N_FILE);
+	struct _KFILE ka = { .node = a }, kb = { .node = b };
+	char path[] = "/tmp/inmemfs-quota-XXXXXX";
+	char *data = (char *)calloc(1, CHUNK_SIZE * 2);
+	char buffer[1];
+	int fd;
+
+	node_add_child(low, a);
+	node_add_child(high, b);
+
+	/* the byte limit counts what's already in the subtree */
+	fail_unless (node_set_quota(low, 100, 0, 0) == 0);
+	fail_unless (kwrite(&ka, data, 100) == 100);
+	fail_unless (kwrite(&ka, data, 1) == E_QUOTA);
+	fail_unless (ktruncate(&ka, 101) == E_QUOTA);
+	fail_unless (kpwrite(&ka, 0, data, 100) == 100);
+	fail_unless (a->size == 100);
+	fail_unless (node_set_quota(low, 0, 0, 0) == 0);
+	fail_unless (ktruncate(&ka, 0) == 0);
+
+	/* chunks of lower priority are evicted first */
+	fail_unless (node_set_quota(high, 0, 0, KCACHE_PRIORITIES - 1) == 0);
+	fd = mkstemp(path);
+	fail_unless (write(fd, data, CHUNK_SIZE * 2) == CHUNK_SIZE * 2);
+	close(fd);
+	a = node_create("c", N_FILE);
+	ka.node = a;
+	node_add_child(low, a);
+	fail_unless (kbind(a, path) == 0);
+	fail_unless (kbind(b, path) == 0);
+
+	kcache_set_limit(CHUNK_SIZE * 2);
+	fail_unless (kpread(&kb, 0, 1, buffer) == 1);
+	fail_unless (kpread(&ka, 0, 1, buffer) == 1);
+	fail_unless (kpread(&ka, CHUNK_SIZE, 1, buffer) == 1);
+	fail_unless (b->first_chunk->memory != NULL);
+	fail_unless (a->first_chunk->memory == NULL);
+	fail_unless (a->first_chunk->next->memory != NULL);
+
+	kcache_set_limit(0);
+	unlink(path);
+	node_delete(low);
+	node_delete(high);
+	free(data);
+	fail_unless (kcache_get_bytes() == 0);
+}
+END_TEST
+
+/*
+ * Frees the chunks allocated by another thread, going through the
+ * shared LRU lists first, and allocates its own
+ */
+static void *
+_magazine_worker(void *arg) {
+	Chunk **chunks = (Chunk **)arg;
+	unsigned int i;
+
+	for (i = 0; i < 64; i++) {
+		chunks[i]->priority = i % KCACHE_PRIORITIES;
+		kcache_insert(chunks[i]);
+		kcache_touch(chunks[i]);
+		kfree(chunks[i]);
+		chunks[i] = kalloc((i % 3) ? 100 : CHUNK_SIZE);
+	}
+
+	return NULL;
+}
+
+START_TEST (mem_thread_magazines)
+{
+	Chunk *chunk, *chunks[4][64];
+	pthread_t threads[4];
+	void *memory;
+	unsigned int i, j;
+	long before = _mem_count;
+	unsigned long cached = kcache_get_bytes();
+
+	/* freed headers and buffers are reused, zeroed */
+	chunk = kalloc(CHUNK_SIZE);
+	memory = chunk->memory;
+	memset(memory, 'x', CHUNK_SIZE);
+	kfree(chunk);
+	chunk = kalloc(CHUNK_SIZE);
+	fail_unless (chunk->memory == memory);
+	fail_unless (((char *)chunk->memory)[CHUNK_SIZE - 1] == 0);
+	fail_unless (chunk->next == NULL && chunk->crc == _chunk_crc(chunk));
+	kfree(chunk);
+
+	/* chunks freed by other threads (which then exit) */
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 64; j++)
+			chunks[i][j] = kalloc((j % 2) ? 10 : CHUNK_SIZE);
+	for (i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, _magazine_worker, chunks[i]);
+	for (i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 64; j++)
+			kfree(chunks[i][j]);
+
+	fail_unless (_mem_count == before);
+	fail_unless (kcache_get_bytes() == cached);
+}
+END_TEST
+
+START_TEST (mem_object_pool)
+{
+	struct pool pool = POOL_INITIALIZER(struct node);
+	void **objects;
+	unsigned int i, n;
+
+	objects = (void **)malloc(10000 * sizeof(void *));
+	for (i = 0; i < 10000; i++) {
+		objects[i] = pool_alloc(&pool);
+		memset(objects[i], 0xff, sizeof(struct node));
+	}
+	fail_unless (pool.objects == 10000);
+	fail_unless ((unsigned long)objects[1] % 16 == 0);
+	n = pool.slabs;
+	fail_unless (n == (10000 + pool.per_slab - 1) / pool.per_slab);
+
+	/* freed objects are reused before mapping new slabs */
+	for (i = 0; i < 10000; i += 2)
+		pool_free(objects[i]);
+	for (i = 0; i < 10000; i += 2)
+		objects[i] = pool_alloc(&pool);
+	fail_unless (pool.slabs == n);
+
+	/* empty slabs go away, except one */
+	for (i = 0; i < 10000; i++)
+		pool_free(objects[i]);
+	fail_unless (pool.objects == 0);
+	fail_unless (pool.slabs == 1);
+
+	free(objects);
+}
+END_TEST
+
+START_TEST (mem_reserve_commit)
+{
+	struct node *node = node_create("node", N_FILE), *clone;
+	struct _KFILE kfile = { .node = node };
+	char buffer[8];
+	void *span;
+
+	/* producers write straight into the chunk */
+	fail_unless (kwrite_reserve(&kfile, 100, &span) == 100);
+	memcpy(span, "hello", 5);
+	fail_unless (node->size == 0);
+	fail_unless (kwrite_commit(&kfile, 101) == E_OUT_OF_BOUNDS);
+	fail_unless (kwrite_commit(&kfile, 5) == 0);
+	fail_unless (node->size == 5 && kfile.wpos == 5);
+	fail_unless (kpread(&kfile, 0, 8, buffer) == 5);
+	fail_unless (memcmp(buffer, "hello", 5) == 0);
+	fail_unless (kwrite_commit(&kfile, 1) == E_CONSTRAINT_VIOLATED);
+
+	/* spans stop at the end of the chunk */
+	kfile.wpos = CHUNK_SIZE - 2;
+	fail_unless (kwrite_reserve(&kfile, 10, &span) == 2);
+	memcpy(span, "ab", 2);
+	fail_unless (kwrite_commit(&kfile, 2) == 0);
+	fail_unless (kwrite_reserve(&kfile, 10, &span) == 10);
+	memcpy(span, "cd", 2);
+	fail_unless (kwrite_commit(&kfile, 2) == 0);
+	fail_unless (node->size == CHUNK_SIZE + 2);
+	fail_unless (kpread(&kfile, CHUNK_SIZE - 2, 4, buffer) == 4);
+	fail_unless (memcmp(buffer, "abcd", 4) == 0);
+
+	/* overwriting in place keeps the checksums right */
+	kfile.wpos = 1;
+	fail_unless (kwrite_reserve(&kfile, 3, &span) == 3);
+	memcpy(span, "EL", 2);
+	fail_unless (kwrite_commit(&kfile, 2) == 0);
+	fail_unless (kpread(&kfile, 0, 5, buffer) == 5);
+	fail_unless (memcmp(buffer, "hELlo", 5) == 0);
+	fail_unless (node->size == CHUNK_SIZE + 2);
+	fail_unless (kverify(node) == 0);
+
+	/* bytes past what's committed, or of abandoned spans, read as zeros */
+	kfile.wpos = CHUNK_SIZE + 2;
+	fail_unless (kwrite_reserve(&kfile, 8, &span) == 8);
+	memcpy(span, "junkjunk", 8);
+	fail_unless (kwrite_reserve(&kfile, 8, &span) == 8);
+	memcpy(span, "okay", 4);
+	fail_unless (kwrite_commit(&kfile, 2) == 0);
+	fail_unless (kverify(node) == 0);
+	fail_unless (ktruncate(&kfile, CHUNK_SIZE + 10) == 0);
+	fail_unless (kpread(&kfile, CHUNK_SIZE + 2, 8, buffer) == 8);
+	fail_unless (memcmp(buffer, "ok\0\0\0\0\0\0", 8) == 0);
+
+	/* spans shared with a clone get their own memory first */
+	clone = node_clone(node, "clone");
+	kfile.wpos = 0;
+	fail_unless (kwrite_reserve(&kfile, 1, &span) == 1);
+	fail_unless (node->first_chunk->shared == NULL);
+	memcpy(span, "H", 1);
+	fail_unless (kwrite_commit(&kfile, 1) == 0);
+	fail_unless (kverify(node) == 0 && kverify(clone) == 0);
+	fail_unless (((char *)clone->first_chunk->memory)[0] == 'h');
+
+	node_delete(clone);
+	node_delete(node);
+}
+END_TEST
+
+START_TEST (mem_mmap_views)
+{
+	struct node *node = node_create("node", N_FILE);
+	struct _KFILE kfile = { .node = node };
+	struct kmap map;
+	char buffer[4];
+
+	fail_unless (kmmap(node, KMMAP_READ, &map) == 0);
+	fail_unless (map.addr == NULL && map.length == 0);
+	fail_unless (kmmap(node, 0, &map) == E_INVALID_SYNTAX);
+
+	/* heap memory is copied, as it was */
+	kwrite(&kfile, "abcdef", 6);
+	fail_unless (kmmap(node, KMMAP_READ, &map) == 0);
+	fail_unless (map.length == 6 && map.pin == NULL);
+	kpwrite(&kfile, 0, "x", 1);
+	fail_unless (memcmp(map.addr, "abcdef", 6) == 0);
+	kmunmap(&map);
+	fail_unless (map.addr == NULL);
+
+	/* mapped chunks are viewed in place, holes read as zeros */
+	kalloc_set_policy(KALLOC_HUGE_NONE, KALLOC_NUMA_LOCAL);
+	kpwrite(&kfile, CHUNK_SIZE * 2, "end", 3);
+	fail_unless (node->first_chunk->placement == KALLOC_PLACE_MAPPED);
+	fail_unless (kmmap(node, KMMAP_READ, &map) == 0);
+	fail_unless (map.length == CHUNK_SIZE * 2 + 3);
+	fail_unless (map.pin != NULL && map.pin->memory == node->first_chunk->memory);
+	fail_unless (memcmp(map.addr, "xbcdef", 6) == 0);
+	fail_unless (((char *)map.addr)[CHUNK_SIZE + 1] == 0);
+	fail_unless (memcmp((char *)map.addr + CHUNK_SIZE * 2, "end", 3) == 0);
+	kpwrite(&kfile, 0, "y", 1);
+	fail_unless (memcmp(map.addr, "xbcdef", 6) == 0);
+	kmunmap(&map);
+	fail_unless (kpread(&kfile, 0, 2, buffer) == 2);
+	fail_unless (memcmp(buffer, "yb", 2) == 0);
+	kpwrite(&kfile, 0, "x", 1);
+	kalloc_set_policy(KALLOC_HUGE_NONE, KALLOC_NUMA_FIRST_TOUCH);
+
+	/* private views can be written, the file doesn't change */
+	fail_unless (kmmap(node, KMMAP_PRIVATE, &map) == 0);
+	memcpy(map.addr, "zz", 2);
+	fail_unless (kpread(&kfile, 0, 2, buffer) == 2);
+	fail_unless (memcmp(buffer, "xb", 2) == 0);
+	kmunmap(&map);
+
+	node_delete(node);
+}
+END_TEST
+
 TCase *
 tcase_memory(void) {
 	TCase *tc_memory = tcase_create("Memory allocation tests");
@@ -101,6 +1148,28 @@ tcase_memory(void) {
 	tcase_add_test(tc_memory, mem_write_node);
 	tcase_add_test(tc_memory, mem_cant_write_directory);
 	tcase_add_test(tc_memory, mem_multiple_reads);
+	tcase_add_test(tc_memory, mem_chunk_list);
+	tcase_add_test(tc_memory, mem_positional_io);
+	tcase_add_test(tc_memory, mem_vectored_io_across_chunks);
+	tcase_add_test(tc_memory, mem_ring_batch);
+	tcase_add_test(tc_memory, mem_bound_file);
+	tcase_add_test(tc_memory, mem_bound_racing_readers);
+	tcase_add_test(tc_memory, mem_bound_evicting_readers);
+	tcase_add_test(tc_memory, mem_bind_errors);
+	tcase_add_test(tc_memory, mem_clone_copy_on_write);
+	tcase_add_test(tc_memory, mem_snapshot_content);
+	tcase_add_test(tc_memory, mem_snapshot_cost);
+	tcase_add_test(tc_memory, mem_huge_page_placement);
+	tcase_add_test(tc_memory, mem_sequential_readahead);
+	tcase_add_test(tc_memory, mem_truncate_and_holes);
+	tcase_add_test(tc_memory, mem_fallocate);
+	tcase_add_test(tc_memory, mem_checksums);
+	tcase_add_test(tc_memory, mem_load_attach);
+	tcase_add_test(tc_memory, mem_quota_and_priority);
+	tcase_add_test(tc_memory, mem_thread_magazines);
+	tcase_add_test(tc_memory, mem_object_pool);
+	tcase_add_test(tc_memory, mem_reserve_commit);
+	tcase_add_test(tc_memory, mem_mmap_views);
 
 	return tc_memory;
 }
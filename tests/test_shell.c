@@ -1,8 +1,13 @@
 #include <check.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "../src/errors.h"
 #include "../src/shell.h"
+#include "../src/io.h"
 
 START_TEST (shell_invalid_command)
 {
@@ -161,6 +166,244 @@ START_TEST (shell_make_file)
 }
 END_TEST
 
+START_TEST (shell_import_dir)
+{
+	char host[] = "/tmp/inmemfs-import-XXXXXX", path[64], line[96];
+	struct node *file;
+	KFILE kfile;
+	char buffer[16];
+	FILE *fd;
+	int i;
+
+	fail_if (mkdtemp(host) == NULL);
+	snprintf(path, sizeof(path), "%s/sub", host);
+	mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/sub/doc", host);
+	fd = fopen(path, "w");
+	fputs("imported", fd);
+	fclose(fd);
+	snprintf(line, sizeof(line), "%s/link", host);
+	fail_unless (symlink("sub/doc", line) == 0);
+
+	shell_parse_line("createroot root");
+	shell_parse_line("setroot 1");
+
+	snprintf(line, sizeof(line), "import %s/missing data", host);
+	fail_unless (shell_parse_line(line) == E_CANT_GET_EXT_FILE);
+
+	snprintf(line, sizeof(line), "import %s data", host);
+	fail_unless (shell_parse_line(line) == EXIT_SUCCESS);
+
+	file = node_path_find(shell_get_curr_node(), "data/sub/doc");
+	fail_if (file == NULL);
+	fail_unless (file->size == 8);
+	fail_unless (node_path_find(shell_get_curr_node(), "data/link") == NULL);
+
+	kfile = kopen(shell_get_curr_node(), "data/sub/doc");
+	memset(buffer, 0, sizeof(buffer));
+	kread(kfile, sizeof(buffer), buffer);
+	fail_unless (strcmp(buffer, "imported") == 0);
+	kclose(kfile);
+
+	/* more files than the readers take at once */
+	for (i = 0; i < 60; i++) {
+		snprintf(path, sizeof(path), "%s/sub/f%02d", host, i);
+		fd = fopen(path, "w");
+		fprintf(fd, "file %02d", i);
+		fclose(fd);
+	}
+	snprintf(line, sizeof(line), "import %s many", host);
+	fail_unless (shell_parse_line(line) == EXIT_SUCCESS);
+	for (i = 0; i < 60; i++) {
+		snprintf(path, sizeof(path), "many/sub/f%02d", i);
+		kfile = kopen(shell_get_curr_node(), path);
+		fail_if (kfile == NULL);
+		memset(buffer, 0, sizeof(buffer));
+		kread(kfile, sizeof(buffer), buffer);
+		snprintf(line, sizeof(line), "file %02d", i);
+		fail_unless (strcmp(buffer, line) == 0);
+		fail_unless (kverify(kfile->node) == 0);
+		kclose(kfile);
+
+		snprintf(path, sizeof(path), "%s/sub/f%02d", host, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/sub/doc", host);
+
+	/* files which can't be loaded make the whole import fail */
+	fail_unless (shell_parse_line("quota 1 0") == EXIT_SUCCESS);
+	fd = fopen(path, "w");
+	fail_unless (fseek(fd, 2 * 1024 * 1024, SEEK_SET) == 0);
+	fputs("big", fd);
+	fclose(fd);
+	snprintf(line, sizeof(line), "import %s big", host);
+	fail_unless (shell_parse_line(line) == E_QUOTA);
+
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/link", host);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/sub", host);
+	rmdir(path);
+	rmdir(host);
+}
+END_TEST
+
+START_TEST (shell_copyto_truncates)
+{
+	char host[] = "/tmp/inmemfs-copyto-XXXXXX", line[64];
+	struct node *file;
+	KFILE kfile;
+	char buffer[16];
+	int fd;
+
+	fd = mkstemp(host);
+	fail_if (fd < 0);
+	fail_unless (write(fd, "short", 5) == 5);
+	close(fd);
+
+	shell_parse_line("createroot root");
+	shell_parse_line("setroot 1");
+	shell_parse_line("mkfile doc");
+	kfile = kopen(shell_get_curr_node(), "doc");
+	kwrite(kfile, "a much longer content", 21);
+	kclose(kfile);
+
+	/* nothing of the old content is left behind */
+	snprintf(line, sizeof(line), "copyto doc %s", host);
+	fail_unless (shell_parse_line(line) == EXIT_SUCCESS);
+	file = node_path_find(shell_get_curr_node(), "doc");
+	fail_unless (file != NULL && file->size == 5);
+
+	kfile = kopen(shell_get_curr_node(), "doc");
+	memset(buffer, 0, sizeof(buffer));
+	fail_unless (kread(kfile, sizeof(buffer), buffer) == 5);
+	fail_unless (strcmp(buffer, "short") == 0);
+	kclose(kfile);
+
+	/* missing files are created, missing directories aren't */
+	snprintf(line, sizeof(line), "copyto new %s", host);
+	fail_unless (shell_parse_line(line) == EXIT_SUCCESS);
+	file = node_path_find(shell_get_curr_node(), "new");
+	fail_unless (file != NULL && file->type == N_FILE && file->size == 5);
+	snprintf(line, sizeof(line), "copyto missing/new %s", host);
+	fail_unless (shell_parse_line(line) == E_DIR_NOT_FOUND);
+
+	unlink(host);
+}
+END_TEST
+
+START_TEST (shell_walk_commands)
+{
+	shell_parse_line("createroot root");
+	shell_parse_line("setroot 1");
+	shell_parse_line("mkdir dir");
+	shell_parse_line("cd dir");
+	shell_parse_line("mkfile doc");
+	shell_parse_line("cd ..");
+
+	fail_unless (shell_parse_line("du") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("du dir") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("du missing") == E_FILE_NOT_FOUND);
+	fail_unless (shell_parse_line("find") == E_INVALID_SYNTAX);
+	fail_unless (shell_parse_line("find d*") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("tree") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("tree missing") == E_FILE_NOT_FOUND);
+	fail_unless (shell_parse_line("verify") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("verify missing") == E_FILE_NOT_FOUND);
+}
+END_TEST
+
+START_TEST (shell_move)
+{
+	shell_parse_line("createroot root");
+	shell_parse_line("setroot 1");
+	shell_parse_line("mkdir dir");
+	shell_parse_line("mkfile a");
+	shell_parse_line("mkfile b");
+
+	fail_unless (shell_parse_line("mv") == E_INVALID_SYNTAX);
+	fail_unless (shell_parse_line("mv missing x") == E_FILE_NOT_FOUND);
+	fail_unless (shell_parse_line("mv a c") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("mv c dir") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("mv b dir/c") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("mv dir/c missing/c") == E_DIR_NOT_FOUND);
+	fail_unless (shell_parse_line("mv dir dir/sub") == E_CONSTRAINT_VIOLATED);
+	fail_unless (shell_parse_line("mv dir/c top") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("cd dir") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("rmdir c") == E_DIR_NOT_FOUND);
+}
+END_TEST
+
+START_TEST (shell_attributes)
+{
+	shell_parse_line("createroot root");
+	shell_parse_line("setroot 1");
+	shell_parse_line("mkfile a");
+	shell_parse_line("mkfile b");
+
+	fail_unless (shell_parse_line("xattr a tenant=x") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("xattr a tenant") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("xattr b tenant") == E_NO_ATTR);
+	fail_unless (shell_parse_line("xattr missing") == E_FILE_NOT_FOUND);
+	fail_unless (shell_parse_line("index tenant x") == E_NO_INDEX);
+	fail_unless (shell_parse_line("index tenant") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("xattr b tenant=x") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("index tenant x") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("index tenant before 10") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("index tenant before x") == E_INVALID_SYNTAX);
+	fail_unless (shell_parse_line("index tenant after 10") == E_INVALID_SYNTAX);
+	fail_unless (shell_parse_line("xattr a tenant=") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("xattr a tenant=") == E_NO_ATTR);
+}
+END_TEST
+
+START_TEST (shell_remove_and_ttl)
+{
+	shell_parse_line("createroot root");
+	shell_parse_line("setroot 1");
+	shell_parse_line("mkdir dir");
+	shell_parse_line("cd dir");
+	shell_parse_line("mkfile a");
+	shell_parse_line("cd ..");
+	shell_parse_line("mkfile b");
+
+	fail_unless (shell_parse_line("rm") == E_INVALID_SYNTAX);
+	fail_unless (shell_parse_line("rm missing") == E_FILE_NOT_FOUND);
+	fail_unless (shell_parse_line("rm b") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("ttl dir 60") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("ttl dir") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("ttl dir x") == E_INVALID_SYNTAX);
+	fail_unless (shell_parse_line("cd dir") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("rm a") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("cd ..") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("rm dir") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("cd dir") == E_DIR_NOT_FOUND);
+}
+END_TEST
+
+START_TEST (shell_list_pages)
+{
+	char line[32];
+	int i;
+
+	shell_parse_line("createroot root");
+	shell_parse_line("setroot 1");
+	for (i = 0; i < 100; i++) {
+		snprintf(line, sizeof(line), "mkfile f%02d", i);
+		shell_parse_line(line);
+	}
+	shell_parse_line("mkdir g");
+
+	fail_unless (shell_parse_line("ls") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("ls f1*") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("ls f* 10") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("ls f* 10 f09") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("ls *[05] 3 f10") == EXIT_SUCCESS);
+	fail_unless (shell_parse_line("ls f* 0") == E_INVALID_SYNTAX);
+	fail_unless (shell_parse_line("ls a b c d") == E_INVALID_SYNTAX);
+}
+END_TEST
+
 TCase *
 tcase_shell(void) {
 	TCase *tc_shell = tcase_create("Shell tests");
@@ -174,6 +417,13 @@ tcase_shell(void) {
 	tcase_add_test(tc_shell, shell_argline);
 	tcase_add_test(tc_shell, shell_invalid_chars_in_root);
 	tcase_add_test(tc_shell, shell_make_file);
+	tcase_add_test(tc_shell, shell_import_dir);
+	tcase_add_test(tc_shell, shell_copyto_truncates);
+	tcase_add_test(tc_shell, shell_walk_commands);
+	tcase_add_test(tc_shell, shell_move);
+	tcase_add_test(tc_shell, shell_attributes);
+	tcase_add_test(tc_shell, shell_remove_and_ttl);
+	tcase_add_test(tc_shell, shell_list_pages);
 
 	return tc_shell;
 }
@@ -1,7 +1,14 @@
 #include <check.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "../src/node.h"
 #include "../src/errors.h"
+#include "../src/epoch.h"
+#include "../src/walk.h"
+#include "../src/xattr.h"
+#include "../src/expire.h"
 
 START_TEST (node_creation)
 {
@@ -123,6 +130,7 @@ START_TEST (node_delete_children)
 	/* and a unique element */
 	node_delete_child(father, children3);
 	fail_unless (node_children_num(father) == 0);
+	fail_unless (father->childrens == NULL);
 }
 END_TEST
 
@@ -173,6 +181,42 @@ START_TEST (node_check_invalid_names)
 }
 END_TEST
 
+START_TEST (node_check_long_names)
+{
+	/* invalid characters past the first SIMD blocks are still caught */
+	struct node *valid = node_create("abcdefghijklmnopqrstuvwxyz-ABCDEFGHIJ.0123456789", N_FILE);
+	struct node *invalid = node_create("abcdefghijklmnopqrstuvwxyz-ABCDEFGHIJ.012345678!", N_FILE);
+	struct node *too_long = node_create("abcdefghijklmnopqrstuvwxyz-ABCDEFGHIJ.0123456789_x", N_FILE);
+
+	fail_if (valid == NULL);
+	fail_if (invalid != NULL);
+	fail_if (too_long != NULL);
+
+	node_delete(valid);
+}
+END_TEST
+
+START_TEST (node_find_children_by_name)
+{
+	struct node *father = node_create("father", N_DIRECTORY);
+	struct node *a = node_create("a", N_FILE);
+	struct node *ab = node_create("ab", N_FILE);
+	struct node *abc = node_create("abc", N_FILE);
+
+	node_add_child(father, abc);
+	node_add_child(father, a);
+	node_add_child(father, ab);
+
+	fail_unless (node_find_children(father, "a") == a);
+	fail_unless (node_find_children(father, "ab") == ab);
+	fail_unless (node_find_children(father, "abc") == abc);
+	fail_unless (node_find_children(father, "abcd") == NULL);
+	fail_unless (node_find_children(father, "") == NULL);
+
+	node_delete(father);
+}
+END_TEST
+
 START_TEST (node_find_path)
 {
 	struct node *father = node_create("father", N_DIRECTORY);
@@ -195,6 +239,308 @@ START_TEST (node_find_path)
 }
 END_TEST
 
+START_TEST (node_clone_subtree)
+{
+	struct node *father = node_create("father", N_DIRECTORY);
+	struct node *dir = node_create("dir", N_DIRECTORY);
+	struct node *a = node_create("a", N_FILE);
+	struct node *b = node_create("b", N_FILE);
+	struct node *clone;
+
+	node_add_child(father, dir);
+	node_add_child(dir, b);
+	node_add_child(dir, a);
+
+	fail_unless (node_clone(father, "in valid") == NULL);
+
+	clone = node_clone(father, "clone");
+	fail_if (clone == NULL);
+	fail_unless (strcmp(clone->name, "clone") == 0);
+	fail_unless (node_get_children_no(clone) == 1);
+	fail_unless (node_path_find(clone, "dir") != dir);
+	fail_unless (node_get_father(node_path_find(clone, "dir/a")) ==
+			node_path_find(clone, "dir"));
+	fail_unless (strcmp(node_get_nth_children(node_path_find(clone, "dir"), 1)->name, "b") == 0);
+
+	node_delete(father);
+	fail_unless (node_children_num(node_path_find(clone, "dir")) == 2);
+	node_delete(clone);
+}
+END_TEST
+
+START_TEST (node_snapshot_is_frozen)
+{
+	struct node *father = node_create("father", N_DIRECTORY);
+	struct node *a = node_create("a", N_DIRECTORY);
+	struct node *b = node_create("b", N_FILE);
+	struct node *c = node_create("c", N_FILE);
+	struct node *snapshot;
+
+	node_add_child(father, a);
+	node_add_child(father, b);
+	snapshot = node_snapshot(father);
+
+	/* writers don't affect the snapshot... */
+	node_add_child(father, c);
+	node_delete_child(father, a);
+	fail_unless (node_children_num(father) == 2);
+	fail_unless (node_children_num(snapshot) == 2);
+	fail_if (node_find_children(snapshot, "a") == NULL);
+	fail_unless (node_find_children(snapshot, "c") == NULL);
+
+	/* ...and the snapshot can't be modified */
+	c = node_create("c", N_FILE);
+	fail_unless (node_add_child(snapshot, c) == E_READ_ONLY);
+	fail_unless (node_add_child(node_find_children(snapshot, "a"), c) == E_READ_ONLY);
+
+	node_delete(c);
+	node_snapshot_release(snapshot);
+	node_delete(father);
+}
+END_TEST
+
+START_TEST (node_delete_while_reading)
+{
+	struct node *father = node_create("father", N_DIRECTORY);
+	struct node *a = node_create("a", N_FILE);
+	struct node *b = node_create("b", N_FILE);
+	struct node *found;
+
+	node_add_child(father, a);
+	node_add_child(father, b);
+
+	fail_unless (epoch_enter() == 0);
+	found = node_find_children(father, "a");
+	node_delete_child(father, a);
+
+	/* the reader can still use what it found... */
+	fail_unless (epoch_pending() == 1);
+	fail_unless (strcmp(found->name, "a") == 0);
+	fail_unless (node_find_children(father, "a") == NULL);
+	fail_unless (node_find_children(father, "b") == b);
+	epoch_exit();
+
+	/* ...until it leaves its critical section */
+	fail_unless (epoch_reclaim() == 1);
+	fail_unless (epoch_pending() == 0);
+
+	/* without readers, deleted nodes are freed right away */
+	node_delete_child(father, b);
+	fail_unless (epoch_pending() == 0);
+
+	node_delete(father);
+}
+END_TEST
+
+struct _rename_reader {
+	struct node *dir;
+	int stop;
+	unsigned long misses;
+};
+
+/* Looks up names that never move while another one gets renamed */
+static void *
+_rename_reader(void *arg) {
+	struct _rename_reader *r = (struct _rename_reader *)arg;
+	char name[16];
+	int i;
+
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+		if (epoch_enter() != 0)
+			break;
+		for (i = 0; i < 100; i++) {
+			snprintf(name, sizeof(name), "n%03d", i * 2);
+			if (node_find_children(r->dir, name) == NULL)
+				r->misses++;
+		}
+		epoch_exit();
+	}
+
+	return NULL;
+}
+
+START_TEST (node_rename_while_reading)
+{
+	struct _rename_reader r = { NULL, 0, 0 };
+	struct node *node;
+	pthread_t tid;
+	char name[16];
+	int i;
+
+	r.dir = node_create("dir", N_DIRECTORY);
+	for (i = 0; i < 200; i += 2) {
+		snprintf(name, sizeof(name), "n%03d", i);
+		node_add_child(r.dir, node_create(name, N_FILE));
+	}
+	node = node_create("n001", N_FILE);
+	node_add_child(r.dir, node);
+
+	pthread_create(&tid, NULL, _rename_reader, &r);
+	for (i = 0; i < 20000; i++)
+		fail_unless (node_rename(node, (i % 2) ? "n001" : "n199") == 0);
+	__atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(tid, NULL);
+
+	fail_unless (r.misses == 0);
+	fail_unless (node_find_children(r.dir, "n001") == node);
+	fail_unless (node_get_children_no(r.dir) == 101);
+
+	epoch_reclaim();
+	node_delete(r.dir);
+}
+END_TEST
+
+static void *
+_enter_epoch(void *arg) {
+	if ((*(int *)arg = epoch_enter()) == 0)
+		epoch_exit();
+	return NULL;
+}
+
+static void
+_count_visit(struct node *node, unsigned int worker, void *arg) {
+	__atomic_add_fetch((unsigned long *)arg, 1, __ATOMIC_RELAXED);
+}
+
+START_TEST (node_parallel_walk)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *dir, *sub, *file = NULL;
+	struct walk_stats stats;
+	unsigned long visited = 0;
+	char name[16], path[64];
+	pthread_t tid;
+	int i, j, entered = -1;
+
+	/* 20 directories with 10 subdirectories of 5 files each */
+	for (i = 0; i < 20; i++) {
+		snprintf(name, sizeof(name), "dir%d", i);
+		dir = node_create(name, N_DIRECTORY);
+		node_add_child(root, dir);
+		for (j = 0; j < 10; j++) {
+			snprintf(name, sizeof(name), "sub%d", j);
+			sub = node_create(name, N_DIRECTORY);
+			node_add_child(dir, sub);
+			while (node_get_children_no(sub) < 5) {
+				snprintf(name, sizeof(name), "file%u", node_get_children_no(sub));
+				file = node_create(name, N_FILE);
+				node_add_child(sub, file);
+				node_set_size(file, 10);
+			}
+		}
+	}
+
+	fail_unless (walk_parallel(root, _count_visit, &visited, 4) == 0);
+	fail_unless (visited == 1 + 20 + 200 + 1000);
+
+	/* the workers' epoch slots are given back when they exit */
+	for (i = 0; i < EPOCH_MAX_THREADS; i++)
+		fail_unless (walk_parallel(root, _count_visit, &visited, 4) == 0);
+	pthread_create(&tid, NULL, _enter_epoch, &entered);
+	pthread_join(tid, NULL);
+	fail_unless (entered == 0);
+
+	fail_unless (walk_du(root, &stats) == 0);
+	fail_unless (stats.dirs == 221);
+	fail_unless (stats.files == 1000);
+	fail_unless (stats.bytes == 10000);
+
+	/* the incremental totals agree with the walk */
+	fail_unless (root->tree_dirs == stats.dirs);
+	fail_unless (root->tree_files == stats.files);
+	fail_unless (root->tree_bytes == stats.bytes);
+
+	fail_unless (file != NULL);
+	fail_unless (walk_path(root, file, path, sizeof(path)) == 16);
+	fail_unless (strcmp(path, "dir19/sub9/file4") == 0);
+	fail_unless (walk_path(root, file, path, 10) == E_OUT_OF_BOUNDS);
+	fail_unless (walk_path(root, root, path, sizeof(path)) == 1);
+
+	node_delete(root);
+}
+END_TEST
+
+START_TEST (node_subtree_totals)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *dir = node_create("dir", N_DIRECTORY);
+	struct node *a = node_create("a", N_FILE);
+	struct node *b = node_create("b", N_FILE);
+
+	fail_unless (root->tree_dirs == 1 && root->tree_files == 0);
+
+	/* subtrees built before being linked are accounted as a whole */
+	node_add_child(dir, a);
+	node_set_size(a, 100);
+	node_add_child(root, dir);
+	fail_unless (root->tree_bytes == 100);
+	fail_unless (root->tree_files == 1);
+	fail_unless (root->tree_dirs == 2);
+
+	node_add_child(dir, b);
+	node_set_size(b, 50);
+	node_set_size(a, 10);
+	fail_unless (dir->tree_bytes == 60 && root->tree_bytes == 60);
+	fail_unless (root->tree_files == 2);
+
+	node_delete_child(dir, a);
+	fail_unless (root->tree_bytes == 50 && root->tree_files == 1);
+
+	node_delete_child(root, dir);
+	fail_unless (root->tree_bytes == 0);
+	fail_unless (root->tree_files == 0);
+	fail_unless (root->tree_dirs == 1);
+
+	node_delete(root);
+}
+END_TEST
+
+START_TEST (node_move_and_rename)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *dir = node_create("dir", N_DIRECTORY);
+	struct node *a = node_create("a", N_FILE);
+	struct node *b = node_create("b", N_FILE);
+	struct node *c = node_create("c", N_FILE);
+
+	node_add_child(root, dir);
+	node_add_child(root, a);
+	node_add_child(dir, b);
+	node_add_child(dir, c);
+	node_set_size(a, 10);
+	node_set_size(b, 20);
+
+	/* renaming keeps the children sorted */
+	fail_unless (node_rename(a, "z") == 0);
+	fail_unless (strcmp(node_get_nth_children(root, 1)->name, "z") == 0);
+	fail_unless (node_find_children(root, "a") == NULL);
+	fail_unless (node_find_children(root, "z") == a);
+	fail_unless (node_rename(a, "in valid") == E_INVALID_NAME);
+	fail_unless (root->children_no == 2);
+
+	/* moving updates the father and the totals */
+	fail_unless (node_move(a, dir, NULL) == 0);
+	fail_unless (node_get_father(a) == dir);
+	fail_unless (root->children_no == 1 && dir->children_no == 3);
+	fail_unless (dir->tree_bytes == 30 && root->tree_bytes == 30);
+	fail_unless (node_move(dir, dir, "loop") == E_CONSTRAINT_VIOLATED);
+	fail_unless (node_move(a, a, "x") == E_FILE_CHILD);
+
+	/* an existing file is replaced */
+	fail_unless (node_move(a, dir, "b") == 0);
+	fail_unless (node_find_children(dir, "b") == a);
+	fail_unless (node_find_children(dir, "z") == NULL);
+	fail_unless (dir->children_no == 2);
+	fail_unless (dir->tree_bytes == 10 && root->tree_files == 2);
+
+	/* but not a directory */
+	fail_unless (node_move(c, root, NULL) == 0);
+	fail_unless (node_rename(c, "dir") == E_NAME_EXISTS);
+
+	node_delete(root);
+}
+END_TEST
+
 START_TEST (node_list_creation)
 {
 	struct node_list *nl = NULL;
@@ -237,6 +583,331 @@ START_TEST (node_list_add_siblings)
 END_TEST
 
 
+START_TEST (node_quotas)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *tenant = node_create("tenant", N_DIRECTORY);
+	struct node *other = node_create("other", N_DIRECTORY);
+	struct node *a = node_create("a", N_FILE);
+	struct node *b = node_create("b", N_FILE);
+	struct node *big = node_create("big", N_FILE);
+
+	node_add_child(root, tenant);
+	node_add_child(root, other);
+	node_add_child(tenant, a);
+	node_set_size(big, 1000);
+	node_add_child(other, big);
+
+	fail_unless (node_set_quota(tenant, 500, tenant->tree_files + tenant->tree_dirs, 0) == 0);
+	fail_unless (node_set_quota(tenant, 0, 0, KCACHE_PRIORITIES) == E_OUT_OF_BOUNDS);
+	fail_unless (node_cache_priority(a) == 0);
+	fail_unless (node_cache_priority(big) == KCACHE_DEFAULT_PRIORITY);
+
+	/* limits apply to the whole subtree, whichever way nodes come in */
+	fail_unless (node_add_child(tenant, b) == E_QUOTA);
+	fail_unless (node_find_children(tenant, "b") == NULL);
+	fail_unless (node_quota_check(a, 501, 0) == E_QUOTA);
+	fail_unless (node_quota_check(big, 501, 1) == 0);
+	fail_unless (node_move(big, tenant, NULL) == E_QUOTA);
+	fail_unless (node_get_father(big) == other);
+
+	/* moves within the subtree don't count twice */
+	fail_unless (node_set_quota(tenant, 500, 0, 0) == 0);
+	fail_unless (node_add_child(tenant, b) == 0);
+	fail_unless (node_set_quota(tenant, 0, tenant->tree_files + tenant->tree_dirs, 0) == 0);
+	fail_unless (node_rename(b, "c") == 0);
+
+	node_delete(root);
+}
+END_TEST
+
+START_TEST (node_attributes)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *a = node_create("a", N_FILE);
+	struct node *b = node_create("b", N_FILE);
+	struct node *clone, *found[4];
+
+	node_add_child(root, a);
+	node_add_child(root, b);
+
+	fail_unless (node_setxattr(a, "type", "text/html") == 0);
+	fail_unless (node_setxattr(a, "tenant", "x") == 0);
+	fail_unless (node_setxattr(a, "type", "text/plain") == 0);
+	fail_unless (strcmp(node_getxattr(a, "type"), "text/plain") == 0);
+	fail_unless (strcmp(node_nextxattr(a, NULL), "tenant") == 0);
+	fail_unless (strcmp(node_nextxattr(a, "tenant"), "type") == 0);
+	fail_unless (node_nextxattr(a, "type") == NULL);
+	fail_unless (node_getxattr(b, "type") == NULL);
+	fail_unless (node_setxattr(a, "a=b", "c") == E_INVALID_NAME);
+	fail_unless (node_removexattr(b, "type") == E_NO_ATTR);
+
+	/* nodes which already have the key are indexed too */
+	fail_unless (xattr_index_find("tenant", "x", NULL, found, 4) == E_NO_INDEX);
+	fail_unless (xattr_index_create("tenant", root) == 0);
+	fail_unless (xattr_index_create("tenant", root) == 0);
+	fail_unless (node_setxattr(b, "tenant", "x") == 0);
+	fail_unless (xattr_index_find("tenant", "x", NULL, found, 4) == 2);
+	fail_unless (xattr_index_find("tenant", "y", NULL, found, 4) == 0);
+
+	/* clones are indexed, snapshots and deleted nodes aren't */
+	clone = node_clone(root, "clone");
+	fail_unless (strcmp(node_getxattr(node_find_children(clone, "a"), "type"), "text/plain") == 0);
+	fail_unless (xattr_index_find("tenant", "x", NULL, found, 4) == 4);
+	fail_unless (xattr_index_find("tenant", "x", clone, found, 4) == 2);
+	fail_unless (node_is_below(found[0], clone) && node_is_below(found[1], clone));
+	fail_unless (xattr_index_find("tenant", "x", a, found, 4) == 1 && found[0] == a);
+	node_delete(clone);
+	clone = node_snapshot(root);
+	fail_unless (xattr_index_find("tenant", "x", NULL, found, 4) == 2);
+	fail_unless (node_setxattr(clone, "k", "v") == E_READ_ONLY);
+	node_snapshot_release(clone);
+
+	fail_unless (node_setxattr(a, "tenant", "y") == 0);
+	fail_unless (xattr_index_find("tenant", "x", NULL, found, 4) == 1 && found[0] == b);
+	fail_unless (node_removexattr(b, "tenant") == 0);
+	fail_unless (xattr_index_find("tenant", "x", NULL, found, 4) == 0);
+	node_delete(root);
+	fail_unless (xattr_index_find("tenant", "y", NULL, found, 4) == 0);
+}
+END_TEST
+
+START_TEST (node_attribute_ranges)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *nodes[1000], *found[4];
+	char name[16], value[16];
+	int i;
+
+	fail_unless (xattr_index_create("expires", NULL) == 0);
+	fail_unless (xattr_index_before("missing", 10, NULL, found, 4) == E_NO_INDEX);
+	for (i = 0; i < 1000; i++) {
+		sprintf(name, "n%d", i);
+		nodes[i] = node_create(name, N_FILE);
+		node_add_child(root, nodes[i]);
+		sprintf(value, "%d", 1000 + i % 10);
+		fail_unless (node_setxattr(nodes[i], "expires", value) == 0);
+		fail_unless (node_setxattr(nodes[i], "tenant", "shared") == 0);
+	}
+	fail_unless (node_setxattr(nodes[0], "expires", "never") == 0);
+	fail_unless (node_setxattr(nodes[1], "expires", "0999") == 0);
+
+	/* numbers compare as numbers, anything else is left out */
+	fail_unless (xattr_index_before("expires", 1000, NULL, found, 4) == 0);
+	fail_unless (xattr_index_before("expires", 1002, root, found, 4) == 198);
+	fail_unless (strcmp(node_getxattr(found[0], "expires"), "1000") == 0);
+	fail_unless (xattr_index_before("expires", 2000, NULL, NULL, 0) == 998);
+	fail_unless (xattr_index_find("expires", "0999", NULL, found, 4) == 1);
+
+	/* thousands of nodes sharing a value come and go one at a time */
+	fail_unless (xattr_index_create("tenant", root) == 0);
+	fail_unless (xattr_index_find("tenant", "shared", NULL, NULL, 0) == 1000);
+	for (i = 0; i < 1000; i += 2)
+		fail_unless (node_removexattr(nodes[i], "tenant") == 0);
+	fail_unless (xattr_index_find("tenant", "shared", NULL, NULL, 0) == 500);
+	for (i = 0; i < 1000; i += 2) {
+		fail_unless (node_unlink_child(root, nodes[i]) == 0);
+		node_delete(nodes[i]);
+	}
+	fail_unless (xattr_index_before("expires", 1001, NULL, found, 4) == 0);
+	fail_unless (xattr_index_before("expires", 1002, NULL, found, 4) == 99);
+
+	node_delete(root);
+	fail_unless (xattr_index_find("tenant", "shared", NULL, NULL, 0) == 0);
+	fail_unless (xattr_index_before("expires", 2000, NULL, NULL, 0) == 0);
+}
+END_TEST
+
+START_TEST (node_expiry)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *dir = node_create("dir", N_DIRECTORY);
+	struct node *sub = node_create("sub", N_FILE);
+	struct node *far = node_create("far", N_FILE);
+	struct node *n;
+	unsigned long now = expire_now();
+	char name[8];
+	int i;
+
+	node_add_child(root, dir);
+	node_add_child(dir, sub);
+	node_add_child(root, far);
+	for (i = 0; i < 10; i++) {
+		sprintf(name, "f%d", i);
+		n = node_create(name, N_FILE);
+		node_add_child(root, n);
+		fail_unless (node_set_ttl(n, 10 + (i % 2) * 5000) == 0);
+	}
+	fail_unless (node_set_ttl(sub, 200) == 0);
+	fail_unless (node_set_ttl(dir, 70) == 0);
+	fail_unless (node_set_ttl(far, 300000) == 0);
+	fail_unless (expire_pending() == 13);
+
+	/* nothing before its time, then in batches */
+	fail_unless (expire_run(now + 9, 100) == 0);
+	fail_unless (expire_run(now + 10, 3) == 3);
+	fail_unless (expire_run(now + 10, 3) == 2);
+	fail_unless (root->children_no == 7);
+
+	/* a directory takes the timers below it with it */
+	fail_unless (expire_run(now + 100, 100) == 2);
+	fail_unless (node_find_children(root, "dir") == NULL);
+	fail_unless (expire_pending() == 6);
+
+	/* timers far away are cascaded down the levels */
+	fail_unless (node_set_ttl(far, 0) == 0);
+	fail_unless (expire_run(now + 5009, 100) == 0);
+	fail_unless (expire_run(now + 5010, 100) == 5);
+	fail_unless (expire_pending() == 0);
+	fail_unless (root->children_no == 1);
+
+	node_delete(root);
+}
+END_TEST
+
+START_TEST (node_expiry_in_batches)
+{
+	struct node *root = node_create("root", N_DIRECTORY);
+	struct node *dir = node_create("dir", N_DIRECTORY);
+	struct node *sub = node_create("sub", N_DIRECTORY);
+	struct node *n;
+	unsigned long now = expire_now();
+	unsigned int deleted = 0, ret;
+	char name[8];
+	int i;
+
+	node_add_child(root, dir);
+	node_add_child(dir, sub);
+	for (i = 0; i < 500; i++) {
+		sprintf(name, "f%d", i);
+		node_add_child((i % 2) ? dir : sub, n = node_create(name, N_FILE));
+	}
+	fail_unless (node_set_ttl(dir, 10) == 0);
+	fail_unless (node_set_ttl(n, 20) == 0);
+
+	/* the subtree goes away at once, but is freed a bit at a time */
+	fail_unless (expire_run(now + 10, 100) == 100);
+	fail_unless (node_find_children(root, "dir") == NULL);
+	fail_unless (root->tree_files == 0 && root->tree_dirs == 1);
+
+	/* timers below it don't fire anymore */
+	while ((ret = expire_run(now + 20, 100)) > 0) {
+		fail_unless (ret <= 100);
+		deleted += ret;
+	}
+	fail_unless (deleted == 502 - 100);
+	fail_unless (expire_pending() == 0);
+
+	node_delete(root);
+}
+END_TEST
+
+START_TEST (node_children_index)
+{
+	struct node *dir, *copy, *node;
+	struct node_list *nl;
+	char name[16], prev[16];
+	int i;
+
+	dir = node_create("dir", N_DIRECTORY);
+	/* inserted out of order, so that the index sees every case */
+	for (i = 0; i < 1000; i++) {
+		snprintf(name, sizeof(name), "n%04d", (i * 7) % 1000);
+		fail_unless (node_add_child(dir, node_create(name, N_FILE)) == 0);
+	}
+	fail_unless (dir->index != NULL);
+	fail_unless (node_add_child(dir, node_create("n0500", N_FILE)) == E_NAME_EXISTS);
+
+	fail_unless (strcmp(node_find_children(dir, "n0999")->name, "n0999") == 0);
+	fail_unless (node_find_children(dir, "n1000") == NULL);
+	fail_unless (strcmp(node_seek_children(dir, "n05")->node->name, "n0500") == 0);
+	fail_unless (strcmp(node_seek_children(dir, "n0500a")->node->name, "n0501") == 0);
+	fail_unless (strcmp(node_seek_children(dir, "")->node->name, "n0000") == 0);
+	fail_unless (node_seek_children(dir, "o") == NULL);
+
+	node = node_find_children(dir, "n0100");
+	fail_unless (node_rename(node, "z") == 0);
+	fail_unless (node_find_children(dir, "n0100") == NULL);
+	fail_unless (node_find_children(dir, "z") == node);
+	fail_unless (strcmp(node_seek_children(dir, "n0100")->node->name, "n0101") == 0);
+
+	for (i = 0; i < 1000; i += 2) {
+		snprintf(name, sizeof(name), "n%04d", i);
+		if ((node = node_find_children(dir, name)) != NULL)
+			node_delete_child(dir, node);
+	}
+	fail_unless (node_find_children(dir, "n0200") == NULL);
+	fail_unless (strcmp(node_seek_children(dir, "n0200")->node->name, "n0201") == 0);
+
+	copy = node_clone(dir, "copy");
+	fail_unless (copy->index != NULL);
+	fail_unless (node_find_children(copy, "n0777") != NULL);
+
+	prev[0] = '\0';
+	for (nl = node_seek_children(copy, ""), i = 0; nl != NULL; nl = nl->next, i++) {
+		fail_unless (strcmp(prev, nl->node->name) < 0);
+		strcpy(prev, nl->node->name);
+	}
+	fail_unless (i == 501);
+
+	node_delete(copy);
+	node_delete(dir);
+}
+END_TEST
+
+START_TEST (node_readdir_batches)
+{
+	struct node *dir, *file;
+	struct node_dir d;
+	struct node_dirent entries[16];
+	char name[16], prev[16] = "";
+	int i, n, total = 0, batches = 0;
+
+	dir = node_create("dir", N_DIRECTORY);
+	file = node_create("file", N_FILE);
+	fail_unless (node_opendir(file, &d) == E_INVALID_TYPE);
+	node_delete(file);
+	fail_unless (node_opendir(dir, &d) == 0);
+	fail_unless (node_readdir(&d, entries, 16) == 0);
+
+	for (i = 0; i < 200; i += 2) {
+		snprintf(name, sizeof(name), "n%03d", i);
+		node_add_child(dir, node_create(name, N_FILE));
+	}
+	node_add_child(dir, node_create("sub", N_DIRECTORY));
+
+	fail_unless (node_opendir(dir, &d) == 0);
+	while ((n = node_readdir(&d, entries, 16)) > 0) {
+		for (i = 0; i < n; i++) {
+			fail_unless (strcmp(prev, entries[i].name) < 0);
+			strcpy(prev, entries[i].name);
+		}
+		total += n;
+
+		/* the cursor survives changes on both sides of it */
+		if (batches++ == 2) {
+			node_add_child(dir, node_create("n001", N_FILE));
+			node_add_child(dir, node_create("n199", N_FILE));
+			node_delete_child(dir, node_find_children(dir, prev));
+		}
+	}
+	fail_unless (total == 102);
+
+	node_seekdir(&d, "n197");
+	fail_unless (node_readdir(&d, entries, 16) == 3);
+	fail_unless (strcmp(entries[0].name, "n198") == 0);
+	fail_unless (entries[0].type == N_FILE && entries[0].size == 0);
+	fail_unless (strcmp(entries[2].name, "sub") == 0);
+	fail_unless (entries[2].type == N_DIRECTORY);
+
+	node_seekdir(&d, NULL);
+	fail_unless (node_readdir(&d, entries, 1) == 1);
+	fail_unless (strcmp(entries[0].name, "n000") == 0);
+
+	node_delete(dir);
+}
+END_TEST
+
 TCase *
 tcase_tree(void) {
 	TCase *tc_tree = tcase_create("Tree tests");
@@ -252,7 +923,23 @@ tcase_tree(void) {
 	tcase_add_test(tc_tree, node_can_get_father);
 	tcase_add_test(tc_tree, node_check_valid_names);
 	tcase_add_test(tc_tree, node_check_invalid_names);
+	tcase_add_test(tc_tree, node_check_long_names);
+	tcase_add_test(tc_tree, node_find_children_by_name);
 	tcase_add_test(tc_tree, node_find_path);
+	tcase_add_test(tc_tree, node_clone_subtree);
+	tcase_add_test(tc_tree, node_snapshot_is_frozen);
+	tcase_add_test(tc_tree, node_delete_while_reading);
+	tcase_add_test(tc_tree, node_rename_while_reading);
+	tcase_add_test(tc_tree, node_parallel_walk);
+	tcase_add_test(tc_tree, node_subtree_totals);
+	tcase_add_test(tc_tree, node_move_and_rename);
+	tcase_add_test(tc_tree, node_quotas);
+	tcase_add_test(tc_tree, node_attributes);
+	tcase_add_test(tc_tree, node_attribute_ranges);
+	tcase_add_test(tc_tree, node_expiry);
+	tcase_add_test(tc_tree, node_expiry_in_batches);
+	tcase_add_test(tc_tree, node_children_index);
+	tcase_add_test(tc_tree, node_readdir_batches);
 
 	return tc_tree;
 }
@@ -3,6 +3,6 @@
 
 #include <check.h>
 
-TCase *test_tree(void);
+TCase *tcase_tree(void);
 
 #endif /* TEST_TREE_H */